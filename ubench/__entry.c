@@ -0,0 +1,165 @@
+#include "usbench.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int main (int argc, char ** argv)
+{
+  static us_t us ;
+  
+  if ( // print the help page
+    2 <= argc && (
+      0 == strcmp(argv[1], "--help") ||
+      0 == strcmp(argv[1], "-h")
+    )
+  ) {
+    fprintf(stderr, "usage: %s [<option>...]\n", argv[0]) ;
+    
+    fprintf(
+      stderr ,
+      "options:\n"
+      "  -h, --help             | print this help page\n"
+      "  -v, --version          | print the version\n"
+      "      --list             | print the cases\n"
+      "      --case <name>      | run only this case\n"
+      "      --time <seconds>   | set the time of a case (default 1)\n"
+      "      --jit              | translate the hot code into host code\n"
+      "      --out <directory>  | write the images into this directory\n"
+      "      --keep             | keep the images\n"
+    ) ;
+    
+    exit(EXIT_SUCCESS) ;
+  }
+  
+  if ( // print the version
+    2 <= argc && (
+      0 == strcmp(argv[1], "--version") ||
+      0 == strcmp(argv[1], "-v")
+    )
+  ) {
+    fprintf(
+      stderr            ,
+      "us %u.%u.%u\n"   ,
+      _US_VERSION_MAJOR ,
+      _US_VERSION_MINOR ,
+      _US_VERSION_PATCH
+    ) ;
+    
+    exit(EXIT_SUCCESS) ;
+  }
+  
+  // scan the arguments
+  
+  const char * only = NULL ;
+  const char * out  = "."  ;
+  double       time = 1.0  ;
+  u8_t         jit  = 0    ;
+  u8_t         keep = 0    ;
+  
+  for (int i = 1 ; i < argc ; ++i) {
+    if (0 == strcmp(argv[i], "--list")) {
+      for (u32_t j = 0 ; j < us_bench_n_cases ; ++j)
+        printf("%-12s | %s\n", us_bench_case[j].name, us_bench_case[j].desc) ;
+      
+      exit(EXIT_SUCCESS) ;
+    } else if (0 == strcmp(argv[i], "--jit"))
+      jit = 1 ;
+    else if (0 == strcmp(argv[i], "--keep"))
+      keep = 1 ;
+    else if (
+      0 == strcmp(argv[i], "--case") ||
+      0 == strcmp(argv[i], "--time") ||
+      0 == strcmp(argv[i], "--out")
+    ) {
+      if (i + 1 != argc) {
+        if (0 == strcmp(argv[i], "--case"))
+          only = argv[i + 1] ;
+        else if (0 == strcmp(argv[i], "--time"))
+          time = strtod(argv[i + 1], NULL) ;
+        else
+          out = argv[i + 1] ;
+        
+        ++i ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else
+      fprintf(stderr, "warning: unknown option `%s` is ignored\n", argv[i]) ;
+  }
+  
+  printf(
+    "%-12s %12s %14s %9s %9s %12s\n",
+    "case", "insts", "clocks", "time (s)", "MIPS", "cycles/inst"
+  ) ;
+  
+  u32_t failed = 0 ;
+  u32_t ran    = 0 ;
+  
+  for (u32_t i = 0 ; i < us_bench_n_cases ; ++i) {
+    const us_bench_case_t * bc = us_bench_case + i ;
+    
+    if (NULL != only && 0 != strcmp(only, bc->name))
+      continue ;
+    
+    ++ran ;
+    
+    // generate and load the image
+    
+    char  fn [4096] ;
+    u64_t insts     ;
+    
+    snprintf(fn, sizeof(fn), "%s/%s.img", out, bc->name) ;
+    
+    if (0 != us_bench_gen(bc, fn, &insts)) {
+      ++failed ;
+      continue ;
+    }
+    
+    memset(&us, 0, sizeof(us_t)) ;
+    
+    if (0 != us_load_img(&us, fn)) {
+      fprintf(stderr, "error: something has gone wrong loading `%s`\n", fn) ;
+      ++failed ;
+      continue ;
+    }
+    
+    if (0 == keep)
+      remove(fn) ;
+    
+    us.opt.max_clocks = (u64_t)-1 ;
+    us.opt.jit        = jit       ;
+    
+    // run the case
+    
+    us_bench_res_t res ;
+    
+    if (0 != us_bench_run(bc, &us, insts, time, &res)) {
+      us_free(&us) ;
+      ++failed ;
+      continue ;
+    }
+    
+    us_free(&us) ;
+    
+    double secs = res.time / 1e9 ;
+    
+    printf(
+      "%-12s %12llu %14llu %9.3f %9.2f ",
+      bc->name, (unsigned long long)res.insts, (unsigned long long)res.clocks,
+      secs, 0 < secs ? res.insts / secs / 1e6 : 0.0
+    ) ;
+    
+    if (0 != res.cycles)
+      printf("%12.2f\n", (double)res.cycles / res.insts) ;
+    else
+      printf("%12s\n", "-") ;
+  }
+  
+  if (0 == ran) {
+    fprintf(stderr, "fatal: unknown case `%s`\n", only) ;
+    exit(EXIT_FAILURE) ;
+  }
+  
+  exit(0 != failed ? EXIT_FAILURE : EXIT_SUCCESS) ;
+}
@@ -0,0 +1,409 @@
+#include "usbench.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+// =============================================================================
+// Benchmarks
+// -----------------------------------------------------------------------------
+// Every case generates an image with the code of a pass, a straight sequence of
+// about `US_BENCH_INSTS` instructions ended by `hlt`. The machine runs a pass
+// until it halts, then the registers are reset and the next pass starts, until
+// the time of the case is over. The images share the same physical layout (see
+// `usbench.h`): in the segmented address space (flag V) every segment index is
+// mapped by the same descriptor, at `US_BENCH_SEG`.
+// -----------------------------------------------------------------------------
+//   alu-reg    | add, sub and cmp between every pair of registers (ModRM mod 3)
+//   alu-mem    | add, sub and cmp with every ModRM/SIB addressing mode of the
+//              | memory operands: [disp32], [base], [base + disp8/32],
+//              | [base + index * scale (+ disp8/32)], [index * scale + disp32]
+//              | and [SIB + disp32] with no base and no index (SI is the base,
+//              | BP the index)
+//   stream     | movs, stos, cmps and scas one element at a time (`us_read` and
+//              | `us_write`)
+//   stream-rep | rep movs of 4096 elements (the bulk path)
+//   int        | int 0x20 and its `iret`
+//   *-v        | the same in the segmented address space
+// -----------------------------------------------------------------------------
+// Generate an image:
+//   1. write the segment descriptor, the ISR of `int 0x20` and the constants
+//   2. emit the code of a pass
+//   3. write the header and the kernel (the memory up to the code end)
+// Run a case:
+//   1. reset the registers (the clock is kept)
+//   2. run the passes and count them up to the time of the case (checked
+//      every `US_BENCH_CHECK` passes)
+//   3. sum the executed instructions, the clocks, the time and the host cycles
+// =============================================================================
+
+// operation codes of the ALU cases (with their size prefix)
+static const u8_t __alu_op [12][2] = {
+  { 0x00, 0x01 }, { 0x00, 0x03 }, { 0x00, 0x05 }, // add, add, sub
+  { 0x00, 0x07 }, { 0x00, 0x0B }, { 0x00, 0x0D }, // sub, cmp, cmp
+  { 0x66, 0x00 }, { 0x66, 0x02 }, { 0x66, 0x04 }, // the same on 8 bits
+  { 0x66, 0x06 }, { 0x66, 0x0A }, { 0x66, 0x0C }
+} ;
+
+u8_t * __bench_u8 (
+  u8_t * pc ,
+  u8_t   b
+)
+{
+  *pc = b ;
+  return pc + 1 ;
+}
+
+u8_t * __bench_u32 (
+  u8_t * pc ,
+  u32_t  d
+)
+{
+  memcpy(pc, &d, sizeof(d)) ;
+  return pc + sizeof(d) ;
+}
+
+u8_t * __bench_op (
+  u8_t * pc ,
+  u64_t  i
+)
+{
+  if (0 != __alu_op[i % 12][0])
+    pc = __bench_u8(pc, __alu_op[i % 12][0]) ;
+  
+  return __bench_u8(pc, __alu_op[i % 12][1]) ;
+}
+
+u64_t __gen_alu_reg (
+  u8_t * code ,
+  u64_t  base
+)
+{
+  (void)base ;
+  
+  u8_t * pc = code ;
+  
+  for (u64_t i = 0 ; i < US_BENCH_INSTS ; ++i) {
+    pc = __bench_op(pc, i) ;
+    pc = __bench_u8(pc, 0xC0 | ((i / 12) & 63)) ; // mod 3, reg, rm
+  }
+  
+  __bench_u8(pc, 0x18) ; // hlt
+  
+  return US_BENCH_INSTS + 1 ;
+}
+
+u64_t __gen_alu_mem (
+  u8_t * code ,
+  u64_t  base
+)
+{
+  u8_t * pc = code ;
+  
+  for (u64_t i = 0 ; i < US_BENCH_INSTS ; ++i) {
+    u32_t disp = base + US_BENCH_DATA + ((i * 4) & 0xFFFF) ;
+    u32_t off  = (i * 4) & 0xFFFF ; // from SI
+    u8_t  reg  = (i / 12) & 3 ;     // AX to BX, SI and BP are the address
+    u8_t  sc   = (i / 9) & 3 ;
+    
+    pc = __bench_op(pc, i) ;
+    
+    switch (i % 9) {
+    case 0 : // [disp32]
+      pc = __bench_u8(pc, (0 << 6) | (reg << 3) | 5) ;
+      pc = __bench_u32(pc, disp) ;
+      break ;
+    
+    case 1 : // [SI]
+      pc = __bench_u8(pc, (0 << 6) | (reg << 3) | US_REG_SI) ;
+      break ;
+    
+    case 2 : // [SI + disp8]
+      pc = __bench_u8(pc, (1 << 6) | (reg << 3) | US_REG_SI) ;
+      pc = __bench_u8(pc, off & 0x7F) ;
+      break ;
+    
+    case 3 : // [SI + disp32]
+      pc = __bench_u8(pc, (2 << 6) | (reg << 3) | US_REG_SI) ;
+      pc = __bench_u32(pc, off) ;
+      break ;
+    
+    case 4 : // [SI + BP * scale]
+      pc = __bench_u8(pc, (0 << 6) | (reg << 3) | 4) ;
+      pc = __bench_u8(pc, (sc << 6) | (US_REG_BP << 3) | US_REG_SI) ;
+      break ;
+    
+    case 5 : // [SI + BP * scale + disp8]
+      pc = __bench_u8(pc, (1 << 6) | (reg << 3) | 4) ;
+      pc = __bench_u8(pc, (sc << 6) | (US_REG_BP << 3) | US_REG_SI) ;
+      pc = __bench_u8(pc, off & 0x7F) ;
+      break ;
+    
+    case 6 : // [SI + BP * scale + disp32]
+      pc = __bench_u8(pc, (2 << 6) | (reg << 3) | 4) ;
+      pc = __bench_u8(pc, (sc << 6) | (US_REG_BP << 3) | US_REG_SI) ;
+      pc = __bench_u32(pc, off) ;
+      break ;
+    
+    case 7 : // [BP * scale + disp32] (no base)
+      pc = __bench_u8(pc, (0 << 6) | (reg << 3) | 4) ;
+      pc = __bench_u8(pc, (sc << 6) | (US_REG_BP << 3) | 5) ;
+      pc = __bench_u32(pc, disp) ;
+      break ;
+    
+    default : // [disp32] (no index, no base)
+      pc = __bench_u8(pc, (0 << 6) | (reg << 3) | 4) ;
+      pc = __bench_u8(pc, (0 << 6) | (US_REG_SP << 3) | 5) ;
+      pc = __bench_u32(pc, disp) ;
+      break ;
+    }
+  }
+  
+  __bench_u8(pc, 0x18) ; // hlt
+  
+  return US_BENCH_INSTS + 1 ;
+}
+
+u64_t __gen_stream (
+  u8_t * code ,
+  u64_t  base
+)
+{
+  (void)base ;
+  
+  u8_t * pc = code ;
+  
+  for (u64_t i = 0 ; i < US_BENCH_INSTS ; ++i)
+    pc = __bench_u8(pc, 0x11 + 2 * (i & 3)) ; // movs, stos, cmps, scas
+  
+  __bench_u8(pc, 0x18) ; // hlt
+  
+  return US_BENCH_INSTS + 1 ;
+}
+
+u64_t __gen_stream_rep (
+  u8_t * code ,
+  u64_t  base
+)
+{
+  u8_t * pc = code ;
+  
+  // 16 * 4096 elements of 4 bytes
+  
+  for (u64_t i = 0 ; i < 16 ; ++i) {
+    pc = __bench_u8(pc, 0x01) ; // add CX, [disp32]
+    pc = __bench_u8(pc, 0x0D) ;
+    pc = __bench_u32(pc, base + US_BENCH_CONST) ;
+    pc = __bench_u8(pc, 0x64) ; // rep movs
+    pc = __bench_u8(pc, 0x11) ;
+  }
+  
+  __bench_u8(pc, 0x18) ; // hlt
+  
+  return 2 * 16 + 1 ;
+}
+
+u64_t __gen_int (
+  u8_t * code ,
+  u64_t  base
+)
+{
+  (void)base ;
+  
+  u8_t * pc = code ;
+  
+  for (u64_t i = 0 ; i < US_BENCH_INSTS / 2 ; ++i) {
+    pc = __bench_u8(pc, 0x08) ; // int 0x20
+    pc = __bench_u8(pc, 0x20) ;
+  }
+  
+  __bench_u8(pc, 0x18) ; // hlt
+  
+  return US_BENCH_INSTS + 1 ; // with the `iret`
+}
+
+const us_bench_case_t us_bench_case [] = {
+  { "alu-reg"      , "add/sub/cmp, register operands"       , 0 , __gen_alu_reg    },
+  { "alu-mem"      , "add/sub/cmp, memory operands"         , 0 , __gen_alu_mem    },
+  { "alu-mem-v"    , "add/sub/cmp, memory operands (V)"     , 1 , __gen_alu_mem    },
+  { "stream"       , "movs/stos/cmps/scas, one element"     , 0 , __gen_stream     },
+  { "stream-v"     , "movs/stos/cmps/scas, one element (V)" , 1 , __gen_stream     },
+  { "stream-rep"   , "rep movs, 4096 elements"              , 0 , __gen_stream_rep },
+  { "stream-rep-v" , "rep movs, 4096 elements (V)"          , 1 , __gen_stream_rep },
+  { "int"          , "int 0x20 and iret"                    , 0 , __gen_int        },
+  { "int-v"        , "int 0x20 and iret (V)"                , 1 , __gen_int        }
+} ;
+
+const u32_t us_bench_n_cases = sizeof(us_bench_case) / sizeof(us_bench_case[0]) ;
+
+u64_t __bench_off (
+  const us_bench_case_t * bc
+)
+{
+  // virtual address of the physical address 0
+  return (0 != bc->V) ? -(u64_t)US_BENCH_SEG : 0 ;
+}
+
+u32_t us_bench_gen (
+  const us_bench_case_t * bc    ,
+  const char *            fn    ,
+        u64_t *           insts
+)
+{
+  u64_t  size = US_BENCH_CODE + 8 * US_BENCH_INSTS + 16 ;
+  u8_t * ker  = (u8_t *)calloc(size, sizeof(u8_t)) ;
+  
+  if (NULL == ker) {
+    fprintf(stderr, "error: cannot allocate the image of `%s`\n", bc->name) ;
+    return 1 ;
+  }
+  
+  u64_t base = __bench_off(bc) ;
+  
+  // segment 0: 4 MiB at `US_BENCH_SEG`, P|X|R|W, IOPL 3
+  __bench_u32(ker + US_BENCH_SDT, 0x3F000006) ;
+  
+  // ISR of `int 0x20` (segment 0)
+  __bench_u32(ker + US_BENCH_IDT + 0x20 * sizeof(u64_t), (u32_t)(base + US_BENCH_ISR)) ;
+  __bench_u8(ker + US_BENCH_ISR, 0x09) ; // iret
+  
+  // elements of a `rep movs`
+  __bench_u32(ker + US_BENCH_CONST, 4096) ;
+  
+  // emit the code
+  
+  *insts = bc->gen(ker + US_BENCH_CODE, base) ;
+  
+  // the kernel ends at the last byte of code
+  
+  u64_t ker_size = size ;
+  
+  while (US_BENCH_CODE < ker_size && 0 == ker[ker_size - 1])
+    --ker_size ;
+  
+  FILE * fp = fopen(fn, "wb") ;
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the image `%s`\n", fn) ;
+    free(ker) ;
+    return 1 ;
+  }
+  
+  u8_t  mag_num [4] = { 0x45, 0x45, 0xFA, 0xDE } ;
+  u64_t mem_size    = US_BENCH_MEM >> 10 ; // KiB
+  u64_t ker_addr    = 0 ;
+  u64_t ker_jump    = US_BENCH_CODE ;
+  
+  u64_t n = 0 ;
+  
+  n += fwrite(mag_num, sizeof(mag_num), 1, fp) ;
+  n += fwrite(&mem_size, sizeof(mem_size), 1, fp) ;
+  n += fwrite(&ker_addr, sizeof(ker_addr), 1, fp) ;
+  n += fwrite(&ker_size, sizeof(ker_size), 1, fp) ;
+  n += fwrite(&ker_jump, sizeof(ker_jump), 1, fp) ;
+  n += fwrite(ker, ker_size, 1, fp) ;
+  
+  free(ker) ;
+  
+  if (0 != fclose(fp) || 6 != n) {
+    fprintf(stderr, "error: cannot write the image `%s`\n", fn) ;
+    return 1 ;
+  }
+  
+  return 0 ;
+}
+
+void us_bench_reset (
+  const us_bench_case_t * bc ,
+        us_t *            us
+)
+{
+  u64_t base = __bench_off(bc) ;
+  
+  for (int i = 0 ; i < US_N_REGS ; ++i) {
+    if (US_REG_CLOCK != i)
+      us->ker.reg[i] = 0 ;
+  }
+  
+  for (int i = 0 ; i < US_N_SEGS ; ++i)
+    us->ker.seg[i] = 0 ;
+  
+  us->ker.reg[US_REG_FLAGS] = US_FLAG_1 | US_FLAG_I | ((0 != bc->V) ? US_FLAG_V : 0) ;
+  us->ker.reg[US_REG_IP]    = base + US_BENCH_CODE  ;
+  us->ker.reg[US_REG_SP]    = base + US_BENCH_STACK ;
+  us->ker.reg[US_REG_BP]    = 64                    ; // index of the SIB modes
+  us->ker.reg[US_REG_SI]    = base + US_BENCH_DATA  ;
+  us->ker.reg[US_REG_DI]    = base + US_BENCH_DATA + 0x200000 ;
+  us->ker.reg[US_REG_IDT]   = base + US_BENCH_IDT   ;
+  us->ker.reg[US_REG_SDT]   = US_BENCH_SDT          ; // physical
+  
+  us->lazy.op = US_LAZY_NONE ;
+  us->idle    = 0            ;
+}
+
+u64_t __bench_cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc() ;
+#else
+  return 0 ;
+#endif
+}
+
+u32_t us_bench_run (
+  const us_bench_case_t * bc    ,
+        us_t *            us    ,
+        u64_t             insts ,
+        double            time  ,
+        us_bench_res_t *  res
+)
+{
+  memset(res, 0, sizeof(us_bench_res_t)) ;
+  
+  us_bench_reset(bc, us) ;
+  
+  struct timespec start ;
+  struct timespec end   ;
+  
+  u64_t clock  = us->ker.reg[US_REG_CLOCK] ;
+  u64_t cycles = __bench_cycles() ;
+  
+  timespec_get(&start, TIME_UTC) ;
+  
+  // run the passes
+  
+  for (;;) {
+    u32_t exit = us_run(us, (u64_t)-1) ;
+    
+    if (US_EXIT_IDLE != exit) {
+      fprintf(
+        stderr, "error: case `%s` exit %u interrupt 0x%02X at 0x%012llX\n",
+        bc->name, exit, us->IRQ, (unsigned long long)us->ker.reg[US_REG_IP]
+      ) ;
+      return 1 ;
+    }
+    
+    ++res->passes ;
+    us_bench_reset(bc, us) ;
+    
+    if (0 != res->passes % US_BENCH_CHECK)
+      continue ;
+    
+    timespec_get(&end, TIME_UTC) ;
+    
+    res->time = (u64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec ;
+    
+    if (time * 1e9 <= res->time)
+      break ;
+  }
+  
+  res->insts  = res->passes * insts ;
+  res->clocks = us->ker.reg[US_REG_CLOCK] - clock ;
+  res->cycles = __bench_cycles() - cycles ;
+  
+  return 0 ;
+}
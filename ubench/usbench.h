@@ -0,0 +1,68 @@
+#ifndef _USBENCH_H
+# define _USBENCH_H
+
+# include "../usys/us.h"
+# include <stdio.h>
+
+typedef struct us_bench_case_s us_bench_case_t ;
+typedef struct us_bench_res_s  us_bench_res_t  ;
+
+enum { // physical layout of the images
+  US_BENCH_SDT   = 0x000000 , // segment descriptor of the segment 0
+  US_BENCH_IDT   = 0x001000 , // interrupt descriptor table
+  US_BENCH_CONST = 0x001E00 , // constants read by the code
+  US_BENCH_ISR   = 0x001F00 , // `iret`
+  US_BENCH_CODE  = 0x002000 , // code of a pass, ended by `hlt`
+  US_BENCH_STACK = 0x080000 , // stack top
+  US_BENCH_DATA  = 0x100000 , // streamed data
+  US_BENCH_MEM   = 0x800000 , // memory size
+  US_BENCH_SEG   = 0x000400 , // physical address of the segment 0
+  US_BENCH_INSTS = 1 << 9   , // instructions per pass (fit the caches)
+  US_BENCH_CHECK = 64         // passes between the checks of the time
+} ;
+
+struct us_bench_case_s {
+  const char * name ;
+  const char * desc ;
+  u8_t         V    ; // segmented address space (flag V)
+  
+  // emit the code of a pass at `code`, `base` is the virtual address of the
+  // physical address 0, return the executed instructions
+  
+  u64_t (* gen) (
+    u8_t * code ,
+    u64_t  base
+  ) ;
+} ;
+
+struct us_bench_res_s {
+  u64_t passes ;
+  u64_t insts  ; // executed instructions
+  u64_t clocks ;
+  u64_t time   ; // nanoseconds
+  u64_t cycles ; // host cycles (0 if unknown)
+} ;
+
+extern const us_bench_case_t us_bench_case [] ;
+extern const u32_t           us_bench_n_cases ;
+
+u32_t us_bench_gen (
+  const us_bench_case_t * bc    ,
+  const char *            fn    ,
+        u64_t *           insts
+) ;
+
+void us_bench_reset (
+  const us_bench_case_t * bc ,
+        us_t *            us
+) ;
+
+u32_t us_bench_run (
+  const us_bench_case_t * bc    ,
+        us_t *            us    ,
+        u64_t             insts ,
+        double            time  ,
+        us_bench_res_t *  res
+) ;
+
+#endif
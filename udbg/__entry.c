@@ -27,6 +27,8 @@ int main (int argc, char ** argv)
       "  -h, --help            | print this help page\n"
       "  -v, --version         | print the version\n"
       "      --verbose         | print additional information\n"
+      "      --jit             | translate the hot code into host code\n"
+      "      --huge            | use the huge pages for the memory\n"
       "  -c, --clocks <number> | set the limit of clocks\n"
     ) ;
     
@@ -75,6 +77,10 @@ int main (int argc, char ** argv)
       }
     } else if (0 == strcmp(argv[i], "--verbose"))
       us.opt.verbose = 1 ;
+    else if (0 == strcmp(argv[i], "--jit"))
+      us.opt.jit = 1 ;
+    else if (0 == strcmp(argv[i], "--huge"))
+      us.opt.huge = 1 ;
     else
       img = argv[i] ;
   }
@@ -86,33 +92,50 @@ int main (int argc, char ** argv)
     exit(EXIT_FAILURE) ;
   }
   
-  // load the operating system
+  // load the operating system (a snapshot keeps its options)
+  
+  us_opt_t opt = us.opt ;
+  
   if (0 != us_load_img(&us, img)) {
     fprintf(stderr, "fatal: something has gone wrong loading `%s`\n", img) ;
     exit(EXIT_FAILURE) ;
   }
   
+  us.opt = opt ;
+  
   // start the machine
   us.ker.reg[US_REG_FLAGS] |= US_FLAG_1 ;
   
   // machine loop
-  while (0 != (us.ker.reg[US_REG_FLAGS] & US_FLAG_1)) {
-    u32_t IRQ = us_clock(&us) ;
+  for (;;) {
+    u32_t exit = us_run(&us, (u64_t)-1) ;
     
-    if (US_N_IRQS != IRQ) {
-      if (US_IRQ_BREAKPOINT != IRQ && 0 != us.opt.verbose)
-        fprintf(stderr, "interrupt: 0x%02X\n", us.IRQ) ;
-      else { // start the debug
-        u32_t res = us_debug(&us, &dbg) ;
-        
-        if (res < 0)
-          break ;      
-      }
+    // the machine is halted and nothing can wake it (no event, no other
+    // thread injects interrupts)
+    if (US_EXIT_IDLE == exit) {
+      if (0 != us.opt.verbose)
+        fprintf(stderr, "halted: no event to wait for\n") ;
+      
+      break ;
     }
+    
+    if (US_EXIT_IRQ != exit && US_EXIT_BREAK != exit)
+      break ;
+    
+    if (US_EXIT_BREAK != exit && 0 != us.opt.verbose)
+      fprintf(stderr, "interrupt: 0x%02X\n", us.IRQ) ;
+    else { // start the debug
+      if (US_EXIT_HALT == us_debug(&us, &dbg))
+        break ;
+    }
+    
+    // the limit of clocks has been reached
+    if (US_IRQ_OUT_OF_CLOCKS == us.IRQ)
+      break ;
   }
 
-  // deallocate the memory
-  free(us.mem.data) ;
+  // deallocate the machine
+  us_free(&us) ;
   
   // deallocate the breakpoints
   if (NULL == dbg.breakpointv)
@@ -81,48 +81,21 @@ u32_t __dump_seg (
 )
 {
   if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_V)) {
-    // Segment Descriptor Entry (SDE):
-    // [  0:1  ] size    scale       -> 1, 2, 4, 8
-    // [  2:3  ] size    granularity -> -, KiB, MiB, GiB
-    // [  4:5  ] address scale       -> 1, 2, 4, 8
-    // [  6:7  ] address granularity -> B, KiB, MiB, GiB
-    // [  8:23 ] address offset      -> 1 << 8-bit value
-    // [ 24:31 ] permissions         -> P|X|R|W|IOPL
+    // look up the segment
     
-    // read the SDE from the Segment Descriptor Table (SDT)
-      
-    u16_t segx = us->ker.reg[US_REG_SDT] >> 48 ;
-    u64_t addr = (us->ker.reg[US_REG_SDT] << 16) >> 16 ;
-    
-    u32_t SDE ;
+    us_sde_t * sde ;
     
-    if (
-      US_N_IRQS != us_read(
-        us, segx, addr + _segx * sizeof(SDE), sizeof(SDE), &SDE
-      )
-    ) {
-      fprintf(stderr, "debug: `us_read` failed loading the segment descriptor entry\n") ;
+    if (US_N_IRQS != us_sde_lookup(us, _segx, &sde)) {
+      fprintf(stderr, "debug: `us_sde_lookup` failed loading the segment descriptor entry\n") ;
       return 1 ;
     }
     
-    u64_t size ;
-    
-    // compute the segment physical size
-    
-    size =
-      (1 << ((SDE >> 0) & 3))               * // scale
-      (1 << (10 * (1 << ((SDE >> 2) & 3)))) ; // granularity
-    
-    // compute the segment physical address
-    
-    addr =
-      (1 << ((SDE >> 4) & 3))               * // scale
-      (1 << (10 * (1 << ((SDE >> 6) & 3)))) + // granularity
-      (((SDE >> 8) & 0xFF) << 2)            ; // offset
+    u64_t addr = sde->addr ;
+    u64_t size = sde->size ;
     
     // generate the permissions string
     
-    u8_t perm = (SDE >> 24) & 15 ;
+    u8_t perm = sde->perm | (sde->IOPL << 4) ;
     char pstr [] = "---- -" ;
     
     // presence
@@ -199,6 +172,9 @@ u32_t __dump_reg (
   if (US_REG_FLAGS == regx) {
     char fstr [] = "-------0--0-0---" ;
     
+    // compute the pending flags
+    us_flags(us) ;
+    
     if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_IB))
       fstr[0] = 'B' ;
     if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_V))
@@ -387,6 +363,9 @@ u32_t us_debug (
   us_dbg_t * dbg
 )
 {
+  // return `US_EXIT_BREAK` to resume the machine (`quit`), `US_EXIT_HALT` to
+  // stop it (end of the input)
+  
   static char input [1024 + 1] ;
   int quit = 0 ;
   int ip = -1 ;
@@ -398,8 +377,11 @@ u32_t us_debug (
     do {
       int chr = fgetc(stdin) ;
       
+      if (EOF == chr)
+        return US_EXIT_HALT ;
+      
       ++ip ;
-      if (EOF == chr || '\n' == chr)
+      if ('\n' == chr)
         input[ip] = 0 ;
       else
         input[ip] = (char)chr ;
@@ -487,6 +469,15 @@ u32_t us_debug (
       __dump_reg(us, dbg->fp, US_REG_IDT   , 8) ;
       __dump_reg(us, dbg->fp, US_REG_SDT   , 8) ;
       __dump_reg(us, dbg->fp, US_REG_CLOCK , 8) ;
+    } else if (0 == strcmp(input, "vecs")) {
+      for (int i = 0 ; i < US_N_VECS ; ++i) {
+        fprintf(dbg->fp, "V%d    |", i) ;
+        
+        for (int j = 0 ; j < US_VEC_SIZE ; ++j)
+          fprintf(dbg->fp, " %02X", us->ker.vec[i][j]) ;
+        
+        fprintf(dbg->fp, "\n") ;
+      }
     } else if (0 == strcmp(input, "segs")) {
       __dump_seg(us, dbg->fp, us->ker.seg[US_SEG_DATA]  , 0, -1) ;
       __dump_seg(us, dbg->fp, us->ker.seg[US_SEG_EXTRA] , 0, -1) ;
@@ -496,5 +487,5 @@ u32_t us_debug (
       fprintf(stderr, "debug: unknown command `%s`\n", input) ;
   } while (0 == quit) ;
   
-  return 0 ;
+  return US_EXIT_BREAK ;
 }
@@ -5,10 +5,11 @@
 
 int main (int argc, char ** argv)
 {
-  static us_t us ;
+  static us_t       us    ;
+  static us_fleet_t fleet ;
 
   // check the arguments
-  if (2 != argc) {
+  if (argc < 2) {
     fprintf(stderr, "fatal: no image\n") ;
     fprintf(stderr, "usage: %s [<option>...] <image>\n", argv[0]) ;
     exit(EXIT_FAILURE) ;
@@ -23,10 +24,26 @@ int main (int argc, char ** argv)
     fprintf(
       stderr ,
       "options:\n"
-      "  -h, --help            | print this help page\n"
-      "  -v, --version         | print the version\n"
-      "      --verbose         | print additional information\n"
-      "  -c, --clocks <number> | set the limit of clocks\n"
+      "  -h, --help             | print this help page\n"
+      "  -v, --version          | print the version\n"
+      "      --verbose          | print additional information\n"
+      "      --jit              | translate the hot code into host code\n"
+      "      --huge             | use the huge pages for the memory\n"
+      "  -c, --clocks <number>  | set the limit of clocks\n"
+      "      --fleet            | run every image in its own machine\n"
+      "      --threads <number> | set the host threads of the fleet\n"
+      "      --quantum <number> | set the clocks per turn of a machine\n"
+      "      --turn <number>    | set the clocks per turn of the next image\n"
+      "      --save <snapshot>  | save the machine when it stops\n"
+      "      --prof <file>      | save the profile (CSV) when it stops\n"
+      "      --sample <file>    | sample CS:IP into a file (CSV)\n"
+      "      --period <number>  | set the clocks between the samples\n"
+      "      --hz <number>      | sample on a host timer (CPU time) instead\n"
+      "      --trace <file>     | trace the execution into a file (binary)\n"
+      "      --lz               | compress the trace\n"
+      "      --dump <trace>     | print a trace (CSV) and exit\n"
+      "      --record <log>     | log the inputs from the host\n"
+      "      --replay <log>     | replay the inputs of a log\n"
     ) ;
     
     exit(EXIT_SUCCESS) ;
@@ -47,6 +64,16 @@ int main (int argc, char ** argv)
     exit(EXIT_SUCCESS) ;
   }
   
+  // print a trace
+  if (0 == strcmp(argv[1], "--dump")) {
+    if (argc < 3) {
+      fprintf(stderr, "fatal: no trace\n") ;
+      exit(EXIT_FAILURE) ;
+    }
+    
+    exit(0 != us_trace_dump(argv[2], stdout) ? EXIT_FAILURE : EXIT_SUCCESS) ;
+  }
+  
   // init the machine
   
   memset(&us, 0, sizeof(us_t)) ;
@@ -54,7 +81,36 @@ int main (int argc, char ** argv)
   
   // scan the arguments
   
-  char * img = NULL ;
+  char * img  = NULL ;
+  char * snap = NULL ;
+  char * prof = NULL ;
+  
+  // the sampling profiler
+  
+  char * sample = NULL ;
+  u64_t  period = 0    ;
+  u32_t  hz     = 0    ;
+  
+  // the trace
+  
+  char * trace = NULL ;
+  u8_t   lz    = 0    ;
+  
+  // the log of the inputs
+  
+  char * record = NULL ;
+  char * replay = NULL ;
+  
+  // the images of the fleet
+  
+  u8_t       has_fleet = 0 ;
+  u64_t      turn      = 0 ; // quantum of the next image
+  us_job_t * job       = (us_job_t *)calloc(argc, sizeof(us_job_t)) ;
+  
+  if (NULL == job) {
+    fprintf(stderr, "fatal: cannot allocate the jobs\n") ;
+    exit(EXIT_FAILURE) ;
+  }
   
   for (int i = 1 ; i < argc ; ++i) {
     if (
@@ -70,8 +126,111 @@ int main (int argc, char ** argv)
       }
     } else if (0 == strcmp(argv[i], "--verbose"))
       us.opt.verbose = 1 ;
-    else
+    else if (0 == strcmp(argv[i], "--jit"))
+      us.opt.jit = 1 ;
+    else if (0 == strcmp(argv[i], "--huge"))
+      us.opt.huge = 1 ;
+    else if (0 == strcmp(argv[i], "--fleet"))
+      has_fleet = 1 ;
+    else if (0 == strcmp(argv[i], "--threads")) {
+      if (i + 1 != argc) {
+        ++i ;
+        fleet.n_threads = strtoul(argv[i], NULL, 10) ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--save")) {
+      if (i + 1 != argc) {
+        ++i ;
+        snap = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--prof")) {
+      if (i + 1 != argc) {
+        ++i ;
+        prof = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--sample")) {
+      if (i + 1 != argc) {
+        ++i ;
+        sample = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--period")) {
+      if (i + 1 != argc) {
+        ++i ;
+        period = strtoull(argv[i], NULL, 10) ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--hz")) {
+      if (i + 1 != argc) {
+        ++i ;
+        hz = strtoul(argv[i], NULL, 10) ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--trace")) {
+      if (i + 1 != argc) {
+        ++i ;
+        trace = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--lz"))
+      lz = 1 ;
+    else if (0 == strcmp(argv[i], "--record")) {
+      if (i + 1 != argc) {
+        ++i ;
+        record = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--replay")) {
+      if (i + 1 != argc) {
+        ++i ;
+        replay = argv[i] ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--quantum")) {
+      if (i + 1 != argc) {
+        ++i ;
+        fleet.quantum = strtoull(argv[i], NULL, 10) ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else if (0 == strcmp(argv[i], "--turn")) {
+      if (i + 1 != argc) {
+        ++i ;
+        turn = strtoull(argv[i], NULL, 10) ;
+      } else {
+        fprintf(stderr, "error: missing argument for option `%s`\n", argv[i]) ;
+        fprintf(stderr, "warning: option `%s` is ignored\n", argv[i]) ;
+      }
+    } else {
       img = argv[i] ;
+      
+      job[fleet.n_jobs].img     = img  ;
+      job[fleet.n_jobs].quantum = turn ;
+      
+      ++fleet.n_jobs ;
+      turn = 0 ;
+    }
   }
   
   // check the image existence
@@ -81,23 +240,121 @@ int main (int argc, char ** argv)
     exit(EXIT_FAILURE) ;
   }
   
-  // load the operating system
+  if (0 != has_fleet) {
+    // the files of a single machine would be shared by the jobs
+    
+    if (
+      NULL != snap || NULL != prof || NULL != sample || NULL != trace ||
+      NULL != record || NULL != replay
+    ) {
+      fprintf(
+        stderr, "fatal: `--save`, `--prof`, `--sample`, `--trace`, `--record` "
+        "and `--replay` cannot be used with `--fleet`\n"
+      ) ;
+      exit(EXIT_FAILURE) ;
+    }
+    
+    // run every image in its own machine
+    
+    fleet.opt = us.opt ;
+    fleet.job = job    ;
+    
+    if (0 != us_fleet_run(&fleet))
+      exit(EXIT_FAILURE) ;
+    
+    for (u32_t i = 0 ; i < fleet.n_jobs ; ++i) {
+      if (0 != job[i].failed)
+        fprintf(stderr, "job %u: `%s` cannot be loaded\n", i, job[i].img) ;
+      else
+        fprintf(
+          stderr, "job %u: `%s` exit %u interrupt 0x%02X clocks %llu\n",
+          i, job[i].img, job[i].exit, job[i].IRQ, (unsigned long long)job[i].clocks
+        ) ;
+    }
+    
+    double time = fleet.time / 1e9 ;
+    
+    fprintf(
+      stderr, "fleet: %u jobs, %u threads, %llu clocks in %.3f s (%.2f MIPS)\n",
+      fleet.n_jobs, fleet.n_threads, (unsigned long long)fleet.clocks, time,
+      0 < time ? fleet.clocks / time / 1e6 : 0.0
+    ) ;
+    
+    free(job) ;
+    
+    exit(EXIT_SUCCESS) ;
+  }
+  
+  free(job) ;
+  
+  // load the operating system (a snapshot keeps its options)
+  
+  us_opt_t opt = us.opt ;
+  
   if (0 != us_load_img(&us, img)) {
     fprintf(stderr, "fatal: something has gone wrong loading `%s`\n", img) ;
     exit(EXIT_FAILURE) ;
   }
   
+  us.opt = opt ;
+  
+  // count the instructions, the accesses and the interrupts
+  if (NULL != prof && 0 != us_prof_init(&us))
+    prof = NULL ;
+  
+  // sample CS:IP (the samples are saved by `us_free`)
+  if (NULL != sample)
+    us_sample_init(&us, sample, period, hz) ;
+  
+  // trace the execution (the trace is closed by `us_free`)
+  if (NULL != trace)
+    us_trace_init(&us, trace, lz) ;
+  
+  // record or replay the inputs from the host (the log is closed by `us_free`)
+  
+  if (NULL != record && 0 != us_record_init(&us, record))
+    exit(EXIT_FAILURE) ;
+  
+  if (NULL != replay && 0 != us_replay_init(&us, replay))
+    exit(EXIT_FAILURE) ;
+  
   // start the machine
   us.ker.reg[US_REG_FLAGS] |= US_FLAG_1 ;
   
   // machine loop
-  while (0 != (us.ker.reg[US_REG_FLAGS] & US_FLAG_1)) {
-    if (US_N_IRQS != us_clock(&us) && 0 != us.opt.verbose)
+  for (;;) {
+    u32_t exit = us_run(&us, (u64_t)-1) ;
+    
+    // the machine is halted and nothing can wake it (no event, no other
+    // thread injects interrupts)
+    if (US_EXIT_IDLE == exit) {
+      if (0 != us.opt.verbose)
+        fprintf(stderr, "halted: no event to wait for\n") ;
+      
+      break ;
+    }
+    
+    if (US_EXIT_IRQ != exit && US_EXIT_BREAK != exit)
+      break ;
+    
+    if (0 != us.opt.verbose)
       fprintf(stderr, "interrupt: 0x%02X\n", us.IRQ) ;
+    
+    // the limit of clocks has been reached
+    if (US_IRQ_OUT_OF_CLOCKS == us.IRQ)
+      break ;
   }
+  
+  // save the machine
+  if (NULL != snap && 0 != us_snapshot_save(&us, snap))
+    fprintf(stderr, "error: something has gone wrong saving `%s`\n", snap) ;
+  
+  // save the profile
+  if (NULL != prof && 0 != us_prof_save(&us, prof))
+    fprintf(stderr, "error: something has gone wrong saving `%s`\n", prof) ;
 
-  // deallocate the memory
-  free(us.mem.data) ;
+  // deallocate the machine
+  us_free(&us) ;
   
   exit(EXIT_SUCCESS) ;
 }
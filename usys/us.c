@@ -4,55 +4,300 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
 // =============================================================================
 // Image Loader
 // -----------------------------------------------------------------------------
+// The image is mapped into the host address space instead of being read, so
+// the kernel is not copied: its pages are mapped copy-on-write from the file
+// into the memory and they are read only when the machine touches them. The
+// memory is shifted inside its mapping to keep the kernel aligned with its file
+// offset, only the first and the last page of the kernel are copied.
+// The memory is reserved but not committed: the host commits a zero-filled page
+// the first time the machine touches it, so only the used memory is resident
+// and a large memory size costs just address space. The transparent huge pages
+// can be requested to reduce the misses of the host TLB.
+// -----------------------------------------------------------------------------
 // Load the operating system image:
-//   1.  open the file
-//   2.  check the magic number (4-byte)
+//   1.  open and map the file
+//   2.  check the magic number (4-byte), load the snapshots of a machine (see
+//       `us_snapshot_load`)
 //   3.  read the memory size (in KiB)
-//   4.  read the kernel address (8-bit)
+//   4.  read the kernel address (8-byte)
 //   5.  read the kernel size (8-byte)
 //   6.  read the kernel entry point (8-byte)
 //   7.  check the bounds
-//   8.  allocate the memory 
-//   9.  read the kernel from the image and write it into the memory using the
-//       previous address
-//   9.  close the file
-//   10. clear the registers and segment registers, instruction data
-//   11. set the instruction pointer to the entry point
+//   8.  reserve the memory (zero-filled)
+//   9.  map the whole pages of the kernel from the file into the memory and
+//       copy the partial ones
+//   10. unmap and close the file
+//   11. clear the registers and segment registers, instruction data
+//   12. set the instruction pointer to the entry point
+// Free the machine:
+//   1. deallocate the baseline and the memory
+//   2. deallocate the translated code, the profilers, the trace and the log
 // =============================================================================
 
+#ifdef _WIN32
+
+u32_t __map_img (
+  const char *  fn   ,
+        int *   fd   ,
+        u8_t ** img  ,
+        u64_t * size
+)
+{
+  FILE * fp = fopen(fn, "rb") ; // Windows needs `b` (binary) flag to work correctly
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the image `%s`\n", fn) ;
+    return 1 ;
+  }
+  
+  fseek(fp, 0, SEEK_END) ;
+  *size = ftell(fp) ;
+  fseek(fp, 0, SEEK_SET) ;
+  
+  *fd  = -1 ;
+  *img = (u8_t *)malloc(*size + 1) ;
+  
+  if (NULL == *img || *size != fread(*img, sizeof(u8_t), *size, fp)) {
+    fclose(fp) ;
+    free(*img) ;
+    fprintf(stderr, "error: cannot read the image `%s`\n", fn) ;
+    return 1 ;
+  }
+  
+  fclose(fp) ;
+  
+  return 0 ;
+}
+
+void __unmap_img (
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  size
+)
+{
+  free(img) ;
+}
+
+u32_t __alloc_mem (
+  us_t * us   ,
+  u64_t  size ,
+  u64_t  skew
+)
+{
+  us->mem.map  = (u8_t *)calloc(size, sizeof(u8_t)) ;
+  us->mem.len  = size                 ;
+  us->mem.data = us->mem.map          ;
+  
+  return NULL == us->mem.map ;
+}
+
+void __free_mem (
+  us_t * us
+)
+{
+  free(us->mem.map) ;
+}
+
+void __map_mem (
+  us_t * us   ,
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  off  ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  memcpy(us->mem.data + addr, img + off, size) ;
+}
+
+u64_t __page_size (void)
+{
+  return 1 ;
+}
+
+#else
+
+u32_t __map_img (
+  const char *  fn   ,
+        int *   fd   ,
+        u8_t ** img  ,
+        u64_t * size
+)
+{
+  struct stat st ;
+  
+  *fd = open(fn, O_RDONLY) ;
+  
+  if (-1 == *fd) {
+    fprintf(stderr, "error: cannot open the image `%s`\n", fn) ;
+    return 1 ;
+  }
+  
+  if (0 != fstat(*fd, &st)) {
+    close(*fd) ;
+    fprintf(stderr, "error: cannot stat the image `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  *size = st.st_size ;
+  
+  if (0 == *size) {
+    close(*fd) ;
+    *img = NULL ;
+    return 0 ;
+  }
+  
+  void * map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, *fd, 0) ;
+  
+  if (MAP_FAILED == map) {
+    close(*fd) ;
+    fprintf(stderr, "error: cannot map the image `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  *img = (u8_t *)map ;
+  
+  return 0 ;
+}
+
+void __unmap_img (
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  size
+)
+{
+  if (NULL != img)
+    munmap(img, size) ;
+  
+  close(fd) ;
+}
+
+u64_t __page_size (void)
+{
+  return (u64_t)sysconf(_SC_PAGESIZE) ;
+}
+
+u32_t __alloc_mem (
+  us_t * us   ,
+  u64_t  size ,
+  u64_t  skew
+)
+{
+  // reserve the address space only, the pages are committed and zero-filled
+  // by the host on their first touch
+  void * map = mmap(
+    NULL, skew + size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+  ) ;
+  
+  if (MAP_FAILED == map)
+    return 1 ;
+  
+# ifdef MADV_HUGEPAGE
+  if (0 != us->opt.huge && 0 != madvise(map, skew + size, MADV_HUGEPAGE))
+    fprintf(stderr, "warning: cannot use the huge pages: %s\n", strerror(errno)) ;
+# endif
+  
+  us->mem.map  = (u8_t *)map        ;
+  us->mem.len  = skew + size        ;
+  us->mem.data = us->mem.map + skew ;
+  
+  return 0 ;
+}
+
+void __free_mem (
+  us_t * us
+)
+{
+  if (NULL != us->mem.map)
+    munmap(us->mem.map, us->mem.len) ;
+}
+
+void __map_mem (
+  us_t * us   ,
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  off  ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  u64_t page = __page_size() ;
+  
+  u64_t lo = (u64_t)(us->mem.data + addr) ;
+  u64_t hi = lo + size ;
+  
+  // whole pages of the memory
+  u64_t first = (lo + page - 1) & ~(page - 1) ;
+  u64_t last  = hi & ~(page - 1) ;
+  
+  // the file offset must have the same page offset
+  if (first < last && 0 == ((lo - off) & (page - 1))) {
+    void * map = mmap(
+      (void *)first, last - first, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, off + (first - lo)
+    ) ;
+    
+    if (MAP_FAILED != map) {
+      memcpy((u8_t *)lo, img + off, first - lo) ;
+      memcpy((u8_t *)last, img + off + (last - lo), hi - last) ;
+      return ;
+    }
+  }
+  
+  // the memory is smaller than a page or cannot be mapped
+  memcpy((u8_t *)lo, img + off, size) ;
+}
+
+#endif
+
 u32_t us_load_img (
         us_t * us ,
   const char * fn
 )
 {
-  FILE * fp ;
+  int    fd       ;
+  u8_t * img      ;
+  u64_t  img_size ;
   
-#ifdef _WIN32
-  fp = fopen(fn, "rb") ; // Windows needs `b` (binary) flag to work correctly
-#else
-  fp = fopen(fn, "r") ;
-#endif
+  if (0 != __map_img(fn, &fd, &img, &img_size))
+    return 1 ;
   
-  if (NULL == fp) {
-    fprintf(stderr, "error: cannot open the image `%s`\n", fn) ;
+  if (img_size < US_IMG_HEAD) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: cannot read the image header\n") ;
     return 1 ;
   }
   
+  // the image can be a snapshot of a machine
+  if (0x45 == img[0] && 0x45 == img[1] && 0x5E == img[2] && 0xAB == img[3]) {
+    __unmap_img(fd, img, img_size) ;
+    return us_snapshot_load(us, fn) ;
+  }
+  
   // image follows the big endian byte order
   
   u8_t mag_num [4] ;
-  mag_num[0] = fgetc(fp) ;
-  mag_num[1] = fgetc(fp) ;
-  mag_num[2] = fgetc(fp) ;
-  mag_num[3] = fgetc(fp) ;
+  mag_num[0] = img[0] ;
+  mag_num[1] = img[1] ;
+  mag_num[2] = img[2] ;
+  mag_num[3] = img[3] ;
   
   if (
     0x45 != mag_num[0] || 0x45 != mag_num[1] ||
-    0xFA != mag_num[2] || 0xDE != mag_num[3] ||
+    0xFA != mag_num[2] || 0xDE != mag_num[3]
   ) {
+    __unmap_img(fd, img, img_size) ;
     fprintf(
       stderr, "error: unknown image magic number 0x%02X%02X%02X%02X\n",
       mag_num[0], mag_num[1], mag_num[2], mag_num[3]
@@ -67,68 +312,50 @@ u32_t us_load_img (
   u64_t ker_size ;
   u64_t ker_jump ;
   
-  if (1 != fread(&mem_size, sizeof(u64_t), 1, fp)) {
-    fclose(fp) ;
-    fprintf(stderr, "error: cannot read the memory size: %s", strerror(errno)) ;
-    return 1 ;
-  }
+  memcpy(&mem_size, img +  4, sizeof(u64_t)) ;
+  memcpy(&ker_addr, img + 12, sizeof(u64_t)) ;
+  memcpy(&ker_size, img + 20, sizeof(u64_t)) ;
+  memcpy(&ker_jump, img + 28, sizeof(u64_t)) ;
   
   mem_size <<= 10 ; // `mem_size` * 1 KiB
   
-  if (1 != fread(&ker_addr, sizeof(u64_t), 1, fp)) {
-    fclose(fp) ;
-    fprintf(stderr, "error: cannot read the kernel address: %s", strerror(errno)) ;
-    return 1 ;
-  }
-  
-  if (1 != fread(&ker_size, sizeof(u64_t), 1, fp)) {
-    fclose(fp) ;
-    fprintf(stderr, "error: cannot read the kernel size: %s", strerror(errno)) ;
-    return 1 ;
-  }
-  
-  if (1 != fread(&ker_jump, sizeof(u64_t), 1, fp)) {
-    fclose(fp) ;
-    fprintf(stderr, "error: cannot read the kernel entry point\n") ;
-    return 1 ;
-  }
-  
   // check the bounds
   
-  if (mem_size < ker_addr + ker_size) {
-    fclose(fp) ;
+  if (mem_size < ker_addr + ker_size || ker_addr + ker_size < ker_addr) {
+    __unmap_img(fd, img, img_size) ;
     fprintf(stderr, "error: kernel is out of memory\n") ;
     return 1 ;
   }
   
   if (ker_size <= ker_jump) {
-    fclose(fp) ;
+    __unmap_img(fd, img, img_size) ;
     fprintf(stderr, "error: kernel entry point is out of kernel\n") ;
     return 1 ;
   }
   
-  // allocate the memory
-  
-  us->mem.size = mem_size ;
-  us->mem.data = (u8_t *)malloc(mem_size * sizeof(u8_t)) ;
-  
-  if (NULL == us->mem.data) {
-    fprintf(stderr, "error: cannot allocate the memory: %s", strerror(errno)) ;
+  if (img_size - US_IMG_HEAD < ker_size) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: cannot read the kernel: image is truncated\n") ;
     return 1 ;
   }
   
-  // read the kernel
+  // allocate the memory, the kernel has the same page offset as in the file
   
-  if (ker_size != fread(us->mem.data + ker_addr, sizeof(u8_t), ker_size, fp)) {
-    fclose(fp) ;
-    free(us->mem.data) ;
-    fprintf(stderr, "error: cannot read the kernel: %s", strerror(errno)) ;
+  u64_t skew = (US_IMG_HEAD - ker_addr) & (__page_size() - 1) ;
+  
+  us->mem.size = mem_size ;
+  
+  if (0 != __alloc_mem(us, mem_size, skew)) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: cannot allocate the memory: %s\n", strerror(errno)) ;
     return 1 ;
   }
   
-  // close the image
+  // map the kernel
+  __map_mem(us, fd, img, US_IMG_HEAD, ker_addr, ker_size) ;
   
-  fclose(fp) ;
+  // close the image
+  __unmap_img(fd, img, img_size) ;
   
   // clear the registers, segment registers and instruction data
   
@@ -138,7 +365,14 @@ u32_t us_load_img (
   for (int i = 0 ; i < US_N_SEGS ; ++i)
     us->ker.seg[i] = 0 ;
   
-  memset(&us->inst, 0, sizeof(us->inst)) ;
+  memset(&us->spare, 0, sizeof(us->spare)) ;
+  memset(&us->lazy, 0, sizeof(us->lazy)) ;
+  
+  us->inst = &us->spare ;
+  
+  // clear the decoded instructions and segments
+  us_icache_flush(us) ;
+  us_stlb_flush(us) ;
   
   // set the entry point
 
@@ -147,6 +381,29 @@ u32_t us_load_img (
   return 0 ;
 }
 
+void us_free (
+  us_t * us
+)
+{
+  // deallocate the baseline and the memory
+  us_baseline_free(us) ;
+  __free_mem(us) ;
+  
+  us->mem.size = 0    ;
+  us->mem.data = NULL ;
+  us->mem.map  = NULL ;
+  us->mem.len  = 0    ;
+  
+  // deallocate the translated code
+  us_jit_free(us) ;
+  
+  // deallocate the profilers, the trace and the log
+  us_prof_free(us) ;
+  us_sample_free(us) ;
+  us_trace_free(us) ;
+  us_replay_free(us) ;
+}
+
 // =============================================================================
 // Memory and Segments
 // -----------------------------------------------------------------------------
@@ -154,21 +411,144 @@ u32_t us_load_img (
 // starts using the physical address space and, then, the operating system
 // switches to the virtual loading its Segment Descriptor Table (SDT)
 // -----------------------------------------------------------------------------
+// Look up the segment:
+//   1. flush the decoded segments if the SDT has changed
+//   2. look up the decoded segment in the Segment TLB (STLB)
+//   If missing:
+//     1. read the Segment Descriptor Entry (SDE) from the SDT (the SDT is in
+//        the physical address space)
+//     2. decode the size, the origin address and the permissions of the
+//        segment and save them into the STLB
 // Convert the address:
 //   1. check if the machine are using the virtualalization
 //   If yes:
-//     1. read the Segment Descriptor Entry (SDE) of the passed segment
-//     2. decode the size and the origin address of the segment
-//     3. check the permissions
-//     4. check the bounds according to the flags
+//     1. look up the segment
+//     2. check the permissions
+//     3. check the bounds according to the flags
 //   If not:
 //     1. check the bounds according to the flags
-// Write/read to/from memory:
+//   Raise the interrupt of the failed check (`__check_addr` only returns it,
+//   so that the bulk operations can fall back to the single elements)
+// Write/read to/from memory (`__access`, inlined in every accessor):
 //   1. convert the virtual address into a physical address
-//   2. write/read the data
+//   2. count and trace the access, if the profiler or the tracer is enabled
+//   3. route the access to the device holding the physical address, if any
+//      (see `usbus.c`)
+//   4. (only writing) invalidate the decoded data and mark the dirty pages
+//   5. write/read the data with a single load or store for the fixed sizes
 // =============================================================================
 
-u32_t __convert_addr (
+u32_t us_sde_lookup (
+  us_t *      us   ,
+  u16_t       segx ,
+  us_sde_t ** sde
+)
+{
+  // check the SDT
+  if (us->stlb.SDT != us->ker.reg[US_REG_SDT]) {
+    us_stlb_flush(us) ;
+    us->stlb.SDT = us->ker.reg[US_REG_SDT] ;
+  }
+  
+  us_sde_t * entry = us->stlb.entry + (segx & (US_STLB_SIZE - 1)) ;
+  
+  if (0 != entry->valid && entry->segx == segx) {
+    *sde = entry ;
+    return US_N_IRQS ;
+  }
+  
+  // Segment Descriptor Entry (SDE):
+  // [  0:1  ] size    scale       -> 1, 2, 4, 8
+  // [  2:3  ] size    granularity -> -, KiB, MiB, GiB
+  // [  4:5  ] address scale       -> 1, 2, 4, 8
+  // [  6:7  ] address granularity -> B, KiB, MiB, GiB
+  // [  8:23 ] address offset      -> 1 << 8-bit value
+  // [ 24:31 ] permissions         -> P|X|R|W|IOPL
+  
+  // read the SDE from the Segment Descriptor Table (SDT)
+  
+  u64_t addr = ((us->ker.reg[US_REG_SDT] << 16) >> 16) + segx * sizeof(u32_t) ;
+  
+  if (us->mem.size < addr + sizeof(u32_t))
+    return US_IRQ_SEGMENT_FAULT ;
+  
+  u32_t SDE ;
+  memcpy(&SDE, us->mem.data + addr, sizeof(SDE)) ;
+  
+  // remember the range of the decoded SDEs
+  
+  if (us->stlb.hi <= us->stlb.lo) {
+    us->stlb.lo = addr ;
+    us->stlb.hi = addr + sizeof(u32_t) ;
+  } else if (addr < us->stlb.lo)
+    us->stlb.lo = addr ;
+  else if (us->stlb.hi < addr + sizeof(u32_t))
+    us->stlb.hi = addr + sizeof(u32_t) ;
+  
+  // compute the segment physical size
+  
+  entry->size =
+    (1 << ((SDE >> 0) & 3))               * // scale
+    (1 << (10 * (1 << ((SDE >> 2) & 3)))) ; // granularity
+  
+  // compute the segment physical address
+  
+  entry->addr =
+    (1 << ((SDE >> 4) & 3))               * // scale
+    (1 << (10 * (1 << ((SDE >> 6) & 3)))) + // granularity
+    (((SDE >> 8) & 0xFF) << 2)            ; // offset
+  
+  entry->perm  = (SDE >> 24) & 15 ;
+  entry->IOPL  = (SDE >> 28) & 3  ;
+  entry->segx  = segx ;
+  entry->valid = 1    ;
+  
+  if (0 != us->opt.verbose) {
+    fprintf(
+      stderr                             ,
+      ">>> Segment 0x%04X :\n"
+      "... | address      : 0x%012llX\n"
+      "... | size         : 0x%012llX\n"
+      "... | permissions  : 0x%02X\n"    ,
+      segx, (unsigned long long)entry->addr, (unsigned long long)entry->size,
+      entry->perm
+    ) ;
+  }
+  
+  *sde = entry ;
+  return US_N_IRQS ;
+}
+
+void us_stlb_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  // check the range of the decoded SDEs
+  if (addr < us->stlb.hi && us->stlb.lo < addr + size) {
+    us_stlb_flush(us) ;
+    
+    // the cached instructions were read through the segments
+    us_icache_flush(us) ;
+  }
+}
+
+void us_stlb_flush (
+  us_t * us
+)
+{
+  for (int i = 0 ; i < US_STLB_SIZE ; ++i)
+    us->stlb.entry[i].valid = 0 ;
+  
+  us->stlb.lo = 0 ;
+  us->stlb.hi = 0 ;
+  
+  // the cached ISRs were read through the segments
+  us_idt_flush(us) ;
+}
+
+static inline u32_t __translate (
   us_t *  us    ,
   u16_t   _segx ,
   u64_t * _addr ,
@@ -177,124 +557,176 @@ u32_t __convert_addr (
 )
 {
   if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_V)) {
-    // Segment Descriptor Entry (SDE):
-    // [  0:1  ] size    scale       -> 1, 2, 4, 8
-    // [  2:3  ] size    granularity -> -, KiB, MiB, GiB
-    // [  4:5  ] address scale       -> 1, 2, 4, 8
-    // [  6:7  ] address granularity -> B, KiB, MiB, GiB
-    // [  8:23 ] address offset      -> 1 << 8-bit value
-    // [ 24:31 ] permissions         -> P|X|R|W|IOPL
-    
-    // read the SDE from the Segment Descriptor Table (SDT)
-      
-    u16_t segx = us->ker.reg[US_REG_SDT] >> 48 ;
-    u64_t addr = (us->ker.reg[US_REG_SDT] << 16) >> 16 ;
-    
-    u32_t SDE ;
-    
-    if (
-      US_N_IRQS != us_read(
-        us, segx, addr + _segx * sizeof(SDE), sizeof(SDE), &SDE
-      )
-    ) // raise a special interrupt
-      return us_int(us, US_IRQ_SEGMENT_FAULT) ;
-    
-    u64_t size ;
-    
-    // compute the segment physical size
-    
-    size =
-      (1 << ((SDE >> 0) & 3))               * // scale
-      (1 << (10 * (1 << ((SDE >> 2) & 3)))) ; // granularity
+    // look up the segment
     
-    // compute the segment physical address
+    us_sde_t * sde ;
     
-    addr =
-      (1 << ((SDE >> 4) & 3))               * // scale
-      (1 << (10 * (1 << ((SDE >> 6) & 3)))) + // granularity
-      (((SDE >> 8) & 0xFF) << 2)            ; // offset
-    
-    if (0 != us->opt.verbose) {
-      fprintf(
-        stderr                             ,
-        ">>> Segment 0x%04X :\n"
-        "... | address      : 0x%012llX\n"
-        "... | size         : 0x%012llX\n"
-        "... | permissions  : 0x%02X\n"    ,
-        addr, size, ((SDE >> 24) & 15)
-      ) ;
-    }
+    if (US_N_IRQS != us_sde_lookup(us, _segx, &sde)) // a special interrupt
+      return US_IRQ_SEGMENT_FAULT ;
     
     // check permissions and privilege level
     
     _perm |= US_SEG_PERM_P ;
     
     if (
-      (_perm & ((SDE >> 24) & 15)) != _perm                       || // check permissions
-      ((SDE >> 28) & 3) < ((us->ker.reg[US_REG_FLAGS] >> 12) & 3)    // check privilege level
-    ) // raise the interrupt
-      return us_int(us, US_IRQ_SEGMENT_PROTECT) ;
+      (_perm & sde->perm) != _perm                               || // check permissions
+      sde->IOPL < ((us->ker.reg[US_REG_FLAGS] >> 12) & 3)           // check privilege level
+    ) // the interrupt
+      return US_IRQ_SEGMENT_PROTECT ;
     
     // check bounds
     
     if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_IB)) {
       // check address
-      if (size < *_addr)
-        return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+      if (sde->size < *_addr)
+        return US_IRQ_SEGMENT_FAULT ;
     
       // resize the data
-      if (size < *_addr + *_size)
-        *_size = size - *_addr ;
-    } else if (size < *_addr + *_size)
-      return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+      if (sde->size < *_addr + *_size)
+        *_size = sde->size - *_addr ;
+    } else if (sde->size < *_addr + *_size)
+      return US_IRQ_SEGMENT_FAULT ;
     
     // set the physical address
-    *_addr += addr ;
+    *_addr += sde->addr ;
   } else {
     if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_IB)) {
       // check address
       if (us->mem.size < *_addr)
-        return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+        return US_IRQ_SEGMENT_FAULT ;
     
       // resize the data
       if (us->mem.size < *_addr + *_size)
         *_size = us->mem.size - *_addr ;
     } else if (us->mem.size < *_addr + *_size)
-      return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+      return US_IRQ_SEGMENT_FAULT ;
   }
   
   return US_N_IRQS ;
 }
 
-u32_t us_write (
-        us_t * us   ,
-        u16_t  segx ,
-        u64_t  addr ,
-        u64_t  size ,
-  const any_t  data
+u32_t __check_addr (
+  us_t *  us    ,
+  u16_t   _segx ,
+  u64_t * _addr ,
+  u64_t * _size ,
+  u32_t   _perm
+)
+{
+  return __translate(us, _segx, _addr, _size, _perm) ;
+}
+
+u32_t __convert_addr (
+  us_t *  us    ,
+  u16_t   _segx ,
+  u64_t * _addr ,
+  u64_t * _size ,
+  u32_t   _perm
+)
+{
+  u32_t IRQ = __translate(us, _segx, _addr, _size, _perm) ;
+  
+  if (US_N_IRQS != IRQ)
+    return us_int(us, IRQ) ;
+  
+  return US_N_IRQS ;
+}
+
+void __mark_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  // invalidate the decoded instructions, segments and ISRs overwritten
+  us_icache_write(us, addr, size) ;
+  us_stlb_write(us, addr, size) ;
+  us_idt_write(us, addr, size) ;
+  
+  if (NULL != us->base.dirty)
+    us_dirty_write(us, addr, size) ;
+}
+
+static inline u8_t * __access (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u64_t * size ,
+  u32_t   perm ,
+  any_t   data ,
+  u32_t * IRQ
 )
 {
   // convert the virtual address `segx`:`addr` to a physical address
-  if (US_N_IRQS != __convert_addr(us, segx, &addr, &size, US_SEG_PERM_W))
-    return us->IRQ ;
+  
+  *IRQ = __translate(us, segx, &addr, size, perm) ;
+  
+  if (US_N_IRQS != *IRQ) {
+    us_int(us, *IRQ) ;
     
-  // write `data` into the memory
+    *IRQ = us->IRQ ;
+    return NULL ;
+  }
+  
+  // the slow features
+  
+  u32_t w = US_SEG_PERM_W == perm ;
+  
+  __prof_mem(us, segx, w, 1) ;
+  __trace_mem(us, segx, w, addr, *size) ;
+  
+  // route the access to the device
+  if (__on_bus(us, addr, *size)) {
+    *IRQ = w ? __bus_write(us, addr, *size, data) : __bus_read(us, addr, *size, data) ;
+    return NULL ;
+  }
   
-  u8_t * dst = (u8_t *)(us->mem.data + addr) ;
-  u8_t * src = (u8_t *)data ;
+  // invalidate the decoded instructions, segments and ISRs overwritten by `data`
+  if (0 != w)
+    __mark_write(us, addr, *size) ;
   
   if (0 != us->opt.verbose) {
     fprintf(
-      stderr                                        ,
-      ">>> Write at 0x%012llX (size: %llu bytes)\n" ,
-      addr, size
+      stderr                                      ,
+      ">>> %s at 0x%012llX (size: %llu bytes)\n" ,
+      w ? "Write" : "Read", (unsigned long long)addr, (unsigned long long)*size
     ) ;
   }
   
-  for (u64_t i = 0 ; i < size ; ++i)
-    dst[i] = src[i] ;
+  return us->mem.data + addr ;
+}
+
+static inline void __copy (
+        any_t  dst  ,
+  const any_t  src  ,
+        u64_t  size ,
+        u64_t  n
+)
+{
+  // a fixed size `n` is a single load or store
+  if (n == size)
+    memcpy(dst, src, n) ;
+  else if (size < n) // resized by the bounds
+    memcpy(dst, src, size) ;
+}
+
+u32_t us_write (
+        us_t * us   ,
+        u16_t  segx ,
+        u64_t  addr ,
+        u64_t  size ,
+  const any_t  data
+)
+{
+  u32_t IRQ ;
+  
+  u8_t * dst = __access(us, segx, addr, &size, US_SEG_PERM_W, (any_t)data, &IRQ) ;
   
-  return US_N_IRQS ;
+  // the host `memcpy` is vectorized for the large data
+  if (NULL != dst)
+    memcpy(dst, data, size) ;
+  
+  return IRQ ;
 }
 
 u32_t us_read (
@@ -305,57 +737,197 @@ u32_t us_read (
   any_t  data
 )
 {
-  // convert the virtual address `segx`:`addr` to a physical address
-  if (US_N_IRQS != __convert_addr(us, segx, &addr, &size, US_SEG_PERM_R))
-    return us->IRQ ;
-    
-  // read `data` from memory
-  
-  u8_t * dst = (u8_t *)data ;
-  u8_t * src = (u8_t *)(us->mem.data + addr) ;
+  u32_t IRQ ;
   
-  if (0 != us->opt.verbose) {
-    fprintf(
-      stderr                                       ,
-      ">>> Read at 0x%012llX (size: %llu bytes)\n" ,
-      addr, size
-    ) ;
-  }
+  u8_t * src = __access(us, segx, addr, &size, US_SEG_PERM_R, data, &IRQ) ;
   
-  for (u64_t i = 0 ; i < size ; ++i)
-    dst[i] = src[i] ;
+  // the host `memcpy` is vectorized for the large data
+  if (NULL != src)
+    memcpy(data, src, size) ;
   
-  return US_N_IRQS ;
+  return IRQ ;
 }
 
+// fixed size accessors of the interpreter, the size is known at compile time
+// so the copy is a single load or store
+
+#define _US_WRITE_N(__bits)                                                    \
+  u32_t us_write##__bits (                                                     \
+    us_t *         us   ,                                                      \
+    u16_t          segx ,                                                      \
+    u64_t          addr ,                                                      \
+    u##__bits##_t  data                                                        \
+  )                                                                            \
+  {                                                                            \
+    u32_t IRQ                 ;                                                \
+    u64_t size = sizeof(data) ;                                                \
+                                                                               \
+    u8_t * dst = __access(us, segx, addr, &size, US_SEG_PERM_W, &data, &IRQ) ; \
+                                                                               \
+    if (NULL != dst)                                                           \
+      __copy(dst, &data, size, sizeof(data)) ;                                 \
+                                                                               \
+    return IRQ ;                                                               \
+  }
+
+#define _US_READ_N(__bits)                                                     \
+  u32_t us_read##__bits (                                                      \
+    us_t *          us   ,                                                     \
+    u16_t           segx ,                                                     \
+    u64_t           addr ,                                                     \
+    u##__bits##_t * data                                                       \
+  )                                                                            \
+  {                                                                            \
+    u32_t IRQ                  ;                                               \
+    u64_t size = sizeof(*data) ;                                               \
+                                                                               \
+    u8_t * src = __access(us, segx, addr, &size, US_SEG_PERM_R, data, &IRQ) ;  \
+                                                                               \
+    if (NULL != src)                                                           \
+      __copy(data, src, size, sizeof(*data)) ;                                 \
+                                                                               \
+    return IRQ ;                                                               \
+  }
+
+_US_WRITE_N( 8)
+_US_WRITE_N(16)
+_US_WRITE_N(32)
+_US_WRITE_N(64)
+
+_US_READ_N( 8)
+_US_READ_N(16)
+_US_READ_N(32)
+_US_READ_N(64)
+
 // =============================================================================
 // Interrupt
 // -----------------------------------------------------------------------------
+// The ISRs are cached once read from the IDT, until the register IDT, the
+// address space or the IDT itself changes (an ISR read from a device is not
+// cached). The context is pushed and popped as a single frame, the far pointer
+// at the top of the stack, then the lower 32-bit of the register FLAGS.
+// -----------------------------------------------------------------------------
 // Interrupt:
-//   1. read from memory the interrupt service routine
-//   2. push onto the stack the basic context:
-//     1. push the register FLAGS (32-bit) onto the stack
-//     2. assemble the segment register CODE with the register IP to construct
+//   1. look up the interrupt service routine in the cache or read it through
+//      the accessors (devices, profiler and trace included)
+//   2. push onto the stack the frame of the basic context:
+//     1. assemble the segment register CODE with the register IP to construct
 //        the far pointer (16:48-bit)
-//     3. push the constructed far pointer (64-bit) onto the stack
+//     2. push the constructed far pointer (64-bit) and the register FLAGS
+//        (32-bit) onto the stack
 //   3. change the interrupt enable flag to avoid that the called interrupt
 //      can raise another interrupt without permission
 //   4. disassemble the far pointer of the interrupt service routine into the
 //      destination segment and offset
 //   5. set the segment register CODE and the register IP
 // Return from interrupt:
-//   1. pop the return far address from the stack
+//   1. pop the frame of the basic context from the stack
 //   2. disassemble the far pointer of the previous process into the destination
 //      segment and offset
 //   3. set the segment register CODE and the register IP
-//   4. pop the lower 32-bit of the register FLAGS from the stack
+//   4. set the lower 32-bit of the register FLAGS
 // =============================================================================
 
+enum {
+  US_INT_FRAME = sizeof(u64_t) + sizeof(u32_t) // far pointer and FLAGS
+} ;
+
+u32_t us_idt_lookup (
+  us_t *  us  ,
+  u32_t   IRQ ,
+  u64_t * ISR
+)
+{
+  u64_t flags = us->ker.reg[US_REG_FLAGS] & (US_FLAG_V | US_FLAG_IOPL) ;
+  
+  // check the IDT and the address space
+  if (
+    us->idt.IDT   != us->ker.reg[US_REG_IDT] ||
+    us->idt.SDT   != us->ker.reg[US_REG_SDT] ||
+    us->idt.flags != flags
+  ) {
+    us_idt_flush(us) ;
+    
+    us->idt.IDT   = us->ker.reg[US_REG_IDT] ;
+    us->idt.SDT   = us->ker.reg[US_REG_SDT] ;
+    us->idt.flags = flags                   ;
+  }
+  
+  if (IRQ < US_IDT_SIZE && 0 != us->idt.valid[IRQ]) {
+    *ISR = us->idt.ISR[IRQ] ;
+    return US_N_IRQS ;
+  }
+  
+  // read the ISR from the IDT
+  
+  u16_t segx = us->ker.reg[US_REG_IDT] >> 48 ;
+  u64_t addr = ((us->ker.reg[US_REG_IDT] << 16) >> 16) + IRQ * sizeof(u64_t) ;
+  u64_t size = sizeof(u64_t) ;
+  u32_t res  ;
+  
+  *ISR = 0 ;
+  
+  // through the accessor, so the devices, the profiler and the trace see it
+  
+  u8_t * src = __access(us, segx, addr, &size, US_SEG_PERM_R, ISR, &res) ;
+  
+  // raised, or read from a device (not cached)
+  if (NULL == src)
+    return res ;
+  
+  memcpy(ISR, src, size) ;
+  
+  addr = (u64_t)(src - us->mem.data) ;
+  
+  // the entry resized by the bounds is not cached
+  if (IRQ < US_IDT_SIZE && sizeof(u64_t) == size) {
+    us->idt.valid[IRQ] = 1    ;
+    us->idt.ISR[IRQ]   = *ISR ;
+    
+    if (addr < us->idt.lo)
+      us->idt.lo = addr ;
+    if (us->idt.hi < addr + size)
+      us->idt.hi = addr + size ;
+  }
+  
+  return US_N_IRQS ;
+}
+
+void us_idt_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  // check the range of the cached ISRs
+  if (addr < us->idt.hi && us->idt.lo < addr + size)
+    us_idt_flush(us) ;
+}
+
+void us_idt_flush (
+  us_t * us
+)
+{
+  memset(us->idt.valid, 0, sizeof(us->idt.valid)) ;
+  
+  us->idt.lo = (u64_t)-1 ;
+  us->idt.hi = 0         ;
+}
+
 u32_t us_int (
   us_t * us  ,
   u32_t  IRQ
 )
 {
+  // an interrupt wakes the halted machine
+  us->idle = 0 ;
+  
+  if (NULL != us->prof)
+    ++us->prof->IRQ[IRQ % US_N_IRQS] ;
+  
+  if (NULL != us->tracer)
+    __trace_rec(us, US_TRACE_IRQ, 0, IRQ, 0) ;
+  
   // check if the Interrupt ReQuest (IRQ) is masked
   // then, the VM cannot execute the code of the
   // relative Interrupt Service Routine (ISR)
@@ -363,36 +935,24 @@ u32_t us_int (
     0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_I) ||
     US_IRQ_NON_MASKABLE == IRQ
   ) {    
-    // read the ISR from the Interrupt Descriptor Table (IDT)
-    
-    u16_t segx = us->ker.reg[US_REG_IDT] >> 48 ;
-    u64_t addr = (us->ker.reg[US_REG_IDT] << 16) >> 16 ;
+    // look up the ISR
     
     u64_t ISR ;
     
-    if (
-      US_N_IRQS != us_read(
-        us, segx, addr + IRQ * sizeof(ISR), sizeof(ISR), &ISR
-      )
-    ) // raise a special interrupt
+    if (US_N_IRQS != us_idt_lookup(us, IRQ, &ISR)) // raise a special interrupt
       return us_int(us, US_IRQ_INTERRUPT_FAULT) ;
     
-    // push the basic context onto the stack
+    // push the frame of the basic context onto the stack (with the pending
+    // flags)
     
-    if (
-      US_N_IRQS != us_push(
-        us, sizeof(u32_t), us->ker.reg + US_REG_FLAGS
-      )
-    ) // raise a special interrupt
-      return us_int(us, US_IRQ_INTERRUPT_FAULT) ;
+    u8_t  frame [US_INT_FRAME] ;
+    u64_t addr  = ((u64_t)us->ker.seg[US_SEG_CODE] << 48) | us->ker.reg[US_REG_IP] ;
+    u32_t flags = us_flags(us) ;
     
-    addr = ((u64_t)us->ker.seg[US_SEG_CODE] << 48) | us->ker.reg[US_REG_IP] ;
+    memcpy(frame, &addr, sizeof(addr)) ;
+    memcpy(frame + sizeof(addr), &flags, sizeof(flags)) ;
     
-    if (
-      US_N_IRQS != us_push(
-        us, sizeof(u64_t), &addr
-      )
-    ) // raise a special interrupt
+    if (US_N_IRQS != us_push(us, sizeof(frame), frame)) // raise a special interrupt
       return us_int(us, US_IRQ_INTERRUPT_FAULT) ;
     
     // reset the interrupt enable flag
@@ -402,7 +962,11 @@ u32_t us_int (
     
     us->ker.seg[US_SEG_CODE] = ISR >> 48 ;
     us->ker.reg[US_REG_IP] = (ISR << 16) >> 16 ;
-  }
+    
+    us->ISR = 1 ;
+    ++us->nest  ;
+  } else
+    us->ISR = 0 ;
   
   if (0 != us->opt.verbose) {
     fprintf(
@@ -420,26 +984,31 @@ u32_t us_iret (
   us_t * us
 )
 {
-  // pop the basic context from the stack
+  // pop the frame of the basic context from the stack
   
-  u64_t addr ;
+  u8_t  frame [US_INT_FRAME] ;
+  u64_t addr  ;
+  u32_t flags ;
   
-  if (
-    US_N_IRQS != us_push(
-      us, sizeof(u64_t), &addr
-    )
-  ) // raise a special interrupt
+  if (US_N_IRQS != us_pop(us, sizeof(frame), frame)) // raise a special interrupt
     return us_int(us, US_IRQ_INTERRUPT_FAULT) ;
   
+  memcpy(&addr, frame, sizeof(addr)) ;
+  memcpy(&flags, frame + sizeof(addr), sizeof(flags)) ;
+  
   us->ker.seg[US_SEG_CODE] = addr >> 48 ;
   us->ker.reg[US_REG_IP] = (addr << 16) >> 16 ;
   
-  if (
-    US_N_IRQS != us_pop(
-      us, sizeof(u32_t), us->ker.reg + US_REG_FLAGS
-    )
-  ) // raise a special interrupt
-    return us_int(us, US_IRQ_INTERRUPT_FAULT) ;
+  // the pending flags are overwritten
+  
+  us->ker.reg[US_REG_FLAGS] = ((us->ker.reg[US_REG_FLAGS] >> 32) << 32) | flags ;
+  us->lazy.op = US_LAZY_NONE ;
+  
+  // deliver the interrupts that were masked
+  __sched_unmask(us) ;
+  
+  if (0 != us->nest)
+    --us->nest ;
   
   if (0 != us->opt.verbose) {
     fprintf(
@@ -477,11 +1046,20 @@ u32_t us_push (
   us->ker.reg[US_REG_SP] -= size ;
   
   // write `data` onto the stack
-  if (
-    US_N_IRQS != us_write(
-      us, us->ker.seg[US_SEG_STACK], us->ker.reg[US_REG_SP], size, data
-    )
-  ) // raise a special segment fault interrupt
+  
+  u16_t segx = us->ker.seg[US_SEG_STACK] ;
+  u64_t addr = us->ker.reg[US_REG_SP]    ;
+  u32_t IRQ ;
+  
+  switch (size) {
+  case 1  : IRQ = us_write8 (us, segx, addr, *(u8_t  *)data) ; break ;
+  case 2  : IRQ = us_write16(us, segx, addr, *(u16_t *)data) ; break ;
+  case 4  : IRQ = us_write32(us, segx, addr, *(u32_t *)data) ; break ;
+  case 8  : IRQ = us_write64(us, segx, addr, *(u64_t *)data) ; break ;
+  default : IRQ = us_write  (us, segx, addr, size, data)     ; break ;
+  }
+  
+  if (US_N_IRQS != IRQ) // raise a special segment fault interrupt
     return us_int(us, US_IRQ_STACK_OVERFLOW) ;
   
   return US_N_IRQS ;
@@ -494,11 +1072,20 @@ u32_t us_pop (
 )
 {
   // read `data` from the stack
-  if (
-    US_N_IRQS != us_read(
-      us, us->ker.seg[US_SEG_STACK], us->ker.reg[US_REG_SP], size, data
-    )
-  ) // raise a special segment fault interrupt
+  
+  u16_t segx = us->ker.seg[US_SEG_STACK] ;
+  u64_t addr = us->ker.reg[US_REG_SP]    ;
+  u32_t IRQ ;
+  
+  switch (size) {
+  case 1  : IRQ = us_read8 (us, segx, addr, (u8_t  *)data) ; break ;
+  case 2  : IRQ = us_read16(us, segx, addr, (u16_t *)data) ; break ;
+  case 4  : IRQ = us_read32(us, segx, addr, (u32_t *)data) ; break ;
+  case 8  : IRQ = us_read64(us, segx, addr, (u64_t *)data) ; break ;
+  default : IRQ = us_read  (us, segx, addr, size, data)    ; break ;
+  }
+  
+  if (US_N_IRQS != IRQ) // raise a special segment fault interrupt
     return us_int(us, US_IRQ_STACK_UNDERFLOW) ;
   
   // update the Stack top Pointer (SP)
@@ -3,11 +3,55 @@
 
 # include "usver.h"
 # include "usdef.h"
+# include <stdio.h>
 
-typedef struct us_ker_s us_ker_t ;
-typedef struct us_mem_s us_mem_t ;
-typedef struct us_opt_s us_opt_t ;
-typedef struct us_s     us_t     ;
+# ifndef _WIN32
+#  include <pthread.h>
+#  include <time.h>
+# endif
+
+// host SIMD kernels, define `_US_NO_SIMD` to force the scalar ones
+# if !defined(_US_NO_SIMD)
+#  if defined(__AVX2__)
+#   define _US_AVX2
+#  endif
+#  if defined(__SSE2__)
+#   define _US_SSE2
+#  endif
+#  if defined(__SSSE3__)
+#   define _US_SSSE3
+#  endif
+# endif
+
+typedef struct us_ker_s          us_ker_t          ;
+typedef struct us_mem_s          us_mem_t          ;
+typedef struct us_opt_s          us_opt_t          ;
+typedef struct us_inst_s         us_inst_t         ;
+typedef struct us_icache_entry_s us_icache_entry_t ;
+typedef struct us_icache_s       us_icache_t       ;
+typedef struct us_jit_block_s    us_jit_block_t    ;
+typedef struct us_sde_s          us_sde_t          ;
+typedef struct us_stlb_s         us_stlb_t         ;
+typedef struct us_jit_s          us_jit_t          ;
+typedef struct us_base_s         us_base_t         ;
+typedef struct us_lazy_s         us_lazy_t         ;
+typedef struct us_idt_s          us_idt_t          ;
+typedef struct us_s              us_t              ;
+typedef struct us_job_s          us_job_t          ;
+typedef struct us_fleet_queue_s  us_fleet_queue_t  ;
+typedef struct us_fleet_s        us_fleet_t        ;
+typedef struct us_dev_s          us_dev_t          ;
+typedef struct us_bus_s          us_bus_t          ;
+typedef struct us_event_s        us_event_t        ;
+typedef struct us_sched_s        us_sched_t        ;
+typedef struct us_prof_ip_s      us_prof_ip_t      ;
+typedef struct us_prof_s         us_prof_t         ;
+typedef struct us_sample_s       us_sample_t       ;
+typedef struct us_sampler_s      us_sampler_t      ;
+typedef struct us_trace_rec_s    us_trace_rec_t    ;
+typedef struct us_tracer_s       us_tracer_t       ;
+typedef struct us_replay_rec_s   us_replay_rec_t   ;
+typedef struct us_replay_s       us_replay_t       ;
 
 enum {
   US_SEG_PERM_P = 1 << 0 , 
@@ -79,59 +123,507 @@ enum {
   US_N_IRQS = 0x100
 } ;
 
+enum { // reasons to exit from `us_run`
+  US_EXIT_HALT   , // the flag 1 has been cleared
+  US_EXIT_BREAK  , // breakpoint
+  US_EXIT_IRQ    , // interrupt not handled by an ISR (see `us->IRQ`)
+  US_EXIT_BUDGET , // the clocks of the run are exhausted
+  US_EXIT_HOST   , // stop requested by the host (see `us_stop`)
+  US_EXIT_IDLE   , // halted with no event and no limit of clocks (see `us_wait`)
+  
+  US_N_EXITS
+} ;
+
+enum {
+  US_N_VECS   = 8  , // vector registers
+  US_VEC_SIZE = 16   // bytes of a vector register
+} ;
+
 struct us_ker_s {
   u64_t reg [US_N_REGS] ;
   u16_t seg [US_N_SEGS] ;
+  u8_t  vec [US_N_VECS][US_VEC_SIZE] ; // packed 8/16/32/64-bit integers
+} ;
+
+enum {
+  US_IMG_HEAD = 4 + 4 * sizeof(u64_t) // magic number and header of an image
 } ;
 
 struct us_mem_s {
   u64_t  size ;
   u8_t * data ;
+  u8_t * map  ; // host mapping holding the memory
+  u64_t  len  ; // size of the host mapping
+} ;
+
+enum { // operations updating the flags (see `us_flags`)
+  US_LAZY_NONE , // the register FLAGS is up to date
+  US_LAZY_ADD  ,
+  US_LAZY_SUB
+} ;
+
+struct us_lazy_s { // last operation updating the flags
+  u8_t  op   ;
+  u8_t  size ; // operands size
+  u64_t a    ; // operands
+  u64_t b    ;
 } ;
 
 struct us_opt_s {
   u8_t  verbose : 1 ;
+  u8_t  jit     : 1 ; // translate the hot code into host code
+  u8_t  huge    : 1 ; // back the memory with transparent huge pages
   u64_t max_clocks  ;
 } ;
 
+struct us_inst_s {
+  u64_t  IP        ; // instruction pointer
+  u32_t  cp        ; // `code` pointer
+  u8_t   code [16] ; // read from code segment
+  u8_t   op [2]    ; // opcodes
+  u64_t  oprd_size ; // operands size
+  u64_t  addr_size ; // address size
+  
+  struct { // prefixes
+    u8_t has_SOV  : 1 ; // segment override
+    u8_t has_ZOV  : 1 ; // size override
+    u8_t has_AOV  : 1 ; // address override
+    u8_t has_REP  : 1 ; // repeat the instruction
+    u8_t REP_cc   : 1 ; // repeat condition
+    u8_t has_IP   : 1 ; // address of IP
+    u8_t SOV_segx : 2 ; // overriding segment register
+  } ;
+  
+  struct { // Mod RM and SIB
+    u8_t mod       : 2 ; // mode
+    u8_t reg       : 3 ; // register or opcode extencion
+    u8_t rm        : 3 ; // register or memory
+    u8_t sc        : 2 ; // index scale
+    u8_t idx       : 3 ; // index register
+    u8_t bs        : 3 ; // base register
+    u8_t has_ModRM : 1 ; // Mod RM byte is present
+    u8_t has_SIB   : 1 ; // SIB byte is present
+  } ;
+  
+  struct { // values
+    u16_t segx ; // segment index
+    u64_t addr ; // computed address
+    i64_t disp ; // displacement
+    i64_t imm  ; // immediate value
+  } ;
+} ;
+
+enum {
+  US_ICACHE_SIZE      = 1 << 12 , // entries (power of 2)
+  US_ICACHE_WAYS      = 2       , // entries per set (the other one is the oldest)
+  US_ICACHE_SETS      = US_ICACHE_SIZE / US_ICACHE_WAYS ,
+  US_ICACHE_PAGE_BITS = 8       , // code pages of 256 bytes
+  US_ICACHE_FILTER    = 1 << 12   // bits of the code pages filter
+} ;
+
+struct us_icache_entry_s {
+  u64_t     IP    ; // instruction pointer
+  u32_t     gen   ; // generation of the cache (valid if the current one)
+  u16_t     segx  ; // code segment
+  u8_t      PL    ; // privilege level of the permission check
+  us_inst_t inst  ; // decoded instruction
+} ;
+
+struct us_icache_s {
+  u64_t             V      ; // flag V when the entries were decoded
+  u64_t             SDT    ; // SDT when the entries were decoded
+  u32_t             gen    ; // current generation (0 is never valid)
+  u64_t             filter [US_ICACHE_FILTER / 64] ;
+  u8_t              old    [US_ICACHE_SETS] ; // least recently used way
+  us_icache_entry_t entry  [US_ICACHE_SIZE] ;
+} ;
+
+enum {
+  US_JIT_SIZE   = 1 << 10  , // blocks (power of 2)
+  US_JIT_LENGTH = 64       , // instructions per block
+  US_JIT_HOT    = 16       , // executions before the translation
+  US_JIT_BUFFER = 4 << 20    // bytes of host code and data
+} ;
+
+struct us_jit_block_s {
+  u16_t  segx  ; // code segment
+  u64_t  IP    ; // instruction pointer
+  u64_t  next  ; // instruction pointer of the next block
+  u32_t  hits  ; // executions before the translation
+  u32_t  n     ; // instructions (0 if it cannot be translated)
+  u8_t   none  ; // the translation has failed (the interpreter runs it)
+  u8_t * code  ; // entry point of the host code
+  u8_t * chain ; // jump to the next block (NULL if already chained)
+} ;
+
+struct us_jit_s {
+  u8_t *           buf   ; // host code (upwards) and data (downwards)
+  u64_t            code  ; // used bytes of code
+  u64_t            data  ; // used bytes of data
+  u8_t             stale ; // the code has been overwritten
+  us_jit_block_t * last  ; // last block exited through its end
+  us_jit_block_t   block [US_JIT_SIZE] ;
+} ;
+
+enum {
+  US_STLB_SIZE = 1 << 6 // segment descriptors (power of 2)
+} ;
+
+struct us_sde_s { // decoded Segment Descriptor Entry (SDE)
+  u16_t segx  ; // segment index
+  u8_t  valid ;
+  u8_t  perm  ; // permissions (P|X|R|W)
+  u8_t  IOPL  ; // I/O privilege level
+  u64_t addr  ; // physical address
+  u64_t size  ; // physical size
+} ;
+
+struct us_stlb_s { // Segment Translation Lookaside Buffer
+  u64_t    SDT   ; // SDT when the entries were decoded
+  u64_t    lo    ; // physical range of the decoded SDEs
+  u64_t    hi    ;
+  us_sde_t entry [US_STLB_SIZE] ;
+} ;
+
+enum {
+  US_IDT_SIZE = 0x100 // cached ISRs (`int imm8`)
+} ;
+
+struct us_idt_s { // decoded Interrupt Descriptor Table
+  u64_t IDT   ; // IDT when the entries were read
+  u64_t SDT   ; // SDT when the entries were read
+  u64_t flags ; // flags V and IOPL when the entries were read
+  u64_t lo    ; // physical range of the read entries
+  u64_t hi    ;
+  u8_t  valid [US_IDT_SIZE] ;
+  u64_t ISR   [US_IDT_SIZE] ;
+} ;
+
+enum {
+  US_DIRTY_PAGE_BITS = 12 // dirty pages of 4 KiB
+} ;
+
+enum { // string instructions (see `usstr.c`)
+  US_STR_MOVS , // move DATA:SI to EXTRA:DI
+  US_STR_STOS , // store AX to EXTRA:DI
+  US_STR_CMPS , // compare DATA:SI with EXTRA:DI
+  US_STR_SCAS   // compare AX with EXTRA:DI
+} ;
+
+enum {
+  US_REP_BURST = 1 << 16 // elements of a repeated instruction per bulk step
+} ;
+
+enum { // 2-byte operation codes of the vector extension (see `usvec.c`)
+  US_VEC_ADD   = 0x10 , // + element size: 0, 1, 2, 3 -> 8, 16, 32, 64-bit
+  US_VEC_SUB   = 0x14 ,
+  US_VEC_MUL   = 0x18 ,
+  US_VEC_CMPEQ = 0x1C ,
+  US_VEC_CMPGT = 0x20 ,
+  US_VEC_SHUF  = 0x24 ,
+  US_VEC_LD    = 0x28 ,
+  US_VEC_ST    = 0x29 ,
+  US_VEC_MOVQ  = 0x2A , // to the vector register
+  US_VEC_MOVR  = 0x2B   // from the vector register
+} ;
+
+enum { // block instructions (see `usstr.c`)
+  US_BLK_COPY , // copy DATA:SI to EXTRA:DI
+  US_BLK_FILL , // fill EXTRA:DI with AL
+  US_BLK_CMP  , // compare DATA:SI with EXTRA:DI
+  US_BLK_SCAN   // search AL in EXTRA:DI
+} ;
+
+enum {
+  US_BUS_SIZE = 64 // devices attached to a machine
+} ;
+
+struct us_dev_s { // memory mapped device (see `usbus.c`)
+  u64_t addr ; // physical range
+  u64_t size ;
+  any_t ctx  ; // host data of the device
+  
+  // access `size` bytes at `off` from the start of the device, return the
+  // interrupt to raise or `US_N_IRQS` (NULL to access the memory)
+  
+  u32_t (* read) (
+    us_t *     us   ,
+    us_dev_t * dev  ,
+    u64_t      off  ,
+    u64_t      size ,
+    any_t      data
+  ) ;
+  
+  u32_t (* write) (
+          us_t *     us   ,
+          us_dev_t * dev  ,
+          u64_t      off  ,
+          u64_t      size ,
+    const any_t      data
+  ) ;
+} ;
+
+struct us_bus_s {
+  u64_t    lo  ; // physical range of the devices (empty if `hi` is 0)
+  u64_t    hi  ;
+  u32_t    n   ; // attached devices
+  us_dev_t dev [US_BUS_SIZE] ; // sorted by address
+} ;
+
+// the physical range `addr`:`size` can hold a device
+# define __on_bus(__us, __addr, __size) \
+  ((__addr) < (__us)->bus.hi && (__us)->bus.lo < (__addr) + (__size))
+
+enum {
+  US_SCHED_SIZE = 256 // events scheduled on a machine
+} ;
+
+struct us_event_s { // event scheduled on the clock (see `usevt.c`)
+  u64_t clock  ; // deadline (absolute clock)
+  u64_t period ; // clocks between the repetitions (0 if it fires once)
+  u32_t IRQ    ; // interrupt to raise (`US_N_IRQS` if none)
+  u32_t id     ; // set by `us_sched_add`
+  any_t ctx    ; // host data of the event
+  
+  // deferred work, return the interrupt to raise or `US_N_IRQS` (NULL to
+  // raise `IRQ`)
+  
+  u32_t (* fire) (
+    us_t *       us ,
+    us_event_t * ev
+  ) ;
+} ;
+
+struct us_sched_s {
+  u64_t      next    ; // clock of the next check (-1 if none)
+  u32_t      n       ; // scheduled events
+  u32_t      id      ; // last assigned identifier
+  u64_t      pending [US_N_IRQS / 64] ; // raised interrupts not yet delivered
+  u64_t      inject  [US_N_IRQS / 64] ; // raised by the other host threads
+  us_event_t heap    [US_SCHED_SIZE]  ; // min-heap on the deadline
+  
+  volatile u32_t wake ; // futex word, bumped by `us_inject` and `us_stop`
+  u32_t          seen ; // last `wake` seen by the machine
+} ;
+
+enum {
+  US_PROF_SIZE = 1 << 16 // instructions counted by the profiler (power of 2)
+} ;
+
+struct us_prof_ip_s {
+  u16_t segx ; // code segment
+  u64_t IP   ; // instruction pointer
+  u64_t n    ; // executions (0 if the entry is free)
+} ;
+
+struct us_prof_s { // counters of the profiler (see `usprf.c`)
+  u64_t        op    [0x100]        ; // executions of the 1-byte opcodes
+  u64_t        op_F0 [0x100]        ; // executions of the 2-byte opcodes
+  u64_t        IRQ   [US_N_IRQS]    ; // interrupts per vector
+  u64_t        mem   [2][1 << 16]   ; // reads and writes per segment index
+  u64_t        lost                 ; // executions not counted (table full)
+  u32_t        n                    ; // used entries of the table
+  us_prof_ip_t ip    [US_PROF_SIZE] ; // open addressing on CS:IP
+} ;
+
+// count `n` reads (`w` = 0) or writes (`w` = 1) of the segment `segx`
+# define __prof_mem(__us, __segx, __w, __n) \
+  if (NULL != (__us)->prof)                 \
+    (__us)->prof->mem[(__w)][(__segx)] += (__n)
+
+enum {
+  US_SAMPLE_SIZE   = 1 << 16 , // samples in the ring (power of 2)
+  US_SAMPLE_PERIOD = 10000   , // default clocks between the samples
+  US_SAMPLE_DRAIN  = 1 << 20   // clocks between the drains of a host timer
+} ;
+
+struct us_sample_s {
+  u64_t clock ;
+  u64_t IP    ; // instruction pointer
+  u16_t segx  ; // code segment
+  u16_t nest  ; // interrupts being served
+} ;
+
+struct us_sampler_s { // sampling profiler (see `ussmp.c`)
+  FILE *         fp     ; // samples file
+  u64_t          period ; // clocks between the samples (0 with a host timer)
+  u64_t          lost   ; // samples dropped (the ring is full)
+  u32_t          id     ; // event of the sampler
+#ifndef _WIN32
+  timer_t        timer  ; // host timer (if `period` is 0)
+#endif
+  volatile u64_t head   ; // written by the producer only
+  volatile u64_t tail   ; // written by the consumer only
+  us_sample_t    ring   [US_SAMPLE_SIZE] ;
+} ;
+
+enum {
+  US_TRACE_CLOCK = 0 , // the clock does not follow the last instruction
+  US_TRACE_INST  = 1 , // instruction at CS:IP
+  US_TRACE_READ  = 2 , // read of the physical memory (or a device)
+  US_TRACE_WRITE = 3 , // write of the physical memory (or a device)
+  US_TRACE_IRQ   = 4   // interrupt
+} ;
+
+enum {
+  US_TRACE_VERSION = 1       , // format of the traces
+  US_TRACE_RECS    = 1 << 16 , // records per buffer
+  US_TRACE_BUFS    = 4         // buffers between the machine and the writer
+} ;
+
+struct us_trace_rec_s { // 16 bytes, host byte order (see `ustrc.c`)
+  u8_t  kind  ; // US_TRACE_*
+  u8_t  n     ; // opcode bytes of an instruction
+  u16_t segx  ; // segment index
+  u32_t arg   ; // opcodes, size of the access or IRQ
+  u64_t delta ; // from the last IP, address or clock
+} ;
+
+struct us_tracer_s { // binary trace (see `ustrc.c`)
+  FILE *           fp    ; // trace file
+  u8_t             lz    ; // compress the blocks
+  u64_t            IP    ; // last instruction pointer
+  u64_t            addr  ; // last address
+  u64_t            next  ; // clock of the next instruction
+  u64_t            recs  ; // written records
+  u64_t            bytes ; // written bytes
+  us_trace_rec_t * buf   [US_TRACE_BUFS] ;
+  u32_t            n     [US_TRACE_BUFS] ; // records of a full buffer
+  us_trace_rec_t * rec   ; // buffer being filled
+  u32_t            i     ; // records of the buffer being filled
+  u8_t *           pack  ; // compressed block
+  u32_t *          hash  ; // last positions of the sequences of 4 bytes
+  
+  // the machine fills the buffers at the head, the writer empties them at
+  // the tail
+  
+  u32_t head ;
+  u32_t tail ;
+  u8_t  done ;
+
+#ifndef _WIN32
+  pthread_t       thread ;
+  pthread_mutex_t lock   ;
+  pthread_cond_t  cond   ;
+#endif
+} ;
+
+enum {
+  US_REPLAY_INJECT = 1 , // interrupt injected at a clock
+  US_REPLAY_READ   = 2 , // read of a device, followed by the data
+  US_REPLAY_WRITE  = 3   // write of a device
+} ;
+
+enum {
+  US_REPLAY_VERSION = 1 // format of the logs
+} ;
+
+struct us_replay_rec_s { // 16 bytes, host byte order (see `usrpl.c`)
+  u8_t  kind    ; // US_REPLAY_*
+  u8_t  pad [3] ;
+  u32_t IRQ     ; // interrupt injected or raised by the device
+  u64_t arg     ; // clock of the injection or size of the access
+} ;
+
+struct us_replay_s { // record or replay (see `usrpl.c`)
+  FILE * fp       ; // log being recorded (NULL while replaying)
+  u64_t  clock    ; // clock of the last pass of the run loop
+  u8_t * log      ; // log being replayed
+  u64_t  size     ;
+  u64_t  dev      ; // offset of the next access of a device
+  u64_t  inject   ; // offset of the next injection
+  u32_t  id       ; // event of the next injection
+  u8_t   diverged ; // the devices are accessed again
+} ;
+
+// trace an access of `size` bytes at the physical address `addr`
+# define __trace_mem(__us, __segx, __w, __addr, __size) \
+  if (NULL != (__us)->tracer)                           \
+    __trace_rec((__us), US_TRACE_READ + (__w), (__segx), (__size), (__addr))
+
+struct us_base_s { // baseline of the machine (see `us_reset_to_baseline`)
+  int       fd    ; // frozen memory
+  u8_t *    mem   ;
+  u64_t *   dirty ; // bitmap of the written pages (NULL without baseline)
+  us_ker_t  ker   ;
+  us_inst_t inst  ;
+  u32_t     IRQ   ;
+  u8_t      ISR   ;
+  u8_t      idle  ;
+} ;
+
 struct us_s {
-  us_ker_t ker ;
-  us_mem_t mem ;
-  us_opt_t opt ;
-  u32_t    IRQ ;
-  
-  struct {
-    u64_t  IP        ; // instruction pointer
-    u32_t  cp        ; // `code` pointer
-    u8_t   code [16] ; // read from code segment
-    u8_t   op [2]    ; // opcodes
-    u64_t  oprd_size ; // operands size
-    u64_t  addr_size ; // address size
-    
-    struct { // prefixes
-      u8_t has_SOV : 1 ; // segment override
-      u8_t has_ZOV : 1 ; // size override
-      u8_t has_AOV : 1 ; // address override
-      u8_t has_REP : 1 ; // repeat the instruction
-      u8_t REP_cc  : 1 ; // repeat condition
-      u8_t has_IP  : 1 ; // address of IP
-    } ;
-    
-    struct { // Mod RM and SIB
-      u8_t mod : 2 ; // mode
-      u8_t reg : 3 ; // register or opcode extencion
-      u8_t rm  : 3 ; // register or memory
-      u8_t sc  : 2 ; // index scale
-      u8_t idx : 3 ; // index register
-      u8_t bs  : 3 ; // base register
-    } ;
-    
-    struct { // values
-      u16_t segx ; // segment index
-      u64_t addr ; // computed address
-      i64_t imm  ; // immediate value
-    } ;
-  } inst ;
+  us_ker_t    ker    ;
+  us_mem_t    mem    ;
+  us_opt_t    opt    ;
+  u32_t       IRQ    ;
+  u8_t        ISR    ; // the last IRQ has been handled by its ISR
+  u8_t        idle   ; // halted until the next event or interrupt (`hlt`)
+  u64_t       limit  ; // clocks limit of the current run
+  us_lazy_t   lazy   ; // flags not yet computed
+  
+  volatile u8_t stop ; // stop requested by the host (atomic, see `us_stop`)
+  
+  us_inst_t * inst   ; // decoded instruction (in the cache or `spare`)
+  us_inst_t   spare  ; // decoded instruction out of the cache
+  us_icache_t icache ;
+  us_jit_t    jit    ;
+  us_stlb_t   stlb   ;
+  us_idt_t    idt    ;
+  us_base_t   base   ;
+  us_bus_t    bus    ;
+  us_sched_t  sched  ;
+  us_prof_t * prof   ; // NULL if the profiler is disabled
+  u32_t       nest   ; // interrupts being served by their ISRs
+  
+  us_sampler_t * sampler ; // NULL if the sampling is disabled
+  us_tracer_t *  tracer  ; // NULL if the trace is disabled
+  us_replay_t *  replay  ; // NULL if not recording nor replaying
+} ;
+
+enum {
+  US_SNAP_VERSION = 4       , // format of the snapshots
+  US_SNAP_ALIGN   = 1 << 16   // alignment of the memory in a snapshot
+} ;
+
+enum {
+  US_FLEET_QUANTUM = 1 << 16 // default clocks per turn of a machine
+} ;
+
+struct us_job_s {
+  const char * img     ; // image of the machine
+  u64_t        quantum ; // clocks per turn (0 for the quantum of the fleet)
+  us_t *       us      ; // machine (allocated while it is running)
+  u32_t        exit    ; // last reason to exit from `us_run`
+  u32_t        IRQ     ; // last IRQ
+  u8_t         failed  ; // the image cannot be loaded
+  u64_t        clocks  ; // executed clocks
+} ;
+
+struct us_fleet_queue_s { // double-ended queue of the jobs of a worker
+  us_fleet_t *   fleet ;
+  volatile u32_t lock  ;
+  u32_t          head  ; // stolen by the other workers (and preempted jobs)
+  u32_t          tail  ; // popped by the owner
+  us_job_t **    job   ; // ring buffer of `n_jobs + 1` entries
+} ;
+
+struct us_fleet_s {
+  us_opt_t           opt       ; // options of every machine
+  u64_t              quantum   ; // clocks per turn of a machine
+  u32_t              n_threads ; // host threads (0 for the cores)
+  u32_t              n_jobs    ;
+  us_job_t *         job       ;
+  u64_t              clocks    ; // executed clocks of every machine
+  u64_t              time      ; // elapsed time (nanoseconds)
+  volatile u32_t     left      ; // jobs not yet completed
+  volatile u32_t     turns     ; // jobs pushed back (wakes the idle threads)
+  us_fleet_queue_t * queue     ; // one per thread
+
+#ifndef _WIN32
+  pthread_mutex_t    lock      ; // the idle threads sleep on `cond`
+  pthread_cond_t     cond      ;
+#endif
 } ;
 
 u32_t us_load_img (
@@ -139,6 +631,113 @@ u32_t us_load_img (
   const char * fn
 ) ;
 
+void us_free (
+  us_t * us
+) ;
+
+u32_t __map_img (
+  const char *  fn   ,
+        int *   fd   ,
+        u8_t ** img  ,
+        u64_t * size
+) ;
+
+void __unmap_img (
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  size
+) ;
+
+u64_t __page_size (void) ;
+
+u32_t __alloc_mem (
+  us_t * us   ,
+  u64_t  size ,
+  u64_t  skew
+) ;
+
+void __free_mem (
+  us_t * us
+) ;
+
+void __map_mem (
+  us_t * us   ,
+  int    fd   ,
+  u8_t * img  ,
+  u64_t  off  ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+u32_t us_sde_lookup (
+  us_t *      us   ,
+  u16_t       segx ,
+  us_sde_t ** sde
+) ;
+
+void us_stlb_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+void us_stlb_flush (
+  us_t * us
+) ;
+
+u32_t __convert_addr (
+  us_t *  us    ,
+  u16_t   _segx ,
+  u64_t * _addr ,
+  u64_t * _size ,
+  u32_t   _perm
+) ;
+
+u32_t __check_addr (
+  us_t *  us    ,
+  u16_t   _segx ,
+  u64_t * _addr ,
+  u64_t * _size ,
+  u32_t   _perm
+) ;
+
+void __mark_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+u32_t __bus_bulk (
+  us_t * us    ,
+  u64_t  addr  ,
+  u64_t  size  ,
+  u8_t   write
+) ;
+
+u32_t __bus_write (
+        us_t * us   ,
+        u64_t  addr ,
+        u64_t  size ,
+  const any_t  data
+) ;
+
+u32_t __bus_read (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size ,
+  any_t  data
+) ;
+
+u32_t us_bus_attach (
+        us_t *     us  ,
+  const us_dev_t * dev
+) ;
+
+u32_t us_bus_detach (
+  us_t * us   ,
+  u64_t  addr
+) ;
+
 u32_t us_write (
         us_t * us   ,
         u16_t  segx ,
@@ -155,6 +754,78 @@ u32_t us_read (
   any_t  data
 ) ;
 
+u32_t us_write8 (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr ,
+  u8_t   data
+) ;
+
+u32_t us_write16 (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr ,
+  u16_t  data
+) ;
+
+u32_t us_write32 (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr ,
+  u32_t  data
+) ;
+
+u32_t us_write64 (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr ,
+  u64_t  data
+) ;
+
+u32_t us_read8 (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u8_t *  data
+) ;
+
+u32_t us_read16 (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u16_t * data
+) ;
+
+u32_t us_read32 (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u32_t * data
+) ;
+
+u32_t us_read64 (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u64_t * data
+) ;
+
+u32_t us_idt_lookup (
+  us_t *  us  ,
+  u32_t   IRQ ,
+  u64_t * ISR
+) ;
+
+void us_idt_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+void us_idt_flush (
+  us_t * us
+) ;
+
 u32_t us_int (
   us_t * us  ,
   u32_t  IRQ
@@ -176,8 +847,264 @@ u32_t us_pop (
   any_t  data
 ) ;
 
+u32_t __fetch_inst (
+  us_t * us
+) ;
+
+u32_t __exec_inst (
+  us_t * us    ,
+  u8_t   chain
+) ;
+
+u64_t us_flags (
+  us_t * us
+) ;
+
+u32_t __string (
+  us_t * us ,
+  u32_t  op
+) ;
+
+u32_t __block (
+  us_t * us ,
+  u32_t  op
+) ;
+
+void __vec_alu (
+        u8_t   op ,
+        u8_t * a  ,
+  const u8_t * b
+) ;
+
 u32_t us_clock (
   us_t * us
 ) ;
 
+u32_t us_run (
+  us_t * us     ,
+  u64_t  budget
+) ;
+
+void us_stop (
+  us_t * us
+) ;
+
+us_icache_entry_t * us_icache_lookup (
+  us_t * us
+) ;
+
+us_icache_entry_t * us_icache_victim (
+  us_t * us
+) ;
+
+void us_icache_fill (
+  us_t *              us    ,
+  us_icache_entry_t * entry ,
+  u64_t               phys
+) ;
+
+void us_icache_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+void us_icache_flush (
+  us_t * us
+) ;
+
+us_jit_block_t * us_jit_lookup (
+  us_t * us
+) ;
+
+u8_t us_jit_skip (
+  us_t * us
+) ;
+
+u32_t us_jit_exec (
+  us_t *           us    ,
+  us_jit_block_t * block
+) ;
+
+void us_jit_flush (
+  us_t * us
+) ;
+
+void us_jit_free (
+  us_t * us
+) ;
+
+u32_t us_snapshot_save (
+        us_t * us ,
+  const char * fn
+) ;
+
+u32_t us_snapshot_load (
+        us_t * us ,
+  const char * fn
+) ;
+
+u32_t us_clone (
+  us_t * us    ,
+  us_t * child ,
+  u32_t  n
+) ;
+
+u32_t us_baseline_save (
+  us_t * us
+) ;
+
+void us_dirty_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+) ;
+
+void us_reset_to_baseline (
+  us_t * us
+) ;
+
+void us_baseline_free (
+  us_t * us
+) ;
+
+u32_t us_fleet_run (
+  us_fleet_t * fleet
+) ;
+
+u32_t us_sched_add (
+        us_t *       us ,
+  const us_event_t * ev ,
+        u32_t *      id
+) ;
+
+u32_t us_sched_cancel (
+  us_t * us ,
+  u32_t  id
+) ;
+
+u64_t __sched_limit (
+  us_t * us  ,
+  u64_t  end
+) ;
+
+u32_t __sched_run (
+  us_t * us
+) ;
+
+void __sched_unmask (
+  us_t * us
+) ;
+
+void __sched_inject (
+  us_t * us
+) ;
+
+u32_t __sched_idle (
+  us_t * us  ,
+  u64_t  end
+) ;
+
+void __sched_wake (
+  us_t * us
+) ;
+
+void us_inject (
+  us_t * us  ,
+  u32_t  IRQ
+) ;
+
+void us_wait (
+  us_t * us
+) ;
+
+u32_t us_prof_init (
+  us_t * us
+) ;
+
+void us_prof_free (
+  us_t * us
+) ;
+
+void __prof_inst (
+  us_t * us
+) ;
+
+u32_t us_prof_save (
+        us_t * us ,
+  const char * fn
+) ;
+
+u32_t us_sample_init (
+        us_t * us     ,
+  const char * fn     ,
+        u64_t  period ,
+        u32_t  hz
+) ;
+
+void us_sample_free (
+  us_t * us
+) ;
+
+u32_t us_trace_init (
+        us_t * us ,
+  const char * fn ,
+        u8_t   lz
+) ;
+
+void us_trace_free (
+  us_t * us
+) ;
+
+void __trace_inst (
+  us_t * us
+) ;
+
+void __trace_rec (
+  us_t * us   ,
+  u32_t  kind ,
+  u16_t  segx ,
+  u64_t  arg  ,
+  u64_t  addr
+) ;
+
+u32_t us_trace_dump (
+  const char * fn ,
+        FILE * out
+) ;
+
+u32_t us_record_init (
+        us_t * us ,
+  const char * fn
+) ;
+
+u32_t us_replay_init (
+        us_t * us ,
+  const char * fn
+) ;
+
+void us_replay_free (
+  us_t * us
+) ;
+
+void __replay_inject (
+  us_t * us
+) ;
+
+u32_t __replay_read (
+  us_t *     us   ,
+  us_dev_t * dev  ,
+  u64_t      off  ,
+  u64_t      size ,
+  any_t      data
+) ;
+
+u32_t __replay_write (
+        us_t *     us   ,
+        us_dev_t * dev  ,
+        u64_t      off  ,
+        u64_t      size ,
+  const any_t      data
+) ;
+
 #endif
@@ -0,0 +1,258 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// =============================================================================
+// Device Bus
+// -----------------------------------------------------------------------------
+// The host attaches the devices to the physical ranges of a machine (clones
+// and snapshots do not inherit them). The accessors route to the device the
+// reads and the writes within its range, the other ones check only the range
+// of the bus, so that the memory pays two comparisons. The instructions are
+// fetched from the memory, and the bulk instructions cannot access a device
+// with a callback (see `usstr.c`).
+// -----------------------------------------------------------------------------
+// Attach a device:
+//   1. check the range of the device against the memory and the neighbours
+//   2. insert the device into the table sorted by address
+//   3. update the range of the bus
+// Access a device:
+//   1. search the last device starting before the address (binary search)
+//   2. check that the access does not cross the device
+//   3. call the device with the offset from its start, the memory is
+//      accessed if the device has no callback (the results of the callbacks
+//      are recorded and replayed, see `usrpl.c`)
+//   4. raise the interrupt returned by the device
+// Check a bulk access:
+//   1. search the device holding the start of the range, or the next one
+//   2. fail at the first device within the range with the callback
+// =============================================================================
+
+u32_t __bus_upper (
+  us_t * us   ,
+  u64_t  addr
+)
+{
+  // first device starting after `addr`
+  
+  u32_t lo = 0 ;
+  u32_t hi = us->bus.n ;
+  
+  while (lo < hi) {
+    u32_t mid = (lo + hi) / 2 ;
+    
+    if (us->bus.dev[mid].addr <= addr)
+      lo = mid + 1 ;
+    else
+      hi = mid ;
+  }
+  
+  return lo ;
+}
+
+void __bus_range (
+  us_t * us
+)
+{
+  if (0 == us->bus.n) {
+    us->bus.lo = 0 ;
+    us->bus.hi = 0 ;
+    return ;
+  }
+  
+  us_dev_t * last = us->bus.dev + us->bus.n - 1 ;
+  
+  us->bus.lo = us->bus.dev[0].addr ;
+  us->bus.hi = last->addr + last->size ;
+}
+
+u32_t us_bus_attach (
+        us_t *     us  ,
+  const us_dev_t * dev
+)
+{
+  // check the range
+  
+  if (
+    0 == dev->size || US_BUS_SIZE == us->bus.n ||
+    dev->addr + dev->size < dev->addr || us->mem.size < dev->addr + dev->size
+  )
+    return 1 ;
+  
+  u32_t i = __bus_upper(us, dev->addr) ;
+  
+  if (0 < i) {
+    us_dev_t * prev = us->bus.dev + i - 1 ;
+    
+    if (dev->addr < prev->addr + prev->size)
+      return 1 ;
+  }
+  
+  if (i < us->bus.n && us->bus.dev[i].addr < dev->addr + dev->size)
+    return 1 ;
+  
+  // insert the device
+  
+  memmove(
+    us->bus.dev + i + 1, us->bus.dev + i, (us->bus.n - i) * sizeof(us_dev_t)
+  ) ;
+  
+  us->bus.dev[i] = *dev ;
+  ++us->bus.n ;
+  
+  __bus_range(us) ;
+  
+  return 0 ;
+}
+
+u32_t us_bus_detach (
+  us_t * us   ,
+  u64_t  addr
+)
+{
+  u32_t i = __bus_upper(us, addr) ;
+  
+  if (0 == i || us->bus.dev[i - 1].addr != addr)
+    return 1 ;
+  
+  // remove the device
+  
+  memmove(
+    us->bus.dev + i - 1, us->bus.dev + i, (us->bus.n - i) * sizeof(us_dev_t)
+  ) ;
+  
+  --us->bus.n ;
+  
+  __bus_range(us) ;
+  
+  return 0 ;
+}
+
+u32_t __bus_lookup (
+  us_t *      us   ,
+  u64_t       addr ,
+  u64_t       size ,
+  us_dev_t ** dev
+)
+{
+  u32_t i = __bus_upper(us, addr) ;
+  
+  *dev = NULL ;
+  
+  // the device holding `addr`
+  
+  if (0 < i && addr < us->bus.dev[i - 1].addr + us->bus.dev[i - 1].size) {
+    *dev = us->bus.dev + i - 1 ;
+    
+    if ((*dev)->addr + (*dev)->size < addr + size)
+      return US_IRQ_SEGMENT_FAULT ;
+    
+    return US_N_IRQS ;
+  }
+  
+  // the memory, up to the next device
+  
+  if (i < us->bus.n && us->bus.dev[i].addr < addr + size)
+    return US_IRQ_SEGMENT_FAULT ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __bus_bulk (
+  us_t * us    ,
+  u64_t  addr  ,
+  u64_t  size  ,
+  u8_t   write
+)
+{
+  u32_t i = __bus_upper(us, addr) ;
+  
+  // the device holding `addr`
+  if (0 < i && addr < us->bus.dev[i - 1].addr + us->bus.dev[i - 1].size)
+    --i ;
+  
+  // the devices within the range, those without the callback are memory
+  
+  for ( ; i < us->bus.n && us->bus.dev[i].addr < addr + size ; ++i) {
+    us_dev_t * dev = us->bus.dev + i ;
+    
+    if ((0 != write) ? NULL != dev->write : NULL != dev->read)
+      return US_IRQ_SEGMENT_FAULT ;
+  }
+  
+  return US_N_IRQS ;
+}
+
+u32_t __bus_write (
+        us_t * us   ,
+        u64_t  addr ,
+        u64_t  size ,
+  const any_t  data
+)
+{
+  us_dev_t * dev ;
+  
+  if (US_N_IRQS != __bus_lookup(us, addr, size, &dev))
+    return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+  
+  if (NULL == dev || NULL == dev->write) {
+    __mark_write(us, addr, size) ;
+    memcpy(us->mem.data + addr, data, size) ;
+    
+    return US_N_IRQS ;
+  }
+  
+  if (0 != us->opt.verbose) {
+    fprintf(
+      stderr                                               ,
+      ">>> Write device at 0x%012llX (size: %llu bytes)\n" ,
+      (unsigned long long)addr, (unsigned long long)size
+    ) ;
+  }
+  
+  u32_t IRQ = (NULL != us->replay) ?
+    __replay_write(us, dev, addr - dev->addr, size, data) :
+    dev->write(us, dev, addr - dev->addr, size, data) ;
+  
+  if (US_N_IRQS != IRQ)
+    return us_int(us, IRQ) ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __bus_read (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size ,
+  any_t  data
+)
+{
+  us_dev_t * dev ;
+  
+  if (US_N_IRQS != __bus_lookup(us, addr, size, &dev))
+    return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+  
+  if (NULL == dev || NULL == dev->read) {
+    memcpy(data, us->mem.data + addr, size) ;
+    
+    return US_N_IRQS ;
+  }
+  
+  if (0 != us->opt.verbose) {
+    fprintf(
+      stderr                                              ,
+      ">>> Read device at 0x%012llX (size: %llu bytes)\n" ,
+      (unsigned long long)addr, (unsigned long long)size
+    ) ;
+  }
+  
+  u32_t IRQ = (NULL != us->replay) ?
+    __replay_read(us, dev, addr - dev->addr, size, data) :
+    dev->read(us, dev, addr - dev->addr, size, data) ;
+  
+  if (US_N_IRQS != IRQ)
+    return us_int(us, IRQ) ;
+  
+  return US_N_IRQS ;
+}
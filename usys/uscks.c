@@ -7,9 +7,26 @@
 // Clock Cycle
 // -----------------------------------------------------------------------------
 // Next clock:
-//   1. read (with no bounds) 16 bytes from code segment (in memory, at CS:IP)
-//   2. fetch the opcode and prefixes of the next instruction to execute
-//   3. decode and execute the instruction
+//   1. check the clocks left
+//   2. run the translated block at CS:IP, if any (see `usjit.c`)
+//   3. look up the decoded instruction at CS:IP in the instruction cache
+//   If missing:
+//     1. read (with no bounds) 16 bytes from code segment (in memory, at CS:IP)
+//     2. fetch the opcode and prefixes of the next instruction to execute
+//     3. decode the operands (ModRM, SIB, displacement and immediate)
+//     4. save the decoded instruction into the instruction cache
+//   4. count the instruction, if the profiler is enabled (see `usprf.c`)
+//   5. compute the effective address and execute the instruction
+// Run:
+//   1. bound the clocks of the translated blocks to the budget and the next
+//      event (see `usevt.c`)
+//   2. merge the interrupts injected by the other threads and run the events
+//      at their deadline
+//   3. skip the clocks of a halted machine up to the next event, or return if
+//      there is none
+//   4. run the clocks until the machine halts, a breakpoint or an interrupt
+//      not handled by an ISR is raised, the budget is exhausted or the host
+//      requests to stop
 // =============================================================================
 
 u32_t __get_reg (
@@ -89,221 +106,351 @@ u32_t __set_reg (
   return US_N_IRQS ;
 }
 
+u32_t __read_mem (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr ,
+  u64_t  size ,
+  any_t  data
+)
+{
+  switch (size) {
+  case 1 : return us_read8 (us, segx, addr, (u8_t  *)data) ;
+  case 2 : return us_read16(us, segx, addr, (u16_t *)data) ;
+  case 4 : return us_read32(us, segx, addr, (u32_t *)data) ;
+  case 8 : return us_read64(us, segx, addr, (u64_t *)data) ;
+  
+  default :
+    return us_read(us, segx, addr, size, data) ;
+  }
+}
+
+u32_t __write_mem (
+        us_t * us   ,
+        u16_t  segx ,
+        u64_t  addr ,
+        u64_t  size ,
+  const any_t  data
+)
+{
+  switch (size) {
+  case 1 : return us_write8 (us, segx, addr, *(u8_t  *)data) ;
+  case 2 : return us_write16(us, segx, addr, *(u16_t *)data) ;
+  case 4 : return us_write32(us, segx, addr, *(u32_t *)data) ;
+  case 8 : return us_write64(us, segx, addr, *(u64_t *)data) ;
+  
+  default :
+    return us_write(us, segx, addr, size, data) ;
+  }
+}
+
+u32_t __fetch_uimm (us_t * us, u64_t size, any_t data)
+{
+  switch (size) {
+  case 1 : *(u8_t  *)data = *(u8_t  *)(us->inst->code + us->inst->cp) ; break ;
+  case 2 : *(u16_t *)data = *(u16_t *)(us->inst->code + us->inst->cp) ; break ;
+  case 4 : *(u32_t *)data = *(u32_t *)(us->inst->code + us->inst->cp) ; break ;
+  case 8 : *(u64_t *)data = *(u64_t *)(us->inst->code + us->inst->cp) ; break ;
+  
+  default :
+    return us_int(us, US_IRQ_NON_MASKABLE) ;
+  }
+  
+  us->inst->cp += size ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __fetch_imm (us_t * us, u64_t size, i64_t * data)
+{
+  switch (size) {
+  case 1 : *data = *(i8_t  *)(us->inst->code + us->inst->cp) ; break ;
+  case 2 : *data = *(i16_t *)(us->inst->code + us->inst->cp) ; break ;
+  case 4 : *data = *(i32_t *)(us->inst->code + us->inst->cp) ; break ;
+  case 8 : *data = *(i64_t *)(us->inst->code + us->inst->cp) ; break ;
+  
+  default :
+    return us_int(us, US_IRQ_NON_MASKABLE) ;
+  }
+  
+  us->inst->cp += size ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __fetch_SIB (
+  us_t * us
+)
+{
+  // fetch the SIB byte
+  u8_t byte = us->inst->code[us->inst->cp] ;
+  us->inst->cp += sizeof(u8_t) ;
+  
+  us->inst->has_SIB = 1 ;
+  us->inst->sc  = (byte >> 6) & 3 ;
+  us->inst->idx = (byte >> 3) & 7 ;
+  us->inst->bs  = (byte >> 0) & 7 ;
+  
+  // fetch the displacement
+  
+  switch (us->inst->mod) {
+  case 0 :
+    if (US_REG_BP == us->inst->bs) {
+      us->inst->disp = *(i32_t *)(us->inst->code + us->inst->cp) ;
+      us->inst->cp += sizeof(i32_t) ;
+    }
+    break ;
+  
+  case 1 :
+    us->inst->disp = *(i8_t *)(us->inst->code + us->inst->cp) ;
+    us->inst->cp += sizeof(i8_t) ;
+    break ;
+  
+  case 2 :
+    us->inst->disp = *(i32_t *)(us->inst->code + us->inst->cp) ;
+    us->inst->cp += sizeof(i32_t) ;
+    break ;
+  
+  default :
+    return us_int(us, US_IRQ_NON_MASKABLE) ;
+  }
+  
+  return US_N_IRQS ;
+}
+
+u32_t __fetch_ModRM (
+  us_t * us
+)
+{
+  // fetch the ModRM byte
+  u8_t byte = us->inst->code[us->inst->cp] ;
+  us->inst->cp += sizeof(u8_t) ;
+  
+  us->inst->has_ModRM = 1 ;
+  us->inst->mod = (byte >> 6) & 3 ;
+  us->inst->reg = (byte >> 3) & 7 ;
+  us->inst->rm  = (byte >> 0) & 7 ;
+  
+  // fetch the SIB byte and the displacement
+  
+  switch (us->inst->mod) {
+  case 0 :
+    if (US_REG_BP == us->inst->rm) { // [IP + disp32]
+      us->inst->has_IP = 1 ;
+      us->inst->disp = *(i32_t *)(us->inst->code + us->inst->cp) ;
+      us->inst->cp += sizeof(i32_t) ;
+    } else if (US_REG_SP == us->inst->rm) { // [SIB]
+      if (US_N_IRQS != __fetch_SIB(us))
+        return us->IRQ ;
+    }
+    break ;
+  
+  case 1 : // disp = disp8
+  case 2 : // disp = disp32
+    if (US_REG_SP == us->inst->rm) { // [SIB + disp]
+      if (US_N_IRQS != __fetch_SIB(us))
+        return us->IRQ ;
+    } else if (1 == us->inst->mod) { // [rm + disp8]
+      us->inst->disp = *(i8_t *)(us->inst->code + us->inst->cp) ;
+      us->inst->cp += sizeof(i8_t) ;
+    } else { // [rm + disp32]
+      us->inst->disp = *(i32_t *)(us->inst->code + us->inst->cp) ;
+      us->inst->cp += sizeof(i32_t) ;
+    }
+    break ;
+  
+  case 3 : // rm
+    break ;
+  
+  default :
+    return us_int(us, US_IRQ_NON_MASKABLE) ;
+  }
+  
+  return US_N_IRQS ;
+}
+
+// operands encoding of the 1-byte operation codes
+enum {
+  __ENC_MODRM = 1 << 0 , // ModRM byte (SIB byte and displacement)
+  __ENC_IMM8  = 1 << 1   // 8-bit immediate
+} ;
+
+const u8_t __op_enc [0x100] = {
+  __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , // add
+  __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , // sub
+  __ENC_IMM8  , 0           ,                             // int imm8, iret
+  __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , __ENC_MODRM , // cmp
+  0           , 0           ,                             // int 3, -
+  0           , 0           , 0           , 0           , // movs, stos
+  0           , 0           , 0           , 0           , // cmps, scas
+  0                                                       // hlt
+} ;
+
+// operands encoding of the 2-byte operation codes (0xF0 xx)
+const u8_t __op_F0_enc [0x100] = {
+  [0x10 ... 0x24] = __ENC_MODRM , // vadd, vsub, vmul, vcmpeq, vcmpgt, vshuf
+  [0x28 ... 0x2B] = __ENC_MODRM   // vld, vst, vmovq
+} ;
+
 u32_t __fetch_inst (
   us_t * us
 )
 {
+  // look up the decoded instruction
+  
+  us_icache_entry_t * entry = us_icache_lookup(us) ;
+  
+  if (NULL != entry) {
+    us->inst = &entry->inst ;
+    return US_N_IRQS ;
+  }
+  
+  // decode into the oldest entry of the set
+  
+  entry = us_icache_victim(us) ;
+  
+  us->inst = &entry->inst ;
+  memset(us->inst, 0, sizeof(us_inst_t)) ;
+  
   // read the instruction from memory
-
+  
+  u64_t addr = us->ker.reg[US_REG_IP] ;
+  u64_t size = sizeof(us->inst->code) ;
+  
   us->ker.reg[US_REG_FLAGS] |= US_FLAG_IB ;
   
   if (
-    US_N_IRQS != us_read(
-      us, us->ker.seg[US_SEG_CODE], us->ker.reg[US_REG_IP],
-      sizeof(us->inst.code), us->inst.code
+    US_N_IRQS != __convert_addr(
+      us, us->ker.seg[US_SEG_CODE], &addr, &size, US_SEG_PERM_R
     )
   )
     return us->IRQ ;
   
   us->ker.reg[US_REG_FLAGS] &= ~US_FLAG_IB ;
   
+  memcpy(us->inst->code, us->mem.data + addr, size) ;
+  
   // scan the prefixes
   
-  us->inst.IP = us->ker.reg[US_REG_IP] ; // save the instruction pointer
+  us->inst->IP = us->ker.reg[US_REG_IP] ; // save the instruction pointer
   
 _scan :
     
   if ( // segment override
-    0x60 <= us->inst.code[us->inst.cp] &&
-    us->inst.code[us->inst.cp] <= 0x63
+    0x60 <= us->inst->code[us->inst->cp] &&
+    us->inst->code[us->inst->cp] <= 0x63
   ) {
-    us->inst.has_SOV = 1 ; 
-    us->inst.segx = us->ker.seg[us->inst.code[us->inst.cp] & 3] ;
+    us->inst->has_SOV = 1 ; 
+    us->inst->SOV_segx = us->inst->code[us->inst->cp] & 3 ;
     
     // next byte of code
-    us->inst.cp += sizeof(u8_t) ;
+    us->inst->cp += sizeof(u8_t) ;
     goto _scan ;
   }
   
   if ( // repeat
-    0x64 == us->inst.code[us->inst.cp] ||
-    0x65 == us->inst.code[us->inst.cp]
+    0x64 == us->inst->code[us->inst->cp] ||
+    0x65 == us->inst->code[us->inst->cp]
   ) {
-    us->inst.has_REP = 1 ;
-    us->inst.REP_cc = us->inst.code[us->inst.cp] & 1 ;
+    us->inst->has_REP = 1 ;
+    us->inst->REP_cc = us->inst->code[us->inst->cp] & 1 ;
     
     // next byte of code
-    us->inst.cp += sizeof(u8_t) ;
+    us->inst->cp += sizeof(u8_t) ;
     goto _scan ;
   }
   
   if ( // operand size override
-    0x66 == us->inst.code[us->inst.cp]
+    0x66 == us->inst->code[us->inst->cp]
   ) {
-    us->inst.has_ZOV = 1 ;
+    us->inst->has_ZOV = 1 ;
     
     // next byte of code
-    us->inst.cp += sizeof(u8_t) ;
+    us->inst->cp += sizeof(u8_t) ;
     goto _scan ;
   }
   
   if ( // address size override
-    0x67 == us->inst.code[us->inst.cp]
+    0x67 == us->inst->code[us->inst->cp]
   ) {
-    us->inst.has_AOV = 1 ;
+    us->inst->has_AOV = 1 ;
     
     // next byte of code
-    us->inst.cp += sizeof(u8_t) ;
+    us->inst->cp += sizeof(u8_t) ;
     goto _scan ;
   }
   
   // operation code
   
-  us->inst.op[0] = us->inst.code[us->inst.cp] ;
+  us->inst->op[0] = us->inst->code[us->inst->cp] ;
   
-  if (0xF0 == us->inst.code[us->inst.cp]) {
+  if (0xF0 == us->inst->code[us->inst->cp]) {
     // 2-byte operation code
-    us->inst.cp += sizeof(u8_t) ;
-    us->inst.op[1] = us->inst.code[us->inst.cp] ;
+    us->inst->cp += sizeof(u8_t) ;
+    us->inst->op[1] = us->inst->code[us->inst->cp] ;
   }
   
-  us->inst.cp += sizeof(u8_t) ;
-  
-  return US_N_IRQS ;
-}
-
-u32_t __fetch_SIB (
-  us_t * us
-)
-{
-  // fetch the SIB byte
-  u8_t byte = us->inst.code[us->inst.cp] ;
-  us->inst.cp += sizeof(u8_t) ;
-  
-  us->inst.sc  = (byte >> 6) & 3 ;
-  us->inst.idx = (byte >> 3) & 7 ;
-  us->inst.bs  = (byte >> 0) & 7 ;
+  us->inst->cp += sizeof(u8_t) ;
   
-  // decode the SIB byte
+  // operands
   
-  i64_t disp = 0 ;
-  u64_t addr = 0 ;
+  u8_t enc = (0xF0 != us->inst->op[0]) ?
+    __op_enc[us->inst->op[0]] : __op_F0_enc[us->inst->op[1]] ;
   
-  switch (us->inst.mod) {
-  case 0 :
-    if (US_REG_BP != us->inst.bs) {      
-      if (US_N_IRQS != __get_reg(us, us->inst.bs, us->inst.addr_size, &addr))
-        return us->IRQ ;
-      
-      // address: base
-      us->inst.addr += addr ;
-    } else {
-      disp = *(i32_t *)(us->inst.code + us->inst.cp) ;
-      us->inst.cp += sizeof(i32_t) ;
-      
-      // address: displacement
-      us->inst.addr += disp ;
-    }
-    
-    if (US_REG_SP != us->inst.idx) {      
-      if (US_N_IRQS != __get_reg(us, us->inst.idx, us->inst.addr_size, &addr))
-        return us->IRQ ;
-      
-      // address: scale * index
-      us->inst.addr += (1 << us->inst.sc) * addr ;
-    }
-    break ;
-  
-  case 1 :
-  case 2 :
-    if (US_REG_SP != us->inst.idx) {      
-      if (US_N_IRQS != __get_reg(us, us->inst.idx, us->inst.addr_size, &addr))
-        return us->IRQ ;
-      
-      // address: scale * index
-      us->inst.addr = (1 << us->inst.sc) * addr ;
-    }
-    
-    if (1 == us->inst.mod) {
-      disp = *(i8_t *)(us->inst.code + us->inst.cp) ;
-      us->inst.cp += sizeof(i8_t) ;
-    } else {
-      disp = *(i32_t *)(us->inst.code + us->inst.cp) ;
-      us->inst.cp += sizeof(i32_t) ;
-    }
-    
-    // address: displacement
-    us->inst.addr += disp ;
-    break ;
+  if (0 != (enc & __ENC_MODRM)) {
+    if (US_N_IRQS != __fetch_ModRM(us))
+      return us->IRQ ;
+  }
   
-  default :
-    return us_int(us, US_IRQ_NON_MASKABLE) ;
+  if (0 != (enc & __ENC_IMM8)) {
+    if (US_N_IRQS != __fetch_imm(us, sizeof(u8_t), &us->inst->imm))
+      return us->IRQ ;
   }
   
+  // validate the decoded instruction
+  us_icache_fill(us, entry, addr) ;
+  
   return US_N_IRQS ;
 }
 
-u32_t __fetch_ModRM (
+u32_t __calc_addr (
   us_t * us
 )
 {
-  // fetch the ModRM byte
-  u8_t byte = us->inst.code[us->inst.cp] ;
-  us->inst.cp += sizeof(u8_t) ;
-  
-  us->inst.mod = (byte >> 6) & 3 ;
-  us->inst.reg = (byte >> 3) & 7 ;
-  us->inst.rm  = (byte >> 0) & 7 ;
-  
-  // decode the ModRM byte
-  
-  i64_t disp = 0 ;
   u64_t addr = 0 ;
   
-  switch (us->inst.mod) {
+  us->inst->addr = 0 ;
+  
+  switch (us->inst->mod) {
   case 0 :
-    if (US_REG_BP == us->inst.rm) { // [IP + disp32]
-      // address: base
-      us->inst.has_IP = 1 ;
+  case 1 :
+  case 2 :
+    if (0 != us->inst->has_SIB) {
+      if (0 != us->inst->mod || US_REG_BP != us->inst->bs) { // not [disp32]
+        if (US_N_IRQS != __get_reg(us, us->inst->bs, us->inst->addr_size, &addr))
+          return us->IRQ ;
+        
+        // address: base
+        us->inst->addr += addr ;
+      }
       
-      // address: displacement
-      us->inst.addr = *(i32_t *)(us->inst.code + us->inst.cp) ;
-      us->inst.cp += sizeof(i32_t) ;
-    } else if (US_REG_SP == us->inst.rm) { // [SIB]
-      if (US_N_IRQS != __fetch_SIB(us))
-        return us->IRQ ;
-    } else { // [rm]
-      if (US_N_IRQS != __get_reg(us, us->inst.rm, us->inst.addr_size, &addr))
+      if (US_REG_SP != us->inst->idx) {
+        if (US_N_IRQS != __get_reg(us, us->inst->idx, us->inst->addr_size, &addr))
+          return us->IRQ ;
+        
+        // address: scale * index
+        us->inst->addr += (1 << us->inst->sc) * addr ;
+      }
+    } else if (0 == us->inst->has_IP) {
+      if (US_N_IRQS != __get_reg(us, us->inst->rm, us->inst->addr_size, &addr))
         return us->IRQ ;
       
       // address: base
-      us->inst.addr = addr ;
+      us->inst->addr = addr ;
     }
-    break ;
     
-  case 1 : // disp = disp8
-  case 2 : // disp = disp32
-    if (US_REG_SP == us->inst.rm) { // [SIB + disp]
-      if (US_N_IRQS != __fetch_SIB(us))
-        return us->IRQ ;
-    } else { // [rm + disp]
-      if (US_N_IRQS != __get_reg(us, us->inst.rm, us->inst.addr_size, &addr))
-        return us->IRQ ;
-      
-      // address: base
-      us->inst.addr = addr ;
-      
-      if (1 == us->inst.mod) {
-        disp = *(i8_t *)(us->inst.code + us->inst.cp) ;
-        us->inst.cp += sizeof(i8_t) ;
-      } else {
-        disp = *(i32_t *)(us->inst.code + us->inst.cp) ;
-        us->inst.cp += sizeof(i32_t) ;
-      }
-      
-      // address: displacement
-      us->inst.addr += disp ;
-    }
+    // address: displacement
+    us->inst->addr += us->inst->disp ;
     break ;
   
   case 3 : // rm
@@ -316,453 +463,609 @@ u32_t __fetch_ModRM (
   return US_N_IRQS ;
 }
 
-#define __raise_0(__us)                             \
-  {                                                 \
-    (__us)->ker.reg[US_REG_IP] += (__us)->inst.cp ; \
-    return us->IRQ ;                                \
+#define __raise_0(__us)                              \
+  {                                                  \
+    (__us)->ker.reg[US_REG_IP] += (__us)->inst->cp ; \
+    return us->IRQ ;                                 \
   }
 
-#define __raise(__us, __IRQ)                        \
-  {                                                 \
-    (__us)->ker.reg[US_REG_IP] += (__us)->inst.cp ; \
-    return us_int((__us), (__IRQ)) ;                \
+#define __raise(__us, __IRQ)                         \
+  {                                                  \
+    (__us)->ker.reg[US_REG_IP] += (__us)->inst->cp ; \
+    return us_int((__us), (__IRQ)) ;                 \
   }
 
-u32_t __fetch_uimm (us_t * us, u64_t size, any_t data)
-{
-  switch (size) {
-  case 1 : *(u8_t  *)data = *(u8_t  *)(us->inst.code + us->inst.cp) ; break ;
-  case 2 : *(u16_t *)data = *(u16_t *)(us->inst.code + us->inst.cp) ; break ;
-  case 4 : *(u32_t *)data = *(u32_t *)(us->inst.code + us->inst.cp) ; break ;
-  case 8 : *(u64_t *)data = *(u64_t *)(us->inst.code + us->inst.cp) ; break ;
-  
-  default :
-    return us_int(us, US_IRQ_NON_MASKABLE) ;
+#define __get_modrm_reg(__us, __size, __data)                                  \
+  {                                                                            \
+    if (US_N_IRQS != __get_reg((__us), (__us)->inst->reg, (__size), (__data))) \
+      __raise_0(__us)                                                          \
   }
-  
-  us->inst.cp += size ;
-  
-  return US_N_IRQS ;
-}
 
-u32_t __fetch_imm (us_t * us, u64_t size, i64_t * data)
-{
-  switch (size) {
-  case 1 : *data = *(i8_t  *)(us->inst.code + us->inst.cp) ; break ;
-  case 2 : *data = *(i16_t *)(us->inst.code + us->inst.cp) ; break ;
-  case 4 : *data = *(i32_t *)(us->inst.code + us->inst.cp) ; break ;
-  case 8 : *data = *(i64_t *)(us->inst.code + us->inst.cp) ; break ;
-  
-  default :
-    return us_int(us, US_IRQ_NON_MASKABLE) ;
+#define __set_modrm_reg(__us, __size, __data)                                  \
+  {                                                                            \
+    if (US_N_IRQS != __set_reg((__us), (__us)->inst->reg, (__size), (__data))) \
+      __raise_0(__us)                                                          \
   }
-  
-  us->inst.cp += size ;
-  
-  return US_N_IRQS ;
-}
 
-#define __get_modrm_reg(__us, __size, __data)                                 \
-  {                                                                           \
-    if (US_N_IRQS != __get_reg((__us), (__us)->inst.reg, (__size), (__data))) \
-      __raise_0(__us)                                                         \
+#define __get_modrm_rm(__us, __size, __data)                                     \
+  {                                                                              \
+    if (3 != (__us)->inst->mod) {                                                \
+      if (                                                                       \
+        US_N_IRQS != __read_mem(                                                 \
+          (__us), (__us)->inst->segx, (__us)->inst->addr, (__size), (__data)     \
+        )                                                                        \
+      )                                                                          \
+        __raise_0(__us)                                                          \
+    } else {                                                                     \
+      if (US_N_IRQS != __get_reg((__us), (__us)->inst->rm, (__size), (__data)))  \
+        __raise_0(__us)                                                          \
+    }                                                                            \
   }
 
-#define __set_modrm_reg(__us, __size, __data)                                 \
-  {                                                                           \
-    if (US_N_IRQS != __set_reg((__us), (__us)->inst.reg, (__size), (__data))) \
-      __raise_0(__us)                                                         \
+#define __set_modrm_rm(__us, __size, __data)                                     \
+  {                                                                              \
+    if (3 != (__us)->inst->mod) {                                                \
+      if (                                                                       \
+        US_N_IRQS != __write_mem(                                                \
+          (__us), (__us)->inst->segx, (__us)->inst->addr, (__size), (__data)     \
+        )                                                                        \
+      )                                                                          \
+        __raise_0(__us)                                                          \
+    } else {                                                                     \
+      if (US_N_IRQS != __set_reg((__us), (__us)->inst->rm, (__size), (__data)))  \
+        __raise_0(__us)                                                          \
+    }                                                                            \
   }
 
-#define __get_modrm_rm(__us, __size, __data)                                    \
+#define __get_vec_rm(__us, __data)                                              \
   {                                                                             \
-    if (3 != (__us)->inst.mod) {                                                \
+    if (3 != (__us)->inst->mod) {                                               \
       if (                                                                      \
         US_N_IRQS != us_read(                                                   \
-          (__us), (__us)->inst.segx, (__us)->inst.addr, (__size), (__data)      \
+          (__us), (__us)->inst->segx, (__us)->inst->addr, US_VEC_SIZE, (__data) \
         )                                                                       \
       )                                                                         \
         __raise_0(__us)                                                         \
-    } else {                                                                    \
-      if (US_N_IRQS != __get_reg((__us), (__us)->inst.reg, (__size), (__data))) \
-        __raise_0(__us)                                                         \
-    }                                                                           \
+    } else                                                                      \
+      memcpy((__data), (__us)->ker.vec[(__us)->inst->rm], US_VEC_SIZE) ;        \
   }
 
-#define __set_modrm_rm(__us, __size, __data)                                    \
+#define __set_vec_rm(__us, __data)                                              \
   {                                                                             \
-    if (3 != (__us)->inst.mod) {                                                \
+    if (3 != (__us)->inst->mod) {                                               \
       if (                                                                      \
         US_N_IRQS != us_write(                                                  \
-          (__us), (__us)->inst.segx, (__us)->inst.addr, (__size), (__data)      \
+          (__us), (__us)->inst->segx, (__us)->inst->addr, US_VEC_SIZE, (__data) \
         )                                                                       \
       )                                                                         \
         __raise_0(__us)                                                         \
-    } else {                                                                    \
-      if (US_N_IRQS != __set_reg((__us), (__us)->inst.reg, (__size), (__data))) \
-        __raise_0(__us)                                                         \
-    }                                                                           \
+    } else                                                                      \
+      memcpy((__us)->ker.vec[(__us)->inst->rm], (__data), US_VEC_SIZE) ;        \
   }
 
-#define __modrm(__us)                     \
-  {                                       \
-    if (US_N_IRQS != __fetch_ModRM(__us)) \
-      __raise_0(__us)                     \
+#define __modrm(__us)                   \
+  {                                     \
+    if (US_N_IRQS != __calc_addr(__us)) \
+      __raise_0(__us)                   \
   }
 
-#define __uimm(__us, __size, __data)                           \
-  {                                                            \
-    if (US_N_IRQS != __fetch_uimm((__us), (__size), (__data))) \
-      __raise_0(__us)                                          \
-  }
-
-#define __imm(__us, __size, __data)                           \
-  {                                                           \
-    if (US_N_IRQS != __fetch_imm((__us), (__size), (__data))) \
-      __raise_0(__us)                                         \
-  }
-
-#define _SOV(__us, __defseg)           \
-  {                                    \
-    if (0 != (__us)->inst.has_SOV)     \
-      (__us)->inst.segx = (__defseg) ; \
+#define _SOV(__us, __defseg)                                         \
+  {                                                                  \
+    if (0 != (__us)->inst->has_SOV)                                  \
+      (__us)->inst->segx = (__us)->ker.seg[(__us)->inst->SOV_segx] ; \
+    else                                                             \
+      (__us)->inst->segx = (__defseg) ;                              \
   }
 
 #define _ZOV(__us, __op, __0_0, __0_1, __1_0, __1_1) \
   {                                                  \
     if (0 != ((__op) & 1)) {                         \
-      if (0 != (__us)->inst.has_ZOV)                 \
-        (__us)->inst.oprd_size = (__1_1) ;           \
+      if (0 != (__us)->inst->has_ZOV)                \
+        (__us)->inst->oprd_size = (__1_1) ;          \
       else                                           \
-        (__us)->inst.oprd_size = (__1_0) ;           \
+        (__us)->inst->oprd_size = (__1_0) ;          \
     } else {                                         \
-      if (0 != (__us)->inst.has_ZOV)                 \
-        (__us)->inst.oprd_size = (__0_1) ;           \
+      if (0 != (__us)->inst->has_ZOV)                \
+        (__us)->inst->oprd_size = (__0_1) ;          \
       else                                           \
-        (__us)->inst.oprd_size = (__0_0) ;           \
+        (__us)->inst->oprd_size = (__0_0) ;          \
     }                                                \
   }
 
-#define _AOV(__us, __0_0, __0_1)         \
-  {                                      \
-    if (0 != (__us)->inst.has_AOV)       \
-      (__us)->inst.addr_size = (__0_1) ; \
-    else                                 \
-      (__us)->inst.addr_size = (__0_0) ; \
+#define _AOV(__us, __0_0, __0_1)          \
+  {                                       \
+    if (0 != (__us)->inst->has_AOV)       \
+      (__us)->inst->addr_size = (__0_1) ; \
+    else                                  \
+      (__us)->inst->addr_size = (__0_0) ; \
   }
 
-u32_t __exec_inst (
+// =============================================================================
+// Flags
+// -----------------------------------------------------------------------------
+// The arithmetic does not update the flags C, P, A, Z, S and O: it records the
+// kind of the operation, its operands and their size, then the flags are
+// computed from them only when something reads the register FLAGS (interrupt,
+// debugger, snapshot). Whoever writes the register FLAGS discards the record.
+// -----------------------------------------------------------------------------
+// Materialize the flags:
+//   1. check if there is a recorded operation
+//   2. compute the result from the operands truncated to their size
+//   3. compute the flags and merge them into the register FLAGS
+// =============================================================================
+
+#define __lazy(__us, __op, __size, __a, __b) \
+  {                                          \
+    (__us)->lazy.op   = (__op)   ;           \
+    (__us)->lazy.size = (__size) ;           \
+    (__us)->lazy.a    = (__a)    ;           \
+    (__us)->lazy.b    = (__b)    ;           \
+  }
+
+u64_t us_flags (
   us_t * us
 )
+{
+  if (US_LAZY_NONE == us->lazy.op)
+    return us->ker.reg[US_REG_FLAGS] ;
+  
+  u64_t bits = 8 * us->lazy.size ;
+  u64_t mask = (64 <= bits) ? (u64_t)-1 : ((u64_t)1 << bits) - 1 ;
+  u64_t sign = (u64_t)1 << (bits - 1) ;
+  
+  u64_t a = us->lazy.a & mask ;
+  u64_t b = us->lazy.b & mask ;
+  u64_t c ;
+  
+  u64_t flags = 0 ;
+  
+  if (US_LAZY_ADD == us->lazy.op) {
+    c = (a + b) & mask ;
+    
+    if (c < a)
+      flags |= US_FLAG_C ;
+    if (0 != ((a ^ c) & (b ^ c) & sign))
+      flags |= US_FLAG_O ;
+  } else {
+    c = (a - b) & mask ;
+    
+    if (a < b)
+      flags |= US_FLAG_C ;
+    if (0 != ((a ^ b) & (a ^ c) & sign))
+      flags |= US_FLAG_O ;
+  }
+  
+  if (0 == __builtin_parityll(c & 0xFF))
+    flags |= US_FLAG_P ;
+  if (0 != ((a ^ b ^ c) & 0x10))
+    flags |= US_FLAG_A ;
+  if (0 == c)
+    flags |= US_FLAG_Z ;
+  if (0 != (c & sign))
+    flags |= US_FLAG_S ;
+  
+  us->ker.reg[US_REG_FLAGS] &= ~(u64_t)(
+    US_FLAG_C | US_FLAG_P | US_FLAG_A | US_FLAG_Z | US_FLAG_S | US_FLAG_O
+  ) ;
+  
+  us->ker.reg[US_REG_FLAGS] |= flags ;
+  
+  us->lazy.op = US_LAZY_NONE ;
+  
+  return us->ker.reg[US_REG_FLAGS] ;
+}
+
+// =============================================================================
+// Dispatch
+// -----------------------------------------------------------------------------
+// The instructions are dispatched through a table of handlers (threaded code)
+// when the compiler supports the labels as values (GNU C), otherwise through
+// a switch. Define `_US_SWITCH` to force the portable switch dispatch.
+// A run of `us_run` chains the instructions: the tail of a handler fetches the
+// next instruction and jumps to its handler (in the switch, back to the
+// switch), until the run loop has something to do before the next clock (see
+// `__chain`). The repeated instructions and the interrupts return to it.
+// Handlers:
+//   __case(op)      | handler of the operation code `op`
+//   __case_2(op)    | handler of the 2-byte operation code `0xF0 op`
+//   __undefined     | handler of the undefined operation codes
+//   __undefined_2   | handler of the undefined 2-byte operation codes
+//   __non_maskable  | handler of the prefixes read as operation codes
+//   __next          | update the instruction pointer and chain the next one
+//   __done          | update the instruction pointer and return
+// =============================================================================
+
+#if defined(__GNUC__) && !defined(_US_SWITCH)
+# define _US_THREADED
+#endif
+
+#ifdef _US_THREADED
+# define __dispatch(__tab, __op) goto * __tab[(__op)] ;
+# define __redispatch(__us)      goto * __op_tab[(__us)->inst->op[0]] ;
+# define __entry
+# define __case(__op)            _op_##__op :
+# define __case_2(__op)          _op_F0_##__op :
+# define __undefined             _op_undefined :
+# define __undefined_2           _op_F0_undefined :
+# define __non_maskable          _op_non_maskable :
+#else
+# define __dispatch(__tab, __op) switch (__op)
+# define __redispatch(__us)      goto _op_entry ;
+# define __entry                 _op_entry :
+# define __case(__op)            case __op :
+# define __case_2(__op)          case __op :
+# define __undefined             default :
+# define __undefined_2           default :
+# define __non_maskable          case 0x60 : case 0x61 : case 0x62 : case 0x63 : \
+                                 case 0x64 : case 0x65 : case 0x66 : case 0x67 :
+#endif
+
+// the next clock would run the instruction at CS:IP and nothing else: no
+// event, no injected interrupt, no stop, no translated block, within the
+// budget (see `us_run`)
+#define __chain(__us)                                            \
+  (                                                              \
+    (__us)->ker.reg[US_REG_CLOCK] + 1 < (__us)->limit         && \
+    0 != ((__us)->ker.reg[US_REG_FLAGS] & US_FLAG_1)          && \
+    0 == __atomic_load_n(&(__us)->stop, __ATOMIC_ACQUIRE)     && \
+    (__us)->sched.seen == (__us)->sched.wake                  && \
+    (0 == (__us)->opt.jit || 0 != us_jit_skip(__us))             \
+  )
+
+#define __next(__us)                                 \
+  {                                                  \
+    (__us)->ker.reg[US_REG_IP] += (__us)->inst->cp ; \
+                                                     \
+    if (0 == chain || !__chain(__us))                \
+      return US_N_IRQS ;                             \
+                                                     \
+    ++(__us)->ker.reg[US_REG_CLOCK] ;                \
+                                                     \
+    if (US_N_IRQS != __fetch_inst(__us))             \
+      return (__us)->IRQ ;                           \
+                                                     \
+    __redispatch(__us)                               \
+  }
+
+#define __done(__us)                                 \
+  {                                                  \
+    (__us)->ker.reg[US_REG_IP] += (__us)->inst->cp ; \
+    return US_N_IRQS ;                               \
+  }
+
+u32_t __exec_inst (
+  us_t * us    ,
+  u8_t   chain
+)
 {
   union { u64_t u ; i64_t i ; } a ;
   union { u64_t u ; i64_t i ; } b ;
   union { u64_t u ; i64_t i ; } c ;
 
-#define _SOV_ZOV_AOV_0                 \
-  _SOV(us, us->ker.seg[US_SEG_DATA])   \
-  _ZOV(us, us->inst.op[0], 0, 1, 2, 3) \
-  _AOV(us, 3, 2)
+#ifdef _US_THREADED
+# define _O(__op) &&_op_##__op
+# define _U       &&_op_undefined
+# define _N       &&_op_non_maskable
+  
+  // 1-byte operation codes
+  static const void * const __op_tab [0x100] = {
+    /* 0x00 */ _O(0x00), _O(0x01), _O(0x02), _O(0x03), _O(0x04), _O(0x05), _O(0x06), _O(0x07),
+    /* 0x08 */ _O(0x08), _O(0x09), _O(0x0A), _O(0x0B), _O(0x0C), _O(0x0D), _O(0x0E), _U      ,
+    /* 0x10 */ _O(0x10), _O(0x11), _O(0x12), _O(0x13), _O(0x14), _O(0x15), _O(0x16), _O(0x17),
+    /* 0x18 */ _O(0x18), _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x20 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x28 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x30 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x38 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x40 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x48 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x50 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x58 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x60 */ _N      , _N      , _N      , _N      , _N      , _N      , _N      , _N      ,
+    /* 0x68 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x70 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x78 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x80 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x88 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x90 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0x98 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xA0 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xA8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xB0 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xB8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xC0 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xC8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xD0 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xD8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xE0 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xE8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xF0 */ _O(0xF0), _U      , _U      , _U      , _U      , _U      , _U      , _U      ,
+    /* 0xF8 */ _U      , _U      , _U      , _U      , _U      , _U      , _U      , _U
+  } ;
+
+# undef  _U
+# define _O2(__op) &&_op_F0_##__op
+# define _U        &&_op_F0_undefined
+  
+  // 2-byte operation codes
+  static const void * const __op_F0_tab [0x100] = {
+    /* 0x00 */ _O2(0x00), _O2(0x01), _O2(0x02), _O2(0x03), _U       , _U       , _U       , _U       ,
+    /* 0x08 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x10 */ _O2(0x10), _O2(0x11), _O2(0x12), _O2(0x13), _O2(0x14), _O2(0x15), _O2(0x16), _O2(0x17),
+    /* 0x18 */ _O2(0x18), _O2(0x19), _O2(0x1A), _O2(0x1B), _O2(0x1C), _O2(0x1D), _O2(0x1E), _O2(0x1F),
+    /* 0x20 */ _O2(0x20), _O2(0x21), _O2(0x22), _O2(0x23), _O2(0x24), _U       , _U       , _U       ,
+    /* 0x28 */ _O2(0x28), _O2(0x29), _O2(0x2A), _O2(0x2B), _U       , _U       , _U       , _U       ,
+    /* 0x30 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x38 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x40 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x48 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x50 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x58 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x60 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x68 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x70 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x78 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x80 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x88 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x90 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0x98 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xA0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xA8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xB0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xB8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xC0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xC8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xD0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xD8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xE0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xE8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xF0 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       ,
+    /* 0xF8 */ _U       , _U       , _U       , _U       , _U       , _U       , _U       , _U       
+  } ;
+
+# undef _O
+# undef _O2
+# undef _U
+# undef _N
+#endif
+
+#define _SOV_ZOV_AOV_0                  \
+  _SOV(us, us->ker.seg[US_SEG_DATA])    \
+  _ZOV(us, us->inst->op[0], 0, 1, 2, 3) \
+  _AOV(us, 8, 4)
 
 #define __init_modrm_0 \
   _SOV_ZOV_AOV_0       \
   __modrm(us)
 
-  switch (us->inst.op[0]) {  
-  case 0x00 :   // add r8  r/m8
-  case 0x01 : { // add r32 r/m32
+#define _SOV_ZOV_AOV_1                  \
+  _SOV(us, us->ker.seg[US_SEG_DATA])    \
+  _ZOV(us, us->inst->op[0], 1, 2, 4, 8) \
+  _AOV(us, 8, 4)
+
+#define _SOV_AOV_2                   \
+  _SOV(us, us->ker.seg[US_SEG_DATA]) \
+  _AOV(us, 8, 4)
+
+#define __init_vec_2 \
+  _SOV_AOV_2         \
+  __modrm(us)
+  
+  __entry
+  __dispatch(__op_tab, us->inst->op[0]) {
+  __case(0x00)   // add r8  r/m8
+  __case(0x01) { // add r32 r/m32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &a.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &b.u)
+    __get_modrm_reg(us, us->inst->oprd_size, &a.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &b.u)
     c.u = a.u + b.u ;
-    __set_modrm_reg(us, us->inst.oprd_size, &c.u)
-    // TODO: update flags
-  } break ;
+    __set_modrm_reg(us, us->inst->oprd_size, &c.u)
+    __lazy(us, US_LAZY_ADD, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x02 :   // add r/m8  r8
-  case 0x03 : { // add r/m32 r32
+  __case(0x02)   // add r/m8  r8
+  __case(0x03) { // add r/m32 r32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &b.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &a.u)
+    __get_modrm_reg(us, us->inst->oprd_size, &b.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &a.u)
     c.u = a.u + b.u ;
-    __set_modrm_rm(us, us->inst.oprd_size, &c.u)
-    // TODO: update flags
-  } break ;
+    __set_modrm_rm(us, us->inst->oprd_size, &c.u)
+    __lazy(us, US_LAZY_ADD, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x04 :   // sub r8  r/m8
-  case 0x05 : { // sub r32 r/m32
+  __case(0x04)   // sub r8  r/m8
+  __case(0x05) { // sub r32 r/m32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &a.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &b.u)
+    __get_modrm_reg(us, us->inst->oprd_size, &a.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &b.u)
     c.u = a.u - b.u ;
-    __set_modrm_reg(us, us->inst.oprd_size, &c.u)
-    // TODO: update flags
-  } break ;
+    __set_modrm_reg(us, us->inst->oprd_size, &c.u)
+    __lazy(us, US_LAZY_SUB, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x06 :   // sub r/m8  r8
-  case 0x07 : { // sub r/m32 r32
+  __case(0x06)   // sub r/m8  r8
+  __case(0x07) { // sub r/m32 r32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &b.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &a.u)
+    __get_modrm_reg(us, us->inst->oprd_size, &b.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &a.u)
     c.u = a.u - b.u ;
-    __set_modrm_rm(us, us->inst.oprd_size, &c.u)
-    // TODO: update flags
-  } break ;
+    __set_modrm_rm(us, us->inst->oprd_size, &c.u)
+    __lazy(us, US_LAZY_SUB, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x08 : { // int imm8
-    u8_t imm = *(u8_t *)(us->inst.code + us->inst.cp) ;
-    us->inst.cp += sizeof(u8_t) ;
+  __case(0x08) { // int imm8
+    u8_t imm = (u8_t)us->inst->imm ;
     
     // interrupt
-    us->ker.reg[US_REG_IP] += us->inst.cp ;
+    us->ker.reg[US_REG_IP] += us->inst->cp ;
     return us_int(us, imm) ;
   }
   
-  case 0x09 :   // iret
+  __case(0x09)   // iret
     return us_iret(us) ;
   
-  case 0x0A :   // cmp r8  r/m8
-  case 0x0B : { // cmp r32 r/m32
+  __case(0x0A)   // cmp r8  r/m8
+  __case(0x0B) { // cmp r32 r/m32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &a.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &b.u)
-    c.u = a.u - b.u ;
-  } break ;
+    __get_modrm_reg(us, us->inst->oprd_size, &a.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &b.u)
+    __lazy(us, US_LAZY_SUB, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x0C :   // cmp r/m8  r8
-  case 0x0D : { // cmp r/m32 r32
+  __case(0x0C)   // cmp r/m8  r8
+  __case(0x0D) { // cmp r/m32 r32
     __init_modrm_0
-    __get_modrm_reg(us, us->inst.oprd_size, &b.u)
-    __get_modrm_rm(us, us->inst.oprd_size, &a.u)
-    c.u = a.u - b.u ;
-  } break ;
+    __get_modrm_reg(us, us->inst->oprd_size, &b.u)
+    __get_modrm_rm(us, us->inst->oprd_size, &a.u)
+    __lazy(us, US_LAZY_SUB, us->inst->oprd_size, a.u, b.u)
+  } __next(us)
   
-  case 0x0E : { // int 3 (breakpoint)
-    us->ker.reg[US_REG_IP] += us->inst.cp ;
+  __case(0x0E) { // int 3 (breakpoint)
+    us->ker.reg[US_REG_IP] += us->inst->cp ;
     return us_int(us, US_IRQ_BREAKPOINT) ;
   }
   
-  case 0x0F : {
-    switch (us->inst.op[1]) {
-    case 0x00 : case 0x01 : case 0x02 : case 0x03 :
-    case 0x04 : case 0x05 : case 0x06 : case 0x07 :
-    case 0x08 : case 0x09 : case 0x0A : case 0x0B :
-    case 0x0C : case 0x0D : case 0x0E : case 0x0F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x10 : case 0x11 : case 0x12 : case 0x13 :
-    case 0x14 : case 0x15 : case 0x16 : case 0x17 :
-    case 0x18 : case 0x19 : case 0x1A : case 0x1B :
-    case 0x1C : case 0x1D : case 0x1E : case 0x1F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x20 : case 0x21 : case 0x22 : case 0x23 :
-    case 0x24 : case 0x25 : case 0x26 : case 0x27 :
-    case 0x28 : case 0x29 : case 0x2A : case 0x2B :
-    case 0x2C : case 0x2D : case 0x2E : case 0x2F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x30 : case 0x31 : case 0x32 : case 0x33 :
-    case 0x34 : case 0x35 : case 0x36 : case 0x37 :
-    case 0x38 : case 0x39 : case 0x3A : case 0x3B :
-    case 0x3C : case 0x3D : case 0x3E : case 0x3F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x40 : case 0x41 : case 0x42 : case 0x43 :
-    case 0x44 : case 0x45 : case 0x46 : case 0x47 :
-    case 0x48 : case 0x49 : case 0x4A : case 0x4B :
-    case 0x4C : case 0x4D : case 0x4E : case 0x4F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+  __case(0x10)   // movs m8  m8
+  __case(0x11) { // movs m32 m32
+    _SOV_ZOV_AOV_1
+  } return __string(us, US_STR_MOVS) ;
+  
+  __case(0x12)   // stos m8
+  __case(0x13) { // stos m32
+    _SOV_ZOV_AOV_1
+  } return __string(us, US_STR_STOS) ;
+  
+  __case(0x14)   // cmps m8  m8
+  __case(0x15) { // cmps m32 m32
+    _SOV_ZOV_AOV_1
+  } return __string(us, US_STR_CMPS) ;
+  
+  __case(0x16)   // scas m8
+  __case(0x17) { // scas m32
+    _SOV_ZOV_AOV_1
+  } return __string(us, US_STR_SCAS) ;
+  
+  __case(0x18) { // hlt
+    // wait for the next event or interrupt (see `us_run`)
+    us->idle = 1 ;
+  } __done(us)
+  
+  __case(0xF0) { // 2-byte operation codes
+    __dispatch(__op_F0_tab, us->inst->op[1]) {
+    __case_2(0x00) { // bcopy
+      _SOV_AOV_2
+    } return __block(us, US_BLK_COPY) ;
     
-    case 0x50 : case 0x51 : case 0x52 : case 0x53 :
-    case 0x54 : case 0x55 : case 0x56 : case 0x57 :
-    case 0x58 : case 0x59 : case 0x5A : case 0x5B :
-    case 0x5C : case 0x5D : case 0x5E : case 0x5F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x60 : case 0x61 : case 0x62 : case 0x63 :
-    case 0x64 : case 0x65 : case 0x66 : case 0x67 :
-    case 0x68 : case 0x69 : case 0x6A : case 0x6B :
-    case 0x6C : case 0x6D : case 0x6E : case 0x6F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x01) { // bfill
+      _SOV_AOV_2
+    } return __block(us, US_BLK_FILL) ;
     
-    case 0x70 : case 0x71 : case 0x72 : case 0x73 :
-    case 0x74 : case 0x75 : case 0x76 : case 0x77 :
-    case 0x78 : case 0x79 : case 0x7A : case 0x7B :
-    case 0x7C : case 0x7D : case 0x7E : case 0x7F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x02) { // bcmp
+      _SOV_AOV_2
+    } return __block(us, US_BLK_CMP) ;
     
-    case 0x80 : case 0x81 : case 0x82 : case 0x83 :
-    case 0x84 : case 0x85 : case 0x86 : case 0x87 :
-    case 0x88 : case 0x89 : case 0x8A : case 0x8B :
-    case 0x8C : case 0x8D : case 0x8E : case 0x8F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    case 0x90 : case 0x91 : case 0x92 : case 0x93 :
-    case 0x94 : case 0x95 : case 0x96 : case 0x97 :
-    case 0x98 : case 0x99 : case 0x9A : case 0x9B :
-    case 0x9C : case 0x9D : case 0x9E : case 0x9F :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x03) { // bscan
+      _SOV_AOV_2
+    } return __block(us, US_BLK_SCAN) ;
     
-    case 0xA0 : case 0xA1 : case 0xA2 : case 0xA3 :
-    case 0xA4 : case 0xA5 : case 0xA6 : case 0xA7 :
-    case 0xA8 : case 0xA9 : case 0xAA : case 0xAB :
-    case 0xAC : case 0xAD : case 0xAE : case 0xAF :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x10)   // vadd.b   V, V/m128
+    __case_2(0x11)   // vadd.w   V, V/m128
+    __case_2(0x12)   // vadd.d   V, V/m128
+    __case_2(0x13)   // vadd.q   V, V/m128
+    __case_2(0x14)   // vsub.b   V, V/m128
+    __case_2(0x15)   // vsub.w   V, V/m128
+    __case_2(0x16)   // vsub.d   V, V/m128
+    __case_2(0x17)   // vsub.q   V, V/m128
+    __case_2(0x18)   // vmul.b   V, V/m128
+    __case_2(0x19)   // vmul.w   V, V/m128
+    __case_2(0x1A)   // vmul.d   V, V/m128
+    __case_2(0x1B)   // vmul.q   V, V/m128
+    __case_2(0x1C)   // vcmpeq.b V, V/m128
+    __case_2(0x1D)   // vcmpeq.w V, V/m128
+    __case_2(0x1E)   // vcmpeq.d V, V/m128
+    __case_2(0x1F)   // vcmpeq.q V, V/m128
+    __case_2(0x20)   // vcmpgt.b V, V/m128
+    __case_2(0x21)   // vcmpgt.w V, V/m128
+    __case_2(0x22)   // vcmpgt.d V, V/m128
+    __case_2(0x23)   // vcmpgt.q V, V/m128
+    __case_2(0x24) { // vshuf    V, V/m128
+      u8_t v [US_VEC_SIZE] ;
+      
+      __init_vec_2
+      __get_vec_rm(us, v)
+      __vec_alu(us->inst->op[1], us->ker.vec[us->inst->reg], v) ;
+    } __next(us)
     
-    case 0xB0 : case 0xB1 : case 0xB2 : case 0xB3 :
-    case 0xB4 : case 0xB5 : case 0xB6 : case 0xB7 :
-    case 0xB8 : case 0xB9 : case 0xBA : case 0xBB :
-    case 0xBC : case 0xBD : case 0xBE : case 0xBF :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x28) { // vld V, V/m128
+      u8_t v [US_VEC_SIZE] ;
+      
+      __init_vec_2
+      __get_vec_rm(us, v)
+      memcpy(us->ker.vec[us->inst->reg], v, US_VEC_SIZE) ;
+    } __next(us)
     
-    case 0xC0 : case 0xC1 : case 0xC2 : case 0xC3 :
-    case 0xC4 : case 0xC5 : case 0xC6 : case 0xC7 :
-    case 0xC8 : case 0xC9 : case 0xCA : case 0xCB :
-    case 0xCC : case 0xCD : case 0xCE : case 0xCF :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x29) { // vst V/m128, V
+      __init_vec_2
+      __set_vec_rm(us, us->ker.vec[us->inst->reg])
+    } __next(us)
     
-    case 0xD0 : case 0xD1 : case 0xD2 : case 0xD3 :
-    case 0xD4 : case 0xD5 : case 0xD6 : case 0xD7 :
-    case 0xD8 : case 0xD9 : case 0xDA : case 0xDB :
-    case 0xDC : case 0xDD : case 0xDE : case 0xDF :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x2A) { // vmovq V, r/m64
+      __init_vec_2
+      
+      if (3 != us->inst->mod) {
+        if (US_N_IRQS != us_read64(us, us->inst->segx, us->inst->addr, &a.u))
+          __raise_0(us)
+      } else
+        a.u = us->ker.reg[us->inst->rm] ;
+      
+      memset(us->ker.vec[us->inst->reg], 0, US_VEC_SIZE) ;
+      memcpy(us->ker.vec[us->inst->reg], &a.u, sizeof(a.u)) ;
+    } __next(us)
     
-    case 0xE0 : case 0xE1 : case 0xE2 : case 0xE3 :
-    case 0xE4 : case 0xE5 : case 0xE6 : case 0xE7 :
-    case 0xE8 : case 0xE9 : case 0xEA : case 0xEB :
-    case 0xEC : case 0xED : case 0xEE : case 0xEF :
-      __raise(us, US_IRQ_UNDEFINED_INST) ;
+    __case_2(0x2B) { // vmovq r/m64, V
+      __init_vec_2
+      
+      memcpy(&a.u, us->ker.vec[us->inst->reg], sizeof(a.u)) ;
+      
+      if (3 != us->inst->mod) {
+        if (US_N_IRQS != us_write64(us, us->inst->segx, us->inst->addr, a.u))
+          __raise_0(us)
+      } else
+        us->ker.reg[us->inst->rm] = a.u ;
+    } __next(us)
     
-    case 0xF0 : case 0xF1 : case 0xF2 : case 0xF3 :
-    case 0xF4 : case 0xF5 : case 0xF6 : case 0xF7 :
-    case 0xF8 : case 0xF9 : case 0xFA : case 0xFB :
-    case 0xFC : case 0xFD : case 0xFE : case 0xFF :
+    __undefined_2
       __raise(us, US_IRQ_UNDEFINED_INST) ;
-    
-    default :
-      __raise(us, US_IRQ_NON_MASKABLE) ;
     }
-  } break ;
-  
-  case 0x10 : case 0x11 : case 0x12 : case 0x13 :
-  case 0x14 : case 0x15 : case 0x16 : case 0x17 :
-  case 0x18 : case 0x19 : case 0x1A : case 0x1B :
-  case 0x1C : case 0x1D : case 0x1E : case 0x1F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x20 : case 0x21 : case 0x22 : case 0x23 :
-  case 0x24 : case 0x25 : case 0x26 : case 0x27 :
-  case 0x28 : case 0x29 : case 0x2A : case 0x2B :
-  case 0x2C : case 0x2D : case 0x2E : case 0x2F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x30 : case 0x31 : case 0x32 : case 0x33 :
-  case 0x34 : case 0x35 : case 0x36 : case 0x37 :
-  case 0x38 : case 0x39 : case 0x3A : case 0x3B :
-  case 0x3C : case 0x3D : case 0x3E : case 0x3F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x40 : case 0x41 : case 0x42 : case 0x43 :
-  case 0x44 : case 0x45 : case 0x46 : case 0x47 :
-  case 0x48 : case 0x49 : case 0x4A : case 0x4B :
-  case 0x4C : case 0x4D : case 0x4E : case 0x4F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x50 : case 0x51 : case 0x52 : case 0x53 :
-  case 0x54 : case 0x55 : case 0x56 : case 0x57 :
-  case 0x58 : case 0x59 : case 0x5A : case 0x5B :
-  case 0x5C : case 0x5D : case 0x5E : case 0x5F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
+  }
   
-  case 0x60 : case 0x61 : case 0x62 : case 0x63 :
-  case 0x64 : case 0x65 : case 0x66 : case 0x67 :
+  __non_maskable // prefixes
     __raise(us, US_IRQ_NON_MASKABLE) ;
   
-  case 0x68 : case 0x69 : case 0x6A : case 0x6B :
-  case 0x6C : case 0x6D : case 0x6E : case 0x6F :
+  __undefined
     __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x70 : case 0x71 : case 0x72 : case 0x73 :
-  case 0x74 : case 0x75 : case 0x76 : case 0x77 :
-  case 0x78 : case 0x79 : case 0x7A : case 0x7B :
-  case 0x7C : case 0x7D : case 0x7E : case 0x7F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x80 : case 0x81 : case 0x82 : case 0x83 :
-  case 0x84 : case 0x85 : case 0x86 : case 0x87 :
-  case 0x88 : case 0x89 : case 0x8A : case 0x8B :
-  case 0x8C : case 0x8D : case 0x8E : case 0x8F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0x90 : case 0x91 : case 0x92 : case 0x93 :
-  case 0x94 : case 0x95 : case 0x96 : case 0x97 :
-  case 0x98 : case 0x99 : case 0x9A : case 0x9B :
-  case 0x9C : case 0x9D : case 0x9E : case 0x9F :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xA0 : case 0xA1 : case 0xA2 : case 0xA3 :
-  case 0xA4 : case 0xA5 : case 0xA6 : case 0xA7 :
-  case 0xA8 : case 0xA9 : case 0xAA : case 0xAB :
-  case 0xAC : case 0xAD : case 0xAE : case 0xAF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xB0 : case 0xB1 : case 0xB2 : case 0xB3 :
-  case 0xB4 : case 0xB5 : case 0xB6 : case 0xB7 :
-  case 0xB8 : case 0xB9 : case 0xBA : case 0xBB :
-  case 0xBC : case 0xBD : case 0xBE : case 0xBF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xC0 : case 0xC1 : case 0xC2 : case 0xC3 :
-  case 0xC4 : case 0xC5 : case 0xC6 : case 0xC7 :
-  case 0xC8 : case 0xC9 : case 0xCA : case 0xCB :
-  case 0xCC : case 0xCD : case 0xCE : case 0xCF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xD0 : case 0xD1 : case 0xD2 : case 0xD3 :
-  case 0xD4 : case 0xD5 : case 0xD6 : case 0xD7 :
-  case 0xD8 : case 0xD9 : case 0xDA : case 0xDB :
-  case 0xDC : case 0xDD : case 0xDE : case 0xDF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xE0 : case 0xE1 : case 0xE2 : case 0xE3 :
-  case 0xE4 : case 0xE5 : case 0xE6 : case 0xE7 :
-  case 0xE8 : case 0xE9 : case 0xEA : case 0xEB :
-  case 0xEC : case 0xED : case 0xEE : case 0xEF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  case 0xF0 : case 0xF1 : case 0xF2 : case 0xF3 :
-  case 0xF4 : case 0xF5 : case 0xF6 : case 0xF7 :
-  case 0xF8 : case 0xF9 : case 0xFA : case 0xFB :
-  case 0xFC : case 0xFD : case 0xFE : case 0xFF :
-    __raise(us, US_IRQ_UNDEFINED_INST) ;
-  
-  default :
-    __raise(us, US_IRQ_NON_MASKABLE) ;
   }
-  
-  // update the next instruction pointer
-  us->ker.reg[US_REG_IP] += us->inst.cp ;
-  
-  return US_N_IRQS ;
 }
 
-u32_t us_clock (
-  us_t * us
+static inline u32_t __clock (
+  us_t * us    ,
+  u8_t   chain
 )
 {
   // check the clocks
-  if (us->opt.max_clocks != us->ker.reg[US_REG_CLOCK])
+  if (us->opt.max_clocks == us->ker.reg[US_REG_CLOCK])
     return us_int(us, US_IRQ_OUT_OF_CLOCKS) ;
 
-  if (0 == us->inst.has_REP) {
-    // clear the previous instruction
-    memset(&us->inst, 0, sizeof(us->inst)) ;
-    
-    // fetch the instruction
-    if (US_N_IRQS != __fetch_inst(us))
-      return us->IRQ ;
-  }
+  // run the translated block
+  
+  us_jit_block_t * block = us_jit_lookup(us) ;
+  
+  if (NULL != block)
+    return us_jit_exec(us, block) ;
+  
+  // fetch the instruction (a repeated one, until it moves IP)
+  if (US_N_IRQS != __fetch_inst(us))
+    return us->IRQ ;
   
   if (0 != us->opt.verbose) {
     fprintf(
@@ -775,15 +1078,31 @@ u32_t us_clock (
       us->ker.reg[US_REG_CLOCK] ,
       us->ker.seg[US_SEG_CODE]  ,
       us->ker.reg[US_REG_IP]    ,
-      us->inst.code[0], us->inst.code[1], us->inst.code[2], us->inst.code[3],
-      us->inst.code[8], us->inst.code[5], us->inst.code[6], us->inst.code[7],
-      us->inst.code[8], us->inst.code[9], us->inst.code[10], us->inst.code[11],
-      us->inst.code[12], us->inst.code[13], us->inst.code[14], us->inst.code[15]
+      us->inst->code[0], us->inst->code[1], us->inst->code[2], us->inst->code[3],
+      us->inst->code[8], us->inst->code[5], us->inst->code[6], us->inst->code[7],
+      us->inst->code[8], us->inst->code[9], us->inst->code[10], us->inst->code[11],
+      us->inst->code[12], us->inst->code[13], us->inst->code[14], us->inst->code[15]
     ) ;
   }
   
-  // execute the instruction
-  if (US_N_IRQS != __exec_inst(us))
+  // count the instruction
+  if (NULL != us->prof)
+    __prof_inst(us) ;
+  
+  // trace the instruction
+  if (NULL != us->tracer)
+    __trace_inst(us) ;
+  
+  // the verbose output, the profiler, the tracer and the recorder (see
+  // `usrpl.c`) see every clock
+  if (
+    0 != us->opt.verbose || NULL != us->prof || NULL != us->tracer ||
+    (NULL != us->replay && NULL != us->replay->fp)
+  )
+    chain = 0 ;
+  
+  // execute the instruction, and the next ones with no check to do
+  if (US_N_IRQS != __exec_inst(us, chain))
     return us->IRQ ;
   
   // update the clock counter
@@ -791,3 +1110,137 @@ u32_t us_clock (
   
   return US_N_IRQS ;
 }
+
+u32_t us_clock (
+  us_t * us
+)
+{
+  // the host may have set the flag I
+  __sched_unmask(us) ;
+  
+  // one clock, bounded only by the clocks limit and the next event
+  
+  if (us->sched.seen != us->sched.wake) {
+    if (NULL == us->replay)
+      __sched_inject(us) ;
+    else
+      __replay_inject(us) ;
+  }
+  
+  if (NULL != us->replay)
+    us->replay->clock = us->ker.reg[US_REG_CLOCK] ;
+  
+  if (us->sched.next <= us->ker.reg[US_REG_CLOCK]) {
+    u32_t IRQ = __sched_run(us) ;
+    
+    if (US_N_IRQS != IRQ)
+      return IRQ ;
+  }
+  
+  us->limit = __sched_limit(us, us->opt.max_clocks) ;
+  
+  // the halted machine skips to the next event, or sleeps with no event
+  if (0 != us->idle && us->opt.max_clocks != us->ker.reg[US_REG_CLOCK]) {
+    if (0 != __sched_idle(us, us->opt.max_clocks))
+      us_wait(us) ;
+    
+    // the limit of clocks is reached at this call
+    if (us->opt.max_clocks != us->ker.reg[US_REG_CLOCK])
+      return US_N_IRQS ;
+  }
+  
+  return __clock(us, 0) ;
+}
+
+u32_t us_run (
+  us_t * us     ,
+  u64_t  budget
+)
+{
+  u64_t clock = us->ker.reg[US_REG_CLOCK] ;
+  u64_t IRQs  = 0 ; // interrupts (they do not update the clock counter)
+  
+  // the host may have set the flag I
+  __sched_unmask(us) ;
+  
+  // the translated blocks cannot run beyond the budget and the next event
+  
+  u64_t end = clock + budget ;
+  
+  if (end < clock || us->opt.max_clocks < end)
+    end = us->opt.max_clocks ;
+  
+  us->limit = __sched_limit(us, end) ;
+  
+  for (;;) {
+    if (0 == (us->ker.reg[US_REG_FLAGS] & US_FLAG_1))
+      return US_EXIT_HALT ;
+    
+    if (0 != __atomic_load_n(&us->stop, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&us->stop, 0, __ATOMIC_RELAXED) ;
+      return US_EXIT_HOST ;
+    }
+    
+    if (budget <= us->ker.reg[US_REG_CLOCK] - clock + IRQs)
+      return US_EXIT_BUDGET ;
+    
+    u32_t IRQ = US_N_IRQS ;
+    
+    // merge the interrupts injected by the other threads
+    if (us->sched.seen != us->sched.wake) {
+      if (NULL == us->replay)
+        __sched_inject(us) ;
+      else
+        __replay_inject(us) ;
+    }
+    
+    // a pass at this clock (see `usrpl.c`)
+    if (NULL != us->replay)
+      us->replay->clock = us->ker.reg[US_REG_CLOCK] ;
+    
+    // run the events at their deadline
+    if (us->sched.next <= us->ker.reg[US_REG_CLOCK]) {
+      IRQ = __sched_run(us) ;
+      us->limit = __sched_limit(us, end) ;
+    }
+    
+    if (US_N_IRQS == IRQ) {
+      // the halted machine skips to the next event
+      if (0 != us->idle && us->opt.max_clocks != us->ker.reg[US_REG_CLOCK]) {
+        if (0 != __sched_idle(us, end))
+          return US_EXIT_IDLE ;
+        
+        continue ;
+      }
+      
+      IRQ = __clock(us, 1) ;
+    }
+    
+    if (US_N_IRQS != IRQ) {
+      if (US_IRQ_BREAKPOINT == IRQ)
+        return US_EXIT_BREAK ;
+      
+      if (0 == us->ISR || US_IRQ_OUT_OF_CLOCKS == IRQ)
+        return US_EXIT_IRQ ;
+      
+      ++IRQs ;
+      
+      // the interrupts take their part of the budget
+      if (clock <= end && budget - IRQs < end - clock) {
+        end       = clock + budget - IRQs ;
+        us->limit = __sched_limit(us, end) ;
+      }
+    }
+  }
+}
+
+void us_stop (
+  us_t * us
+)
+{
+  // checked by `us_run` between the clocks
+  __atomic_store_n(&us->stop, 1, __ATOMIC_RELEASE) ;
+  
+  // wake the thread sleeping in `us_wait`
+  __sched_wake(us) ;
+}
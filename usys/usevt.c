@@ -0,0 +1,341 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#elif defined(_WIN32)
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+// =============================================================================
+// Event Scheduler
+// -----------------------------------------------------------------------------
+// The events of a machine (timer interrupts, device completions, deferred
+// work) are kept in a min-heap on their deadline, in clocks. The run loop
+// compares the clock with the next deadline only, and the translated blocks
+// and the repeated instructions are bounded to it (see `us_run`), so that an
+// event fires before the instruction at its clock. The interrupts of the
+// events wait while the flag I is clear, then the lowest one is delivered at
+// every clock. The events are host state, the clones and the snapshots do
+// not inherit them.
+// A machine halted by `hlt` executes nothing: its clock jumps to the next
+// deadline, or to the end of the run (the budget or the limit of clocks). With
+// no event and no limit of clocks, `us_run` returns and the host thread sleeps
+// in `us_wait` until another thread injects an interrupt or stops the machine.
+// -----------------------------------------------------------------------------
+// Add an event:
+//   1. assign the identifier and push the event into the heap
+//   2. bound the current run to the deadline
+// Run the events:
+//   1. pop the events whose deadline has been reached, call them and mark
+//      their interrupts as pending
+//   2. push again the periodic events, skipping the missed periods
+//   3. deliver the lowest pending interrupt, if the flag I is set
+//   4. set the clock of the next check (the next clock while an interrupt is
+//      pending and the flag I is set, `iret` and the host set it again when
+//      they set the flag I)
+// Inject an interrupt (from any thread):
+//   1. mark the interrupt in the injected ones
+//   2. bump the futex word and wake the sleeping thread
+//   3. the machine merges the injected interrupts into the pending ones
+//      between the clocks
+// =============================================================================
+
+u32_t __event_before (
+  const us_event_t * a ,
+  const us_event_t * b
+)
+{
+  // the events with the same deadline fire in order of addition
+  if (a->clock != b->clock)
+    return a->clock < b->clock ;
+  
+  return a->id < b->id ;
+}
+
+void __sched_up (
+  us_sched_t * sched ,
+  u32_t        i
+)
+{
+  us_event_t ev = sched->heap[i] ;
+  
+  while (0 < i && __event_before(&ev, sched->heap + (i - 1) / 2)) {
+    sched->heap[i] = sched->heap[(i - 1) / 2] ;
+    i = (i - 1) / 2 ;
+  }
+  
+  sched->heap[i] = ev ;
+}
+
+void __sched_down (
+  us_sched_t * sched ,
+  u32_t        i
+)
+{
+  us_event_t ev = sched->heap[i] ;
+  
+  for (;;) {
+    u32_t child = 2 * i + 1 ;
+    
+    if (sched->n <= child)
+      break ;
+    
+    if (
+      child + 1 < sched->n &&
+      __event_before(sched->heap + child + 1, sched->heap + child)
+    )
+      ++child ;
+    
+    if (!__event_before(sched->heap + child, &ev))
+      break ;
+    
+    sched->heap[i] = sched->heap[child] ;
+    i = child ;
+  }
+  
+  sched->heap[i] = ev ;
+}
+
+u32_t __sched_pending (
+  us_sched_t * sched
+)
+{
+  for (int i = 0 ; i < US_N_IRQS / 64 ; ++i) {
+    if (0 != sched->pending[i])
+      return i * 64 + __builtin_ctzll(sched->pending[i]) ;
+  }
+  
+  return US_N_IRQS ;
+}
+
+void __sched_next (
+  us_t * us
+)
+{
+  // the masked interrupts wait for `__sched_unmask`
+  if (
+    US_N_IRQS != __sched_pending(&us->sched) &&
+    0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_I)
+  )
+    us->sched.next = us->ker.reg[US_REG_CLOCK] + 1 ;
+  else if (0 != us->sched.n)
+    us->sched.next = us->sched.heap[0].clock ;
+  else
+    us->sched.next = (u64_t)-1 ;
+}
+
+u64_t __sched_limit (
+  us_t * us  ,
+  u64_t  end
+)
+{
+  // at least one clock, the events fire between the clocks
+  
+  u64_t next = us->sched.next ;
+  
+  if (next <= us->ker.reg[US_REG_CLOCK])
+    next = us->ker.reg[US_REG_CLOCK] + 1 ;
+  
+  return (next < end) ? next : end ;
+}
+
+u32_t us_sched_add (
+        us_t *       us ,
+  const us_event_t * ev ,
+        u32_t *      id
+)
+{
+  if (US_SCHED_SIZE == us->sched.n)
+    return 1 ;
+  
+  us_event_t * slot = us->sched.heap + us->sched.n ;
+  
+  *slot    = *ev ;
+  slot->id = ++us->sched.id ;
+  
+  if (NULL != id)
+    *id = slot->id ;
+  
+  __sched_up(&us->sched, us->sched.n++) ;
+  __sched_next(us) ;
+  
+  // bound the current run
+  us->limit = __sched_limit(us, us->limit) ;
+  
+  return 0 ;
+}
+
+u32_t us_sched_cancel (
+  us_t * us ,
+  u32_t  id
+)
+{
+  for (u32_t i = 0 ; i < us->sched.n ; ++i) {
+    if (us->sched.heap[i].id != id)
+      continue ;
+    
+    // replace the event with the last one
+    
+    us->sched.heap[i] = us->sched.heap[--us->sched.n] ;
+    
+    if (i < us->sched.n) {
+      __sched_up(&us->sched, i) ;
+      __sched_down(&us->sched, i) ;
+    }
+    
+    __sched_next(us) ;
+    
+    return 0 ;
+  }
+  
+  return 1 ;
+}
+
+u32_t __sched_run (
+  us_t * us
+)
+{
+  u64_t clock = us->ker.reg[US_REG_CLOCK] ;
+  
+  // fire the events
+  
+  while (0 != us->sched.n && us->sched.heap[0].clock <= clock) {
+    us_event_t ev  = us->sched.heap[0] ;
+    us_event_t due = ev ;
+    
+    us->sched.heap[0] = us->sched.heap[--us->sched.n] ;
+    __sched_down(&us->sched, 0) ;
+    
+    if (0 != ev.period) {
+      // the missed periods fire once
+      ev.clock += ((clock - ev.clock) / ev.period + 1) * ev.period ;
+      
+      us->sched.heap[us->sched.n] = ev ;
+      __sched_up(&us->sched, us->sched.n++) ;
+    }
+    
+    u32_t IRQ = (NULL != due.fire) ? ev.fire(us, &due) : ev.IRQ ;
+    
+    if (IRQ < US_N_IRQS)
+      us->sched.pending[IRQ / 64] |= (u64_t)1 << (IRQ % 64) ;
+  }
+  
+  // deliver the lowest pending interrupt
+  
+  u32_t IRQ = __sched_pending(&us->sched) ;
+  
+  if (US_N_IRQS != IRQ && 0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_I)) {
+    us->sched.pending[IRQ / 64] &= ~((u64_t)1 << (IRQ % 64)) ;
+    
+    // the ISR runs with the flag I clear
+    IRQ = us_int(us, IRQ) ;
+    
+    __sched_next(us) ;
+    
+    return IRQ ;
+  }
+  
+  __sched_next(us) ;
+  
+  return US_N_IRQS ;
+}
+
+void __sched_unmask (
+  us_t * us
+)
+{
+  // the flag I has been set, check the pending interrupts at the next clock
+  if (
+    US_N_IRQS != __sched_pending(&us->sched) &&
+    0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_I)
+  ) {
+    us->sched.next = us->ker.reg[US_REG_CLOCK] + 1 ;
+    us->limit      = __sched_limit(us, us->limit) ;
+  }
+}
+
+void __sched_inject (
+  us_t * us
+)
+{
+  // the interrupts are marked before the futex word is bumped
+  us->sched.seen = __atomic_load_n(&us->sched.wake, __ATOMIC_ACQUIRE) ;
+  
+  for (int i = 0 ; i < US_N_IRQS / 64 ; ++i)
+    us->sched.pending[i] |= __atomic_exchange_n(us->sched.inject + i, 0, __ATOMIC_ACQ_REL) ;
+  
+  // deliver them at this clock
+  if (US_N_IRQS != __sched_pending(&us->sched))
+    us->sched.next = us->ker.reg[US_REG_CLOCK] ;
+}
+
+u32_t __sched_idle (
+  us_t * us  ,
+  u64_t  end
+)
+{
+  // only an injected interrupt can wake the machine (with no limit of clocks)
+  if (0 == us->sched.n && (u64_t)-1 == us->opt.max_clocks)
+    return 1 ;
+  
+  // skip the clocks up to the next deadline or up to the end
+  
+  u64_t clock = end ;
+  
+  if (0 != us->sched.n && us->sched.heap[0].clock < clock)
+    clock = us->sched.heap[0].clock ;
+  
+  if (us->ker.reg[US_REG_CLOCK] < clock)
+    us->ker.reg[US_REG_CLOCK] = clock ;
+  
+  return 0 ;
+}
+
+void __sched_wake (
+  us_t * us
+)
+{
+  __atomic_fetch_add(&us->sched.wake, 1, __ATOMIC_RELEASE) ;
+
+#if defined(__linux__)
+  syscall(SYS_futex, &us->sched.wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) ;
+#endif
+}
+
+void us_inject (
+  us_t * us  ,
+  u32_t  IRQ
+)
+{
+  if (US_N_IRQS <= IRQ)
+    return ;
+  
+  __atomic_fetch_or(us->sched.inject + IRQ / 64, (u64_t)1 << (IRQ % 64), __ATOMIC_RELEASE) ;
+  __sched_wake(us) ;
+}
+
+void us_wait (
+  us_t * us
+)
+{
+  u32_t seen = us->sched.seen ;
+  
+  // the futex word has not changed since the last merge
+  
+  while (seen == __atomic_load_n(&us->sched.wake, __ATOMIC_ACQUIRE)) {
+#if defined(__linux__)
+    syscall(SYS_futex, &us->sched.wake, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0) ;
+#elif defined(_WIN32)
+    Sleep(1) ;
+#else
+    usleep(1000) ;
+#endif
+  }
+}
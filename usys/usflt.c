@@ -0,0 +1,361 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _WIN32
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+// =============================================================================
+// Fleet
+// -----------------------------------------------------------------------------
+// A fleet runs many machines in the same process, one for each job, on a pool
+// of host threads. Every thread owns a double-ended queue of jobs: the owner
+// pops the jobs from the tail, while the idle threads steal them from the head
+// of the other queues. A machine runs for a quantum of clocks per turn (its
+// own, or the one of the fleet), then it is preempted and pushed back at the
+// head of the queue, behind the other jobs. A thread with no job to steal
+// sleeps until a job is pushed back or the last one ends. The machines do not
+// share any state (the host timers of the samplers included, see `ussmp.c`),
+// so they need no synchronization.
+// -----------------------------------------------------------------------------
+// Run the fleet:
+//   1. create the queues and deal the jobs among them
+//   2. start the threads (the caller is the first one)
+//   3. wait for the threads and sum the executed clocks
+// Run a worker:
+//   1. pop a job from its own queue or steal it from the others, otherwise
+//      sleep until a job is pushed back
+//   2. load the machine at its first turn
+//   3. run the machine for a quantum of clocks
+//   4. push the job back and wake a sleeping thread if it has not ended,
+//      otherwise free the machine (and wake every thread after the last one)
+// =============================================================================
+
+void __fleet_lock (
+  us_fleet_queue_t * queue
+)
+{
+  while (0 != __atomic_exchange_n(&queue->lock, 1, __ATOMIC_ACQUIRE))
+    while (0 != __atomic_load_n(&queue->lock, __ATOMIC_RELAXED)) ;
+}
+
+void __fleet_unlock (
+  us_fleet_queue_t * queue
+)
+{
+  __atomic_store_n(&queue->lock, 0, __ATOMIC_RELEASE) ;
+}
+
+void __fleet_push (
+  us_fleet_queue_t * queue ,
+  us_job_t *         job
+)
+{
+  u32_t size = queue->fleet->n_jobs + 1 ;
+  
+  __fleet_lock(queue) ;
+  
+  queue->job[(queue->head + size - 1) % size] = job ;
+  __atomic_store_n(&queue->head, (queue->head + size - 1) % size, __ATOMIC_RELAXED) ;
+  
+  __fleet_unlock(queue) ;
+}
+
+us_job_t * __fleet_pop (
+  us_fleet_queue_t * queue
+)
+{
+  u32_t      size = queue->fleet->n_jobs + 1 ;
+  us_job_t * job  = NULL ;
+  
+  __fleet_lock(queue) ;
+  
+  if (queue->head != queue->tail) {
+    job = queue->job[(queue->tail + size - 1) % size] ;
+    __atomic_store_n(&queue->tail, (queue->tail + size - 1) % size, __ATOMIC_RELAXED) ;
+  }
+  
+  __fleet_unlock(queue) ;
+  
+  return job ;
+}
+
+us_job_t * __fleet_steal (
+  us_fleet_queue_t * queue
+)
+{
+  u32_t      size = queue->fleet->n_jobs + 1 ;
+  us_job_t * job  = NULL ;
+  
+  // do not wait for an empty queue
+  if (
+    __atomic_load_n(&queue->head, __ATOMIC_RELAXED) ==
+    __atomic_load_n(&queue->tail, __ATOMIC_RELAXED)
+  )
+    return NULL ;
+  
+  __fleet_lock(queue) ;
+  
+  if (queue->head != queue->tail) {
+    job = queue->job[queue->head] ;
+    __atomic_store_n(&queue->head, (queue->head + 1) % size, __ATOMIC_RELAXED) ;
+  }
+  
+  __fleet_unlock(queue) ;
+  
+  return job ;
+}
+
+u32_t __fleet_turn (
+  us_fleet_t * fleet ,
+  us_job_t *   job
+)
+{
+  if (NULL == job->us) {
+    // load the machine
+    job->us = (us_t *)calloc(1, sizeof(us_t)) ;
+    
+    if (NULL == job->us) {
+      fprintf(stderr, "error: cannot allocate the machine of `%s`\n", job->img) ;
+      job->failed = 1 ;
+      return 0 ;
+    }
+    
+    job->us->opt = fleet->opt ;
+    
+    if (0 != us_load_img(job->us, job->img)) {
+      free(job->us) ;
+      job->us     = NULL ;
+      job->failed = 1    ;
+      return 0 ;
+    }
+    
+    // a snapshot keeps its options
+    job->us->opt = fleet->opt ;
+    
+    // start the machine
+    job->us->ker.reg[US_REG_FLAGS] |= US_FLAG_1 ;
+  }
+  
+  us_t * us = job->us ;
+  
+  job->exit   = us_run(us, (0 != job->quantum) ? job->quantum : fleet->quantum) ;
+  job->IRQ    = us->IRQ                    ;
+  job->clocks = us->ker.reg[US_REG_CLOCK]  ;
+  
+  switch (job->exit) {
+  case US_EXIT_BUDGET :
+    return 1 ;
+  
+  case US_EXIT_IRQ   :
+  case US_EXIT_BREAK :
+    if (0 != us->opt.verbose)
+      fprintf(stderr, "interrupt: 0x%02X\n", us->IRQ) ;
+    
+    // the limit of clocks has been reached
+    if (US_IRQ_OUT_OF_CLOCKS != us->IRQ)
+      return 1 ;
+  }
+  
+  // the job has ended
+  
+  us_free(us) ;
+  free(us) ;
+  
+  job->us = NULL ;
+  
+  return 0 ;
+}
+
+void __fleet_wake (
+  us_fleet_t * fleet ,
+  u8_t         all
+)
+{
+#ifndef _WIN32
+  pthread_mutex_lock(&fleet->lock) ;
+  
+  __atomic_fetch_add(&fleet->turns, 1, __ATOMIC_RELEASE) ;
+  
+  if (0 != all)
+    pthread_cond_broadcast(&fleet->cond) ;
+  else
+    pthread_cond_signal(&fleet->cond) ;
+  
+  pthread_mutex_unlock(&fleet->lock) ;
+#endif
+}
+
+void __fleet_sleep (
+  us_fleet_t * fleet ,
+  u32_t        turns
+)
+{
+#ifndef _WIN32
+  pthread_mutex_lock(&fleet->lock) ;
+  
+  // no job has been pushed back since the thread has looked for one
+  
+  while (
+    turns == __atomic_load_n(&fleet->turns, __ATOMIC_ACQUIRE) &&
+    0 != __atomic_load_n(&fleet->left, __ATOMIC_ACQUIRE)
+  )
+    pthread_cond_wait(&fleet->cond, &fleet->lock) ;
+  
+  pthread_mutex_unlock(&fleet->lock) ;
+#endif
+}
+
+any_t __fleet_worker (
+  any_t arg
+)
+{
+  us_fleet_queue_t * queue = (us_fleet_queue_t *)arg ;
+  us_fleet_t *       fleet = queue->fleet ;
+  
+  u32_t id = queue - fleet->queue ;
+  
+  while (0 != __atomic_load_n(&fleet->left, __ATOMIC_ACQUIRE)) {
+    u32_t turns = __atomic_load_n(&fleet->turns, __ATOMIC_ACQUIRE) ;
+    
+    us_job_t * job = __fleet_pop(queue) ;
+    
+    for (u32_t i = 1 ; NULL == job && i < fleet->n_threads ; ++i)
+      job = __fleet_steal(fleet->queue + (id + i) % fleet->n_threads) ;
+    
+    if (NULL == job) {
+      // the other jobs are running
+      __fleet_sleep(fleet, turns) ;
+      continue ;
+    }
+    
+    if (0 != __fleet_turn(fleet, job)) {
+      __fleet_push(queue, job) ;
+      __fleet_wake(fleet, 0) ;
+      continue ;
+    }
+    
+    __atomic_fetch_add(&fleet->clocks, job->clocks, __ATOMIC_RELAXED) ;
+    
+    // the last job wakes the sleeping threads to exit
+    if (1 == __atomic_fetch_sub(&fleet->left, 1, __ATOMIC_RELEASE))
+      __fleet_wake(fleet, 1) ;
+  }
+  
+  return NULL ;
+}
+
+u32_t us_fleet_run (
+  us_fleet_t * fleet
+)
+{
+  if (0 == fleet->n_jobs)
+    return 0 ;
+  
+  if (0 == fleet->quantum)
+    fleet->quantum = US_FLEET_QUANTUM ;
+
+#ifdef _WIN32
+  fleet->n_threads = 1 ;
+#else
+  if (0 == fleet->n_threads) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN) ;
+    fleet->n_threads = 0 < cores ? cores : 1 ;
+  }
+#endif
+  
+  if (fleet->n_jobs < fleet->n_threads)
+    fleet->n_threads = fleet->n_jobs ;
+  
+  // create the queues
+  
+  fleet->queue = (us_fleet_queue_t *)calloc(fleet->n_threads, sizeof(us_fleet_queue_t)) ;
+  
+  if (NULL == fleet->queue) {
+    fprintf(stderr, "error: cannot allocate the fleet\n") ;
+    return 1 ;
+  }
+  
+  for (u32_t i = 0 ; i < fleet->n_threads ; ++i) {
+    fleet->queue[i].fleet = fleet ;
+    fleet->queue[i].job   = (us_job_t **)calloc(fleet->n_jobs + 1, sizeof(us_job_t *)) ;
+    
+    if (NULL == fleet->queue[i].job) {
+      for (u32_t j = 0 ; j < i ; ++j)
+        free(fleet->queue[j].job) ;
+      
+      free(fleet->queue) ;
+      fleet->queue = NULL ;
+      
+      fprintf(stderr, "error: cannot allocate the fleet\n") ;
+      return 1 ;
+    }
+  }
+  
+  // deal the jobs
+  
+  for (u32_t i = 0 ; i < fleet->n_jobs ; ++i) {
+    us_fleet_queue_t * queue = fleet->queue + i % fleet->n_threads ;
+    
+    queue->job[queue->tail++] = fleet->job + i ;
+  }
+  
+  fleet->left   = fleet->n_jobs ;
+  fleet->turns  = 0             ;
+  fleet->clocks = 0             ;
+  
+  struct timespec start ;
+  struct timespec end   ;
+  
+  timespec_get(&start, TIME_UTC) ;
+  
+  // run the workers
+
+#ifdef _WIN32
+  __fleet_worker(fleet->queue) ;
+#else
+  pthread_mutex_init(&fleet->lock, NULL) ;
+  pthread_cond_init(&fleet->cond, NULL) ;
+  
+  pthread_t * thread = (pthread_t *)calloc(fleet->n_threads, sizeof(pthread_t)) ;
+  u32_t       n      = 1 ;
+  
+  if (NULL != thread) {
+    for (; n < fleet->n_threads ; ++n) {
+      if (0 != pthread_create(thread + n, NULL, __fleet_worker, fleet->queue + n)) {
+        fprintf(stderr, "warning: cannot start more than %u threads\n", n) ;
+        break ;
+      }
+    }
+  }
+  
+  // the jobs of a missing thread are stolen by the others
+  __fleet_worker(fleet->queue) ;
+  
+  for (u32_t i = 1 ; NULL != thread && i < n ; ++i)
+    pthread_join(thread[i], NULL) ;
+  
+  free(thread) ;
+  
+  pthread_cond_destroy(&fleet->cond) ;
+  pthread_mutex_destroy(&fleet->lock) ;
+#endif
+  
+  timespec_get(&end, TIME_UTC) ;
+  
+  fleet->time = (u64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec ;
+  
+  // destroy the queues
+  
+  for (u32_t i = 0 ; i < fleet->n_threads ; ++i)
+    free(fleet->queue[i].job) ;
+  
+  free(fleet->queue) ;
+  fleet->queue = NULL ;
+  
+  return 0 ;
+}
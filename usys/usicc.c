@@ -0,0 +1,167 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// =============================================================================
+// Instruction Cache
+// -----------------------------------------------------------------------------
+// The decoded instructions are cached by their far pointer (CS:IP), so that the
+// hot code is read from memory and decoded only once. An entry does not depend
+// on the registers: the effective address is computed at every execution. The
+// cache is set associative and indexed by the start of the instructions, the
+// instructions are decoded in their entry and executed from there.
+// -----------------------------------------------------------------------------
+// Look up an instruction:
+//   1. flush the cache if the address space has changed (flag V or SDT)
+//   2. select the set from the far pointer
+//   3. compare the far pointer and the privilege level with the ones of the
+//      entries (the code segment was checked at that level)
+// Fill an entry:
+//   1. decode the instruction into the oldest entry of the set
+//   2. tag it with the far pointer and the privilege level
+//   3. mark the pages holding the instruction in the code pages filter
+// Write into the memory:
+//   1. check the written pages against the code pages filter
+//   2. flush the cache if one of them can hold cached code (start a new
+//      generation, the entries of the older ones are invalid)
+// =============================================================================
+
+u64_t __icache_set (
+  u16_t segx ,
+  u64_t IP
+)
+{
+  return (IP ^ ((u64_t)segx << 8)) & (US_ICACHE_SETS - 1) ;
+}
+
+u64_t __icache_page (
+  u64_t addr
+)
+{
+  return (addr >> US_ICACHE_PAGE_BITS) & (US_ICACHE_FILTER - 1) ;
+}
+
+us_icache_entry_t * us_icache_lookup (
+  us_t * us
+)
+{
+  u64_t V = us->ker.reg[US_REG_FLAGS] & US_FLAG_V ;
+  
+  // check the address space
+  if (us->icache.V != V || us->icache.SDT != us->ker.reg[US_REG_SDT]) {
+    us_icache_flush(us) ;
+    
+    us->icache.V   = V ;
+    us->icache.SDT = us->ker.reg[US_REG_SDT] ;
+    
+    return NULL ;
+  }
+  
+  u16_t segx = us->ker.seg[US_SEG_CODE] ;
+  u64_t IP   = us->ker.reg[US_REG_IP] ;
+  u8_t  PL   = (us->ker.reg[US_REG_FLAGS] >> 12) & 3 ;
+  u64_t set  = __icache_set(segx, IP) ;
+  
+  us_icache_entry_t * entry = us->icache.entry + set * US_ICACHE_WAYS ;
+  
+  for (u32_t way = 0 ; way < US_ICACHE_WAYS ; ++way, ++entry) {
+    if (entry->gen == us->icache.gen && entry->IP == IP && entry->segx == segx && entry->PL == PL) {
+      us->icache.old[set] = way ^ 1 ;
+      return entry ;
+    }
+  }
+  
+  return NULL ;
+}
+
+us_icache_entry_t * us_icache_victim (
+  us_t * us
+)
+{
+  u64_t set = __icache_set(us->ker.seg[US_SEG_CODE], us->ker.reg[US_REG_IP]) ;
+  
+  us_icache_entry_t * entry = us->icache.entry + set * US_ICACHE_WAYS + us->icache.old[set] ;
+  
+  // the entry is valid again when the decoding succeeds
+  entry->gen = 0 ;
+  
+  return entry ;
+}
+
+void us_icache_fill (
+  us_t *              us    ,
+  us_icache_entry_t * entry ,
+  u64_t               phys
+)
+{
+  u64_t set = __icache_set(us->ker.seg[US_SEG_CODE], us->inst->IP) ;
+  
+  entry->segx = us->ker.seg[US_SEG_CODE] ;
+  entry->IP   = us->inst->IP ;
+  entry->PL   = (us->ker.reg[US_REG_FLAGS] >> 12) & 3 ;
+  entry->gen  = us->icache.gen ;
+  
+  // the other entry of the set is the oldest
+  us->icache.old[set] = (entry - us->icache.entry) % US_ICACHE_WAYS ^ 1 ;
+  
+  // the instruction can lie across two pages
+  
+  u64_t page ;
+  
+  page = __icache_page(phys) ;
+  us->icache.filter[page >> 6] |= (u64_t)1 << (page & 63) ;
+  
+  page = __icache_page(phys + us->inst->cp - 1) ;
+  us->icache.filter[page >> 6] |= (u64_t)1 << (page & 63) ;
+}
+
+void us_icache_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  if (0 == size)
+    return ;
+  
+  u64_t first = addr >> US_ICACHE_PAGE_BITS ;
+  u64_t last  = (addr + size - 1) >> US_ICACHE_PAGE_BITS ;
+  
+  // the filter wraps around, every page is checked
+  if (US_ICACHE_FILTER <= last - first) {
+    us_icache_flush(us) ;
+    return ;
+  }
+  
+  for (u64_t i = first ; i <= last ; ++i) {
+    u64_t page = i & (US_ICACHE_FILTER - 1) ;
+    
+    if (0 != (us->icache.filter[page >> 6] & ((u64_t)1 << (page & 63)))) {
+      us_icache_flush(us) ;
+      return ;
+    }
+  }
+}
+
+void us_icache_flush (
+  us_t * us
+)
+{
+  if (0 != us->opt.verbose)
+    fprintf(stderr, ">>> Flush the instruction cache\n") ;
+  
+  // a new generation invalidates the entries, they are cleared when it wraps
+  
+  if (0 == ++us->icache.gen) {
+    for (int i = 0 ; i < US_ICACHE_SIZE ; ++i)
+      us->icache.entry[i].gen = 0 ;
+    
+    us->icache.gen = 1 ;
+  }
+  
+  memset(us->icache.filter, 0, sizeof(us->icache.filter)) ;
+  
+  // the translated code is decoded from the cache
+  us_jit_flush(us) ;
+}
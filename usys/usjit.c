@@ -0,0 +1,610 @@
+#include "us.h"
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+# include <sys/mman.h>
+#endif
+
+// =============================================================================
+// Block Translator
+// -----------------------------------------------------------------------------
+// The hot basic blocks are translated into x86-64 host code. A block starts at
+// CS:IP and ends before the first instruction that changes the control flow
+// (`int`, `iret`, breakpoint), repeats or cannot be decoded, so its exit is
+// always the next instruction and the blocks are chained by a direct jump.
+// The register to register arithmetic is translated inline (recording its
+// operands for the flags), every other instruction calls `__exec_inst` with its
+// decoded copy.
+// -----------------------------------------------------------------------------
+// Host code of a block (`rbx` holds the machine):
+//   exit_0 : mov eax, US_N_IRQS
+//   exit   : pop rbx
+//            ret
+//   entry  : push rbx
+//            mov rbx, rdi
+//   check  : if the clocks left are less than the instructions, goto exit_0
+//            instructions (the clock and IP are updated before a call)
+//            update the clock and IP, save the block to be chained
+//   chain  : jmp exit_0 (then patched to `check` of the next block)
+// -----------------------------------------------------------------------------
+// Look up a block:
+//   1. flush the translated code if it has been overwritten
+//   2. hash the far pointer to select the block
+//   3. count the executions and translate it when it becomes hot
+//   4. chain the last exited block to this one
+//   5. check that the clocks left are enough to run the whole block
+// A block that cannot be translated is marked, the interpreter runs it and
+// chains the next instructions through it (see `us_jit_skip`).
+// =============================================================================
+
+u64_t __jit_hash (
+  u16_t segx ,
+  u64_t IP
+)
+{
+  return (IP ^ ((u64_t)segx << 7) ^ (IP >> 10)) & (US_JIT_SIZE - 1) ;
+}
+
+void us_jit_flush (
+  us_t * us
+)
+{
+  // the code can be running, it is cleared by the next look up
+  us->jit.stale = 1 ;
+}
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+u32_t __jit_exec_inst (
+        us_t *      us   ,
+  const us_inst_t * inst
+)
+{
+  // the data is not writable (see `__jit_protect`)
+  us->spare = *inst      ;
+  us->inst  = &us->spare ;
+  
+  // execute the instruction
+  if (US_N_IRQS != __exec_inst(us, 0))
+    return us->IRQ ;
+  
+  // update the clock counter
+  ++us->ker.reg[US_REG_CLOCK] ;
+  
+  return US_N_IRQS ;
+}
+
+void __jit_u8 (u8_t ** pc, u8_t data)
+{
+  *(*pc)++ = data ;
+}
+
+void __jit_u32 (u8_t ** pc, u32_t data)
+{
+  memcpy(*pc, &data, sizeof(data)) ;
+  *pc += sizeof(data) ;
+}
+
+void __jit_u64 (u8_t ** pc, u64_t data)
+{
+  memcpy(*pc, &data, sizeof(data)) ;
+  *pc += sizeof(data) ;
+}
+
+// `op [rbx + disp32]`
+void __jit_rbx (u8_t ** pc, u8_t rex, u8_t op0, u8_t op1, u8_t modrm, u32_t disp)
+{
+  if (0 != rex)
+    __jit_u8(pc, rex) ;
+  
+  __jit_u8(pc, op0) ;
+  
+  if (0 != op1)
+    __jit_u8(pc, op1) ;
+  
+  __jit_u8(pc, modrm) ;
+  __jit_u32(pc, disp) ;
+}
+
+// `jmp rel32` / `jcc rel32` to `dst`
+void __jit_jmp (u8_t ** pc, u8_t cc, u8_t * dst)
+{
+  if (0 != cc) {
+    __jit_u8(pc, 0x0F) ;
+    __jit_u8(pc, cc) ;
+  } else
+    __jit_u8(pc, 0xE9) ;
+  
+  __jit_u32(pc, (u32_t)(dst - (*pc + sizeof(u32_t)))) ;
+}
+
+// `add qword [rbx + disp32], imm32`
+void __jit_add (u8_t ** pc, u32_t disp, u32_t imm)
+{
+  if (0 == imm)
+    return ;
+  
+  __jit_rbx(pc, 0x48, 0x81, 0, 0x83, disp) ;
+  __jit_u32(pc, imm) ;
+}
+
+// update the clock and IP of the instructions run since the last update
+void __jit_sync (u8_t ** pc, u64_t * IP, u64_t * clocks)
+{
+  __jit_add(pc, offsetof(us_t, ker.reg) + US_REG_IP    * sizeof(u64_t), *IP) ;
+  __jit_add(pc, offsetof(us_t, ker.reg) + US_REG_CLOCK * sizeof(u64_t), *clocks) ;
+  
+  *IP     = 0 ;
+  *clocks = 0 ;
+}
+
+// byte offset of the register as read by `__get_reg`
+u32_t __jit_reg (u8_t regx, u64_t size)
+{
+  u32_t disp = offsetof(us_t, ker.reg) ;
+  
+  if (1 == size)
+    return disp + (regx & 3) * sizeof(u64_t) + ((3 <= regx) ? 0 : 1) ;
+  
+  return disp + regx * sizeof(u64_t) ;
+}
+
+// operands size as set by `_ZOV`
+u64_t __jit_oprd_size (const us_inst_t * inst)
+{
+  if (0 != (inst->op[0] & 1))
+    return (0 != inst->has_ZOV) ? 3 : 2 ;
+  
+  return (0 != inst->has_ZOV) ? 1 : 0 ;
+}
+
+// translate the register to register arithmetic
+u32_t __jit_inline (u8_t ** pc, const us_inst_t * inst)
+{
+  u64_t size = __jit_oprd_size(inst) ;
+  
+  if (3 != inst->mod || (1 != size && 2 != size && 4 != size && 8 != size))
+    return 1 ;
+  
+  // the register operands as read by `__get_modrm_reg` and `__get_modrm_rm`
+  u32_t reg = __jit_reg(inst->reg, size) ;
+  u32_t rm  = __jit_reg(inst->rm, size)  ;
+  
+  u8_t  op   ;
+  u8_t  lazy ;
+  u32_t a    ; // first operand and result
+  u32_t b    ;
+  u8_t  save ;
+  
+  switch (inst->op[0]) {
+  case 0x00 : case 0x01 : op = 0x01 ; lazy = US_LAZY_ADD ; a = reg ; b = rm  ; save = 1 ; break ;
+  case 0x02 : case 0x03 : op = 0x01 ; lazy = US_LAZY_ADD ; a = rm  ; b = reg ; save = 1 ; break ;
+  case 0x04 : case 0x05 : op = 0x29 ; lazy = US_LAZY_SUB ; a = reg ; b = rm  ; save = 1 ; break ;
+  case 0x06 : case 0x07 : op = 0x29 ; lazy = US_LAZY_SUB ; a = rm  ; b = reg ; save = 1 ; break ;
+  case 0x0A : case 0x0B : op = 0x29 ; lazy = US_LAZY_SUB ; a = reg ; b = rm  ; save = 0 ; break ;
+  case 0x0C : case 0x0D : op = 0x29 ; lazy = US_LAZY_SUB ; a = rm  ; b = reg ; save = 0 ; break ;
+  
+  default :
+    return 1 ;
+  }
+  
+  // load the operands zero-extended
+  
+  switch (size) {
+  case 1 :
+    __jit_rbx(pc, 0x00, 0x0F, 0xB6, 0x83, a) ;       // movzx eax, byte [a]
+    __jit_rbx(pc, 0x00, 0x0F, 0xB6, 0x8B, b) ;       // movzx ecx, byte [b]
+    break ;
+  
+  case 2 :
+    __jit_rbx(pc, 0x00, 0x0F, 0xB7, 0x83, a) ;       // movzx eax, word [a]
+    __jit_rbx(pc, 0x00, 0x0F, 0xB7, 0x8B, b) ;       // movzx ecx, word [b]
+    break ;
+  
+  case 4 :
+    __jit_rbx(pc, 0x00, 0x8B, 0, 0x83, a) ;          // mov eax, [a]
+    __jit_rbx(pc, 0x00, 0x8B, 0, 0x8B, b) ;          // mov ecx, [b]
+    break ;
+  
+  case 8 :
+    __jit_rbx(pc, 0x48, 0x8B, 0, 0x83, a) ;          // mov rax, [a]
+    __jit_rbx(pc, 0x48, 0x8B, 0, 0x8B, b) ;          // mov rcx, [b]
+    break ;
+  }
+  
+  // record the operation updating the flags
+  
+  __jit_rbx(pc, 0x48, 0x89, 0, 0x83, offsetof(us_t, lazy.a)) ;   // mov [lazy.a], rax
+  __jit_rbx(pc, 0x48, 0x89, 0, 0x8B, offsetof(us_t, lazy.b)) ;   // mov [lazy.b], rcx
+  __jit_rbx(pc, 0x00, 0xC6, 0, 0x83, offsetof(us_t, lazy.op)) ;  // mov byte [lazy.op], lazy
+  __jit_u8(pc, lazy) ;
+  __jit_rbx(pc, 0x00, 0xC6, 0, 0x83, offsetof(us_t, lazy.size)) ; // mov byte [lazy.size], size
+  __jit_u8(pc, size) ;
+  
+  if (0 == save)
+    return 0 ;
+  
+  // compute and save the result
+  
+  switch (size) {
+  case 1 :
+    __jit_u8(pc, op) ; __jit_u8(pc, 0xC8) ;          // add/sub eax, ecx
+    __jit_rbx(pc, 0x00, 0x88, 0, 0x83, a) ;          // mov [a], al
+    break ;
+  
+  case 2 :
+    __jit_u8(pc, op) ; __jit_u8(pc, 0xC8) ;          // add/sub eax, ecx
+    __jit_rbx(pc, 0x66, 0x89, 0, 0x83, a) ;          // mov [a], ax
+    break ;
+  
+  case 4 :
+    __jit_u8(pc, op) ; __jit_u8(pc, 0xC8) ;          // add/sub eax, ecx
+    __jit_rbx(pc, 0x48, 0x89, 0, 0x83, a) ;          // mov [a], rax
+    break ;
+  
+  case 8 :
+    __jit_u8(pc, 0x48) ;
+    __jit_u8(pc, op) ; __jit_u8(pc, 0xC8) ;          // add/sub rax, rcx
+    __jit_rbx(pc, 0x48, 0x89, 0, 0x83, a) ;          // mov [a], rax
+    break ;
+  }
+  
+  return 0 ;
+}
+
+// translate the instruction into a call to `__exec_inst`
+void __jit_call (us_t * us, u8_t ** pc, u8_t * exit_0, u8_t * exit)
+{
+  // copy the decoded instruction into the data
+  
+  us->jit.data += (sizeof(us_inst_t) + 15) & ~15 ;
+  
+  us_inst_t * inst = (us_inst_t *)(us->jit.buf + US_JIT_BUFFER - us->jit.data) ;
+  *inst = *us->inst ;
+  
+  __jit_u8(pc, 0x48) ; __jit_u8(pc, 0x89) ; __jit_u8(pc, 0xDF) ; // mov rdi, rbx
+  __jit_u8(pc, 0x48) ; __jit_u8(pc, 0xBE) ;                      // mov rsi, inst
+  __jit_u64(pc, (u64_t)inst) ;
+  __jit_u8(pc, 0x48) ; __jit_u8(pc, 0xB8) ;                      // mov rax, __jit_exec_inst
+  __jit_u64(pc, (u64_t)__jit_exec_inst) ;
+  __jit_u8(pc, 0xFF) ; __jit_u8(pc, 0xD0) ;                      // call rax
+  
+  // exit on the interrupt
+  
+  __jit_u8(pc, 0x3D) ;                                           // cmp eax, US_N_IRQS
+  __jit_u32(pc, US_N_IRQS) ;
+  __jit_jmp(pc, 0x85, exit) ;                                    // jne exit
+  
+  // exit if the instruction has overwritten the code
+  
+  __jit_rbx(pc, 0x00, 0x80, 0, 0xBB, offsetof(us_t, jit.stale)) ; // cmp byte [stale], 0
+  __jit_u8(pc, 0x00) ;
+  __jit_jmp(pc, 0x85, exit_0) ;                                    // jne exit_0
+}
+
+u32_t __jit_protect (
+  us_t * us   ,
+  int    prot
+)
+{
+  // the buffer is writable or executable, never both
+  if (0 != mprotect(us->jit.buf, US_JIT_BUFFER, prot)) {
+    fprintf(stderr, "warning: cannot protect the translated code, the translation is disabled\n") ;
+    us->opt.jit = 0 ;
+    return 1 ;
+  }
+  
+  return 0 ;
+}
+
+void __jit_reset (
+  us_t * us
+)
+{
+  us->jit.code  = 0    ;
+  us->jit.data  = 0    ;
+  us->jit.stale = 0    ;
+  us->jit.last  = NULL ;
+  
+  memset(us->jit.block, 0, sizeof(us->jit.block)) ;
+}
+
+u32_t __jit_translate (
+  us_t *           us    ,
+  us_jit_block_t * block
+)
+{
+  // worst case of an instruction
+  const u64_t inst_code = 128 ;
+  const u64_t inst_data = (sizeof(us_inst_t) + 15) & ~15 ;
+  
+  if (NULL == us->jit.buf) {
+    void * buf = mmap(
+      NULL, US_JIT_BUFFER, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    ) ;
+    
+    if (MAP_FAILED == buf) {
+      fprintf(stderr, "warning: cannot allocate the translated code, the translation is disabled\n") ;
+      us->opt.jit = 0 ;
+      return 1 ;
+    }
+    
+    us->jit.buf = (u8_t *)buf ;
+  } else if (0 != __jit_protect(us, PROT_READ | PROT_WRITE))
+    return 1 ;
+  
+  if (US_JIT_BUFFER < us->jit.code + us->jit.data + 64 + US_JIT_LENGTH * (inst_code + inst_data)) {
+    // the buffer is full, restart from an empty one
+    u16_t segx = block->segx ;
+    u64_t IP   = block->IP   ;
+    
+    __jit_reset(us) ;
+    
+    block->segx = segx       ;
+    block->IP   = IP         ;
+    block->hits = US_JIT_HOT ;
+  }
+  
+  // save the state changed by the decoding
+  
+  u64_t     IP   = us->ker.reg[US_REG_IP] ;
+  us_inst_t inst = *us->inst ;
+  
+  u8_t * start = us->jit.buf + us->jit.code ;
+  u8_t * pc    = start ;
+  
+  // exits
+  
+  u8_t * exit_0 = pc ;
+  __jit_u8(&pc, 0xB8) ; __jit_u32(&pc, US_N_IRQS) ;              // mov eax, US_N_IRQS
+  
+  u8_t * exit = pc ;
+  __jit_u8(&pc, 0x5B) ;                                          // pop rbx
+  __jit_u8(&pc, 0xC3) ;                                          // ret
+  
+  // entry point
+  
+  u8_t * entry = pc ;
+  __jit_u8(&pc, 0x53) ;                                          // push rbx
+  __jit_u8(&pc, 0x48) ; __jit_u8(&pc, 0x89) ; __jit_u8(&pc, 0xFB) ; // mov rbx, rdi
+  
+  // check the clocks left (the chained blocks jump here)
+  
+  __jit_rbx(&pc, 0x48, 0x8B, 0, 0x83, offsetof(us_t, limit)) ;  // mov rax, [limit]
+  __jit_rbx(
+    &pc, 0x48, 0x2B, 0, 0x83,                                     // sub rax, [CLOCK]
+    offsetof(us_t, ker.reg) + US_REG_CLOCK * sizeof(u64_t)
+  ) ;
+  __jit_u8(&pc, 0x48) ; __jit_u8(&pc, 0x3D) ;                    // cmp rax, n
+  u8_t * n = pc ;
+  __jit_u32(&pc, 0) ;
+  __jit_jmp(&pc, 0x82, exit_0) ;                                 // jb exit_0
+  
+  // instructions
+  
+  u64_t next   = block->IP ;
+  u64_t IP_d   = 0 ;
+  u64_t clocks = 0 ;
+  
+  block->n = 0 ;
+  
+  while (block->n < US_JIT_LENGTH && next < us->mem.size) {
+    us->ker.reg[US_REG_IP] = next ;
+    
+    if (US_N_IRQS != __fetch_inst(us) || 0 != us->jit.stale)
+      break ;
+    
+    if (0 != us->inst->has_REP)
+      break ;
+    
+    if (
+      0x07 < us->inst->op[0] &&
+      !(0x0A <= us->inst->op[0] && us->inst->op[0] <= 0x0D)
+    ) // `int`, `iret`, breakpoint and the undefined instructions
+      break ;
+    
+    if (0 == __jit_inline(&pc, us->inst)) {
+      IP_d   += us->inst->cp ;
+      clocks += 1 ;
+    } else {
+      __jit_sync(&pc, &IP_d, &clocks) ;
+      __jit_call(us, &pc, exit_0, exit) ;
+    }
+    
+    next += us->inst->cp ;
+    ++block->n ;
+  }
+  
+  // restore the state
+  
+  us->ker.reg[US_REG_IP] = IP ;
+  us->spare = inst ;
+  us->inst  = &us->spare ;
+  
+  if (0 == block->n || 0 != us->jit.stale) {
+    block->n    = 0    ;
+    block->code = NULL ;
+    block->none = 1    ;
+    
+    __jit_protect(us, PROT_READ | PROT_EXEC) ;
+    return 1 ;
+  }
+  
+  memcpy(n, &block->n, sizeof(u32_t)) ;
+  
+  // save the block to be chained to the next one
+  
+  __jit_sync(&pc, &IP_d, &clocks) ;
+  __jit_u8(&pc, 0x48) ; __jit_u8(&pc, 0xB8) ;                    // mov rax, block
+  __jit_u64(&pc, (u64_t)block) ;
+  __jit_rbx(&pc, 0x48, 0x89, 0, 0x83, offsetof(us_t, jit.last)) ; // mov [last], rax
+  
+  block->chain = pc ;
+  __jit_jmp(&pc, 0, exit_0) ;                                    // jmp exit_0
+  
+  block->next = next  ;
+  block->code = entry ;
+  
+  us->jit.code += pc - start ;
+  
+  return __jit_protect(us, PROT_READ | PROT_EXEC) ;
+}
+
+us_jit_block_t * us_jit_lookup (
+  us_t * us
+)
+{
+  if (
+    0 == us->opt.jit || 0 != us->opt.verbose || NULL != us->prof ||
+    NULL != us->tracer ||
+    0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_V)
+  )
+    return NULL ;
+  
+  // flush the overwritten code
+  if (0 != us->jit.stale)
+    __jit_reset(us) ;
+  
+  u16_t segx = us->ker.seg[US_SEG_CODE] ;
+  u64_t IP   = us->ker.reg[US_REG_IP] ;
+  
+  us_jit_block_t * block = us->jit.block + __jit_hash(segx, IP) ;
+  us_jit_block_t * last  = us->jit.last ;
+  
+  us->jit.last = NULL ;
+  
+  if (block->segx != segx || block->IP != IP) {
+    memset(block, 0, sizeof(us_jit_block_t)) ;
+    
+    block->segx = segx ;
+    block->IP   = IP   ;
+  }
+  
+  if (NULL == block->code) {
+    // the translation has already failed
+    if (0 != block->none)
+      return NULL ;
+    
+    // count the executions
+    if (US_JIT_HOT != ++block->hits)
+      return NULL ;
+    
+    // translate the block
+    if (0 != __jit_translate(us, block))
+      return NULL ;
+  }
+  
+  // chain the last block
+  
+  if (
+    NULL != last && NULL != last->chain &&
+    last->segx == segx && last->next == IP
+  ) {
+    // jump after the entry point (push rbx, mov rbx, rdi)
+    u32_t rel = (u32_t)((block->code + 4) - (last->chain + 5)) ;
+    
+    if (0 != __jit_protect(us, PROT_READ | PROT_WRITE))
+      return NULL ;
+    
+    memcpy(last->chain + 1, &rel, sizeof(rel)) ;
+    last->chain = NULL ;
+    
+    if (0 != __jit_protect(us, PROT_READ | PROT_EXEC))
+      return NULL ;
+  }
+  
+  // check the clocks left
+  if (us->limit - us->ker.reg[US_REG_CLOCK] < block->n)
+    return NULL ;
+  
+  return block ;
+}
+
+u8_t us_jit_skip (
+  us_t * us
+)
+{
+  // the look up would return NULL (see `us_jit_lookup`)
+  
+  if (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_V))
+    return 1 ;
+  
+  if (0 != us->jit.stale)
+    return 0 ;
+  
+  u16_t segx = us->ker.seg[US_SEG_CODE] ;
+  u64_t IP   = us->ker.reg[US_REG_IP] ;
+  
+  us_jit_block_t * block = us->jit.block + __jit_hash(segx, IP) ;
+  
+  if (0 == block->none || block->segx != segx || block->IP != IP)
+    return 0 ;
+  
+  us->jit.last = NULL ;
+  
+  return 1 ;
+}
+
+u32_t us_jit_exec (
+  us_t *           us    ,
+  us_jit_block_t * block
+)
+{
+  return ((u32_t (*)(us_t *))block->code)(us) ;
+}
+
+void us_jit_free (
+  us_t * us
+)
+{
+  if (NULL != us->jit.buf)
+    munmap(us->jit.buf, US_JIT_BUFFER) ;
+  
+  us->jit.buf = NULL ;
+  __jit_reset(us) ;
+}
+
+#else
+
+us_jit_block_t * us_jit_lookup (
+  us_t * us
+)
+{
+  (void)us ;
+  
+  // the host is not supported
+  return NULL ;
+}
+
+u8_t us_jit_skip (
+  us_t * us
+)
+{
+  (void)us ;
+  
+  return 1 ;
+}
+
+u32_t us_jit_exec (
+  us_t *           us    ,
+  us_jit_block_t * block
+)
+{
+  (void)us ;
+  (void)block ;
+  
+  return US_N_IRQS ;
+}
+
+void us_jit_free (
+  us_t * us
+)
+{
+  (void)us ;
+}
+
+#endif
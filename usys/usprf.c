@@ -0,0 +1,187 @@
+#include "us.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// =============================================================================
+// Profiler
+// -----------------------------------------------------------------------------
+// The profiler counts the executions of every operation code and of every
+// instruction (by CS:IP), the reads and writes of every segment index and the
+// interrupts of every vector. The counters are plain increments, so the cost is
+// a few loads and stores per clock, not a line of text like `--verbose`. The
+// instructions are counted by the interpreter, so the translated code is not
+// run while the profiler is enabled. A repeated instruction counts once, its
+// accesses once per element (the block instructions once per block).
+// -----------------------------------------------------------------------------
+// Count an instruction:
+//   1. count its operation code
+//   2. hash CS:IP and probe the table linearly up to a free or equal entry
+//   3. count the lost executions if the table is full
+// Save the profile (CSV, one counter per line):
+//   1. write the operation codes with their executions
+//   2. write the instructions sorted by executions (the hot loops first)
+//   3. write the reads and writes per segment index and the interrupts
+// =============================================================================
+
+u32_t us_prof_init (
+  us_t * us
+)
+{
+  if (NULL != us->prof)
+    return 0 ;
+  
+  us->prof = (us_prof_t *)calloc(1, sizeof(us_prof_t)) ;
+  
+  if (NULL == us->prof) {
+    fprintf(stderr, "error: cannot allocate the profiler\n") ;
+    return 1 ;
+  }
+  
+  return 0 ;
+}
+
+void us_prof_free (
+  us_t * us
+)
+{
+  free(us->prof) ;
+  us->prof = NULL ;
+}
+
+void __prof_inst (
+  us_t * us
+)
+{
+  us_prof_t * prof = us->prof ;
+  
+  // count the operation code
+  
+  if (0xF0 == us->inst->op[0])
+    ++prof->op_F0[us->inst->op[1]] ;
+  else
+    ++prof->op[us->inst->op[0]] ;
+  
+  // count the instruction
+  
+  u16_t segx = us->ker.seg[US_SEG_CODE] ;
+  u64_t IP   = us->ker.reg[US_REG_IP]   ;
+  u64_t i    = (IP * 0x9E3779B97F4A7C15ull ^ segx) >> 48 ;
+  
+  for (u32_t n = 0 ; n < US_PROF_SIZE ; ++n) {
+    us_prof_ip_t * entry = prof->ip + ((i + n) & (US_PROF_SIZE - 1)) ;
+    
+    if (0 == entry->n) {
+      // keep some free entries, the probes of a full table are too long
+      if (US_PROF_SIZE - US_PROF_SIZE / 8 <= prof->n)
+        break ;
+      
+      entry->segx = segx ;
+      entry->IP   = IP   ;
+      entry->n    = 1    ;
+      
+      ++prof->n ;
+      
+      return ;
+    }
+    
+    if (entry->IP == IP && entry->segx == segx) {
+      ++entry->n ;
+      return ;
+    }
+  }
+  
+  ++prof->lost ;
+}
+
+int __prof_cmp (
+  const void * a ,
+  const void * b
+)
+{
+  u64_t na = ((const us_prof_ip_t *)a)->n ;
+  u64_t nb = ((const us_prof_ip_t *)b)->n ;
+  
+  return (na < nb) - (na > nb) ;
+}
+
+u32_t us_prof_save (
+        us_t * us ,
+  const char * fn
+)
+{
+  us_prof_t * prof = us->prof ;
+  
+  if (NULL == prof)
+    return 1 ;
+  
+  FILE * fp = fopen(fn, "w") ;
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the profile `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  fprintf(fp, "kind,key,count\n") ;
+  
+  // write the operation codes
+  
+  for (int i = 0 ; i < 0x100 ; ++i) {
+    if (0 != prof->op[i])
+      fprintf(fp, "op,%02X,%llu\n", i, (unsigned long long)prof->op[i]) ;
+  }
+  
+  for (int i = 0 ; i < 0x100 ; ++i) {
+    if (0 != prof->op_F0[i])
+      fprintf(fp, "op,F0 %02X,%llu\n", i, (unsigned long long)prof->op_F0[i]) ;
+  }
+  
+  // write the instructions, the hot ones first
+  
+  us_prof_ip_t * ip = (us_prof_ip_t *)malloc(prof->n * sizeof(us_prof_ip_t) + 1) ;
+  u32_t          n  = 0 ;
+  
+  if (NULL != ip) {
+    for (u32_t i = 0 ; i < US_PROF_SIZE ; ++i) {
+      if (0 != prof->ip[i].n)
+        ip[n++] = prof->ip[i] ;
+    }
+    
+    qsort(ip, n, sizeof(us_prof_ip_t), __prof_cmp) ;
+    
+    for (u32_t i = 0 ; i < n ; ++i) {
+      fprintf(
+        fp, "ip,%04X:%012llX,%llu\n",
+        ip[i].segx, (unsigned long long)ip[i].IP, (unsigned long long)ip[i].n
+      ) ;
+    }
+    
+    free(ip) ;
+  }
+  
+  if (0 != prof->lost)
+    fprintf(fp, "ip,lost,%llu\n", (unsigned long long)prof->lost) ;
+  
+  // write the accesses per segment index and the interrupts
+  
+  for (int i = 0 ; i < (1 << 16) ; ++i) {
+    if (0 != prof->mem[0][i])
+      fprintf(fp, "read,%04X,%llu\n", i, (unsigned long long)prof->mem[0][i]) ;
+    
+    if (0 != prof->mem[1][i])
+      fprintf(fp, "write,%04X,%llu\n", i, (unsigned long long)prof->mem[1][i]) ;
+  }
+  
+  for (int i = 0 ; i < US_N_IRQS ; ++i) {
+    if (0 != prof->IRQ[i])
+      fprintf(fp, "irq,%02X,%llu\n", i, (unsigned long long)prof->IRQ[i]) ;
+  }
+  
+  if (0 != fclose(fp)) {
+    fprintf(stderr, "error: cannot write the profile `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  return 0 ;
+}
@@ -0,0 +1,420 @@
+#include "us.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// =============================================================================
+// Record and Replay
+// -----------------------------------------------------------------------------
+// The execution of a machine is a function of its state and of the inputs from
+// the host: the interrupts injected by the other threads and the results of
+// the devices. The recorder logs only these inputs, so the log stays small:
+// an injection with its clock, a read of a device with its data and IRQ, a
+// write of a device with its IRQ. The replay starts from the same state (the
+// same image or snapshot) and feeds them back instead of the threads and the
+// devices, so the machine runs again the same instructions.
+// An injection is positioned by its clock, but an interrupt delivered between
+// two instructions does not update the clock. The recorder merges the injected
+// interrupts at the first pass of the run loop at a clock (or while the
+// machine is halted, when the passes change nothing), and the replay schedules
+// them as events at their clock, which fire at that same pass. The other
+// events are host state: the host schedules them again before the replay.
+// -----------------------------------------------------------------------------
+// Layout of a log (host byte order):
+//   magic number (4-byte), version (4-byte), clock at the start (8-byte)
+//   records (see `us_replay_rec_t`), the data of a read after its record
+// Record:
+//   1. merge the injected interrupts at the first pass of a clock and log the
+//      new pending ones
+//   2. call the devices and log their results
+// Replay:
+//   1. load the log and check the clock at the start
+//   2. schedule the next injection as an event, the next one when it fires
+//   3. return the logged results of the devices in order, the devices are
+//      called again if the accesses differ from the log or the log is over
+// =============================================================================
+
+enum {
+  US_REPLAY_HEAD = 16 // size of the header
+} ;
+
+static const u8_t __replay_mag [4] = { 0x45, 0x45, 0x4E, 0xC0 } ;
+
+u32_t __replay_next (
+  us_replay_t *     replay ,
+  u64_t *           pos    ,
+  u8_t              dev    ,
+  us_replay_rec_t * rec
+)
+{
+  // next access of a device (`dev` = 1) or next injection (`dev` = 0)
+  
+  while (*pos + sizeof(us_replay_rec_t) <= replay->size) {
+    memcpy(rec, replay->log + *pos, sizeof(us_replay_rec_t)) ;
+    *pos += sizeof(us_replay_rec_t) ;
+    
+    u64_t size = (US_REPLAY_READ == rec->kind) ? rec->arg : 0 ;
+    
+    // the log has been truncated
+    if (replay->size - *pos < size)
+      break ;
+    
+    *pos += size ;
+    
+    if ((US_REPLAY_INJECT != rec->kind) == dev)
+      return 0 ;
+  }
+  
+  *pos = replay->size ;
+  
+  return 1 ;
+}
+
+void __replay_diverge (
+  us_t * us    ,
+  u8_t   ended
+)
+{
+  if (0 != ended) {
+    fprintf(
+      stderr, "warning: the replay has ended at clock %llu\n",
+      (unsigned long long)us->ker.reg[US_REG_CLOCK]
+    ) ;
+  } else {
+    fprintf(
+      stderr, "error: the replay has diverged at clock %llu\n",
+      (unsigned long long)us->ker.reg[US_REG_CLOCK]
+    ) ;
+  }
+  
+  // the devices are called again
+  us->replay->diverged = 1 ;
+}
+
+u32_t __replay_fire (
+  us_t *       us ,
+  us_event_t * ev
+) ;
+
+void __replay_schedule (
+  us_t * us
+)
+{
+  us_replay_t *   replay = us->replay ;
+  us_replay_rec_t rec    ;
+  
+  if (0 != __replay_next(replay, &replay->inject, 0, &rec))
+    return ;
+  
+  us_event_t ev = {
+    .clock  = rec.arg       ,
+    .period = 0             ,
+    .IRQ    = rec.IRQ       ,
+    .fire   = __replay_fire
+  } ;
+  
+  if (0 != us_sched_add(us, &ev, &replay->id))
+    fprintf(stderr, "error: cannot schedule the injection at clock %llu\n", (unsigned long long)rec.arg) ;
+}
+
+u32_t __replay_fire (
+  us_t *       us ,
+  us_event_t * ev
+)
+{
+  // the injections at the same clock fire in the same pass
+  __replay_schedule(us) ;
+  
+  return ev->IRQ ;
+}
+
+void __replay_inject (
+  us_t * us
+)
+{
+  us_replay_t * replay = us->replay ;
+  
+  // the replay drops the injected interrupts, the log holds them
+  
+  if (NULL == replay->fp) {
+    us->sched.seen = __atomic_load_n(&us->sched.wake, __ATOMIC_ACQUIRE) ;
+    
+    for (int i = 0 ; i < US_N_IRQS / 64 ; ++i)
+      __atomic_exchange_n(us->sched.inject + i, 0, __ATOMIC_ACQ_REL) ;
+    
+    return ;
+  }
+  
+  // the injected interrupts wait for the next clock
+  if (replay->clock == us->ker.reg[US_REG_CLOCK] && 0 == us->idle)
+    return ;
+  
+  // log the interrupts that were not pending
+  
+  u64_t pending [US_N_IRQS / 64] ;
+  
+  memcpy(pending, us->sched.pending, sizeof(pending)) ;
+  
+  __sched_inject(us) ;
+  
+  for (int i = 0 ; i < US_N_IRQS / 64 ; ++i) {
+    for (u64_t bits = us->sched.pending[i] & ~pending[i] ; 0 != bits ; bits &= bits - 1) {
+      us_replay_rec_t rec = {
+        .kind = US_REPLAY_INJECT               ,
+        .IRQ  = i * 64 + __builtin_ctzll(bits) ,
+        .arg  = us->ker.reg[US_REG_CLOCK]
+      } ;
+      
+      fwrite(&rec, sizeof(rec), 1, replay->fp) ;
+    }
+  }
+  
+  // the injections are rare, keep the log on the disk up to them
+  fflush(replay->fp) ;
+}
+
+u32_t __replay_read (
+  us_t *     us   ,
+  us_dev_t * dev  ,
+  u64_t      off  ,
+  u64_t      size ,
+  any_t      data
+)
+{
+  us_replay_t *   replay = us->replay ;
+  us_replay_rec_t rec    ;
+  
+  // log the data and the interrupt of the device
+  
+  if (NULL != replay->fp) {
+    u32_t IRQ = dev->read(us, dev, off, size, data) ;
+    
+    rec = (us_replay_rec_t){
+      .kind = US_REPLAY_READ ,
+      .IRQ  = IRQ            ,
+      .arg  = size
+    } ;
+    
+    fwrite(&rec, sizeof(rec), 1, replay->fp) ;
+    fwrite(data, size, 1, replay->fp) ;
+    
+    return IRQ ;
+  }
+  
+  // return the logged ones
+  
+  if (0 == replay->diverged) {
+    u32_t ended = __replay_next(replay, &replay->dev, 1, &rec) ;
+    
+    if (0 == ended && US_REPLAY_READ == rec.kind && size == rec.arg) {
+      memcpy(data, replay->log + replay->dev - size, size) ;
+      return rec.IRQ ;
+    }
+    
+    __replay_diverge(us, ended) ;
+  }
+  
+  return dev->read(us, dev, off, size, data) ;
+}
+
+u32_t __replay_write (
+        us_t *     us   ,
+        us_dev_t * dev  ,
+        u64_t      off  ,
+        u64_t      size ,
+  const any_t      data
+)
+{
+  us_replay_t *   replay = us->replay ;
+  us_replay_rec_t rec    ;
+  
+  // log the interrupt of the device
+  
+  if (NULL != replay->fp) {
+    u32_t IRQ = dev->write(us, dev, off, size, data) ;
+    
+    rec = (us_replay_rec_t){
+      .kind = US_REPLAY_WRITE ,
+      .IRQ  = IRQ             ,
+      .arg  = size
+    } ;
+    
+    fwrite(&rec, sizeof(rec), 1, replay->fp) ;
+    
+    return IRQ ;
+  }
+  
+  // return the logged one
+  
+  if (0 == replay->diverged) {
+    u32_t ended = __replay_next(replay, &replay->dev, 1, &rec) ;
+    
+    if (0 == ended && US_REPLAY_WRITE == rec.kind && size == rec.arg)
+      return rec.IRQ ;
+    
+    __replay_diverge(us, ended) ;
+  }
+  
+  return dev->write(us, dev, off, size, data) ;
+}
+
+u32_t us_record_init (
+        us_t * us ,
+  const char * fn
+)
+{
+  if (NULL != us->replay) {
+    fprintf(stderr, "error: the machine is already recorded or replayed\n") ;
+    return 1 ;
+  }
+  
+  us_replay_t * replay = (us_replay_t *)calloc(1, sizeof(us_replay_t)) ;
+  
+  if (NULL == replay) {
+    fprintf(stderr, "error: cannot allocate the recorder\n") ;
+    return 1 ;
+  }
+  
+  replay->fp = fopen(fn, "wb") ;
+  
+  if (NULL == replay->fp) {
+    fprintf(stderr, "error: cannot open the log `%s`: %s\n", fn, strerror(errno)) ;
+    free(replay) ;
+    return 1 ;
+  }
+  
+  // write the header
+  
+  u32_t version = US_REPLAY_VERSION         ;
+  u64_t clock   = us->ker.reg[US_REG_CLOCK] ;
+  
+  u64_t n = 0 ;
+  
+  n += fwrite(__replay_mag, sizeof(__replay_mag), 1, replay->fp) ;
+  n += fwrite(&version, sizeof(version), 1, replay->fp) ;
+  n += fwrite(&clock, sizeof(clock), 1, replay->fp) ;
+  
+  if (3 != n) {
+    fprintf(stderr, "error: cannot write the log `%s`: %s\n", fn, strerror(errno)) ;
+    fclose(replay->fp) ;
+    free(replay) ;
+    return 1 ;
+  }
+  
+  // the first pass is at the current clock
+  replay->clock = clock - 1 ;
+  
+  us->replay = replay ;
+  
+  return 0 ;
+}
+
+u32_t us_replay_init (
+        us_t * us ,
+  const char * fn
+)
+{
+  if (NULL != us->replay) {
+    fprintf(stderr, "error: the machine is already recorded or replayed\n") ;
+    return 1 ;
+  }
+  
+  // load the log
+  
+  FILE * fp = fopen(fn, "rb") ;
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the log `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  us_replay_t * replay = (us_replay_t *)calloc(1, sizeof(us_replay_t)) ;
+  
+  long size = -1 ;
+  
+  if (0 == fseek(fp, 0, SEEK_END))
+    size = ftell(fp) ;
+  
+  if (NULL != replay && US_REPLAY_HEAD <= size) {
+    replay->size = size ;
+    replay->log  = (u8_t *)malloc(size) ;
+  }
+  
+  if (
+    NULL == replay || NULL == replay->log || 0 != fseek(fp, 0, SEEK_SET) ||
+    1 != fread(replay->log, size, 1, fp)
+  ) {
+    fprintf(stderr, "error: cannot load the log `%s`\n", fn) ;
+    
+    if (NULL != replay)
+      free(replay->log) ;
+    
+    free(replay) ;
+    fclose(fp) ;
+    return 1 ;
+  }
+  
+  fclose(fp) ;
+  
+  // check the header
+  
+  u32_t version ;
+  u64_t clock   ;
+  
+  memcpy(&version, replay->log + 4, sizeof(version)) ;
+  memcpy(&clock, replay->log + 8, sizeof(clock)) ;
+  
+  if (
+    0 != memcmp(replay->log, __replay_mag, sizeof(__replay_mag)) ||
+    US_REPLAY_VERSION != version
+  ) {
+    fprintf(stderr, "error: `%s` is not a log\n", fn) ;
+    free(replay->log) ;
+    free(replay) ;
+    return 1 ;
+  }
+  
+  if (us->ker.reg[US_REG_CLOCK] != clock) {
+    fprintf(
+      stderr, "error: the log starts at clock %llu, the machine is at clock %llu\n",
+      (unsigned long long)clock, (unsigned long long)us->ker.reg[US_REG_CLOCK]
+    ) ;
+    free(replay->log) ;
+    free(replay) ;
+    return 1 ;
+  }
+  
+  replay->dev    = US_REPLAY_HEAD ;
+  replay->inject = US_REPLAY_HEAD ;
+  
+  us->replay = replay ;
+  
+  // schedule the first injection
+  __replay_schedule(us) ;
+  
+  return 0 ;
+}
+
+void us_replay_free (
+  us_t * us
+)
+{
+  us_replay_t * replay = us->replay ;
+  
+  if (NULL == replay)
+    return ;
+  
+  if (NULL != replay->fp) {
+    if (0 != fclose(replay->fp))
+      fprintf(stderr, "error: cannot write the log: %s\n", strerror(errno)) ;
+  } else {
+    // the next injection, if any
+    us_sched_cancel(us, replay->id) ;
+    free(replay->log) ;
+  }
+  
+  free(replay) ;
+  
+  us->replay = NULL ;
+}
@@ -0,0 +1,246 @@
+#include "us.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+# include <signal.h>
+# include <time.h>
+#endif
+
+// =============================================================================
+// Sampling Profiler
+// -----------------------------------------------------------------------------
+// The sampler records CS:IP and the nesting of the interrupts every `period`
+// clocks, or at every tick of a host timer (SIGPROF, on the CPU time of the
+// process). Every machine owns its timer and the signal carries the machine,
+// so the machines of a process are sampled independently. The samples go into
+// a lock-free ring with one producer (the sampling event or the signal
+// handler) and one consumer (the drain), so the signal handler never waits.
+// The machine runs at full speed between the samples, translated code
+// included: a block ends at the clock of the next sample and a signal reads
+// the registers at the last exit of a block. The samples are written as CSV
+// (`clock,ip,nest`) and aggregated offline.
+// -----------------------------------------------------------------------------
+// Take a sample:
+//   1. drop it if the ring is full
+//   2. write the entry at the head, then publish the head
+// Drain the ring (on the thread of the machine):
+//   1. read the entries from the tail to the published head
+//   2. write them into the file, then publish the tail
+// Start the sampler:
+//   1. open the file and allocate the ring
+//   2. schedule a periodic event that samples (`period`) or drains the ring
+//   3. create and start the host timer of the machine, if any
+// Stop the sampler:
+//   1. delete the host timer and cancel the event
+//   2. drain the ring and close the file
+// =============================================================================
+
+void __sample_take (
+  us_t * us
+)
+{
+  us_sampler_t * sampler = us->sampler ;
+  
+  u64_t head = sampler->head ;
+  
+  if (US_SAMPLE_SIZE <= head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE)) {
+    ++sampler->lost ;
+    return ;
+  }
+  
+  us_sample_t * sample = sampler->ring + (head & (US_SAMPLE_SIZE - 1)) ;
+  
+  sample->clock = us->ker.reg[US_REG_CLOCK] ;
+  sample->IP    = us->ker.reg[US_REG_IP]    ;
+  sample->segx  = us->ker.seg[US_SEG_CODE]  ;
+  sample->nest  = us->nest                  ;
+  
+  __atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE) ;
+}
+
+void __sample_drain (
+  us_t * us
+)
+{
+  us_sampler_t * sampler = us->sampler ;
+  
+  u64_t tail = sampler->tail ;
+  u64_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE) ;
+  
+  for (; tail != head ; ++tail) {
+    us_sample_t * sample = sampler->ring + (tail & (US_SAMPLE_SIZE - 1)) ;
+    
+    fprintf(
+      sampler->fp, "%llu,%04X:%012llX,%u\n",
+      (unsigned long long)sample->clock, sample->segx,
+      (unsigned long long)sample->IP, sample->nest
+    ) ;
+  }
+  
+  __atomic_store_n(&sampler->tail, tail, __ATOMIC_RELEASE) ;
+}
+
+u32_t __sample_fire (
+  us_t *       us ,
+  us_event_t * ev
+)
+{
+  (void)ev ;
+  
+  if (0 != us->sampler->period)
+    __sample_take(us) ;
+  
+  // keep the ring half empty
+  if (US_SAMPLE_SIZE / 2 <= us->sampler->head - us->sampler->tail)
+    __sample_drain(us) ;
+  
+  return US_N_IRQS ;
+}
+
+#ifndef _WIN32
+void __sample_signal (
+  int         sig  ,
+  siginfo_t * info ,
+  void *      ctx
+)
+{
+  (void)sig ;
+  (void)ctx ;
+  
+  // the machine of the timer
+  us_t * us = (us_t *)info->si_value.sival_ptr ;
+  
+  if (SI_TIMER == info->si_code && NULL != us)
+    __sample_take(us) ;
+}
+#endif
+
+u32_t us_sample_init (
+        us_t * us     ,
+  const char * fn     ,
+        u64_t  period ,
+        u32_t  hz
+)
+{
+#ifdef _WIN32
+  if (0 != hz) {
+    fprintf(stderr, "error: the host timer is not supported\n") ;
+    return 1 ;
+  }
+#endif
+  
+  if (0 == period)
+    period = US_SAMPLE_PERIOD ;
+  
+  // open the file and allocate the ring
+  
+  us_sampler_t * sampler = (us_sampler_t *)calloc(1, sizeof(us_sampler_t)) ;
+  
+  if (NULL == sampler) {
+    fprintf(stderr, "error: cannot allocate the sampler\n") ;
+    return 1 ;
+  }
+  
+  sampler->fp = fopen(fn, "w") ;
+  
+  if (NULL == sampler->fp) {
+    fprintf(stderr, "error: cannot open the samples `%s`: %s\n", fn, strerror(errno)) ;
+    free(sampler) ;
+    return 1 ;
+  }
+  
+  sampler->period = (0 != hz) ? 0 : period ;
+  
+  fprintf(sampler->fp, "clock,ip,nest\n") ;
+  
+  // sample or drain the ring on the clock
+  
+  u64_t every = (0 != hz) ? US_SAMPLE_DRAIN : period ;
+  
+  us_event_t ev = {
+    .clock  = us->ker.reg[US_REG_CLOCK] + every ,
+    .period = every         ,
+    .IRQ    = US_N_IRQS     ,
+    .fire   = __sample_fire
+  } ;
+  
+  if (0 != us_sched_add(us, &ev, &sampler->id)) {
+    fprintf(stderr, "error: cannot schedule the sampler\n") ;
+    fclose(sampler->fp) ;
+    free(sampler) ;
+    return 1 ;
+  }
+  
+  us->sampler = sampler ;
+
+#ifndef _WIN32
+  // start the host timer
+  
+  if (0 != hz) {
+    struct sigaction sa ;
+    
+    memset(&sa, 0, sizeof(sa)) ;
+    sa.sa_sigaction = __sample_signal         ;
+    sa.sa_flags     = SA_SIGINFO | SA_RESTART ;
+    sigemptyset(&sa.sa_mask) ;
+    sigaction(SIGPROF, &sa, NULL) ;
+    
+    struct sigevent sev ;
+    
+    memset(&sev, 0, sizeof(sev)) ;
+    sev.sigev_notify          = SIGEV_SIGNAL ;
+    sev.sigev_signo           = SIGPROF      ;
+    sev.sigev_value.sival_ptr = us           ;
+    
+    if (0 != timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &sampler->timer)) {
+      fprintf(stderr, "error: cannot create the host timer: %s\n", strerror(errno)) ;
+      us->sampler = NULL ;
+      us_sched_cancel(us, sampler->id) ;
+      fclose(sampler->fp) ;
+      free(sampler) ;
+      return 1 ;
+    }
+    
+    struct itimerspec ts ;
+    u64_t             ns_per_tick = (1000000000 < hz) ? 1 : 1000000000 / hz ;
+    
+    ts.it_interval.tv_sec  = ns_per_tick / 1000000000 ;
+    ts.it_interval.tv_nsec = ns_per_tick % 1000000000 ;
+    ts.it_value            = ts.it_interval           ;
+    
+    timer_settime(sampler->timer, 0, &ts, NULL) ;
+  }
+#endif
+  
+  return 0 ;
+}
+
+void us_sample_free (
+  us_t * us
+)
+{
+  us_sampler_t * sampler = us->sampler ;
+  
+  if (NULL == sampler)
+    return ;
+
+#ifndef _WIN32
+  // delete the host timer (with its pending signal)
+  if (0 == sampler->period)
+    timer_delete(sampler->timer) ;
+#endif
+  
+  us_sched_cancel(us, sampler->id) ;
+  __sample_drain(us) ;
+  
+  if (0 != sampler->lost)
+    fprintf(stderr, "warning: %llu samples have been dropped\n", (unsigned long long)sampler->lost) ;
+  
+  fclose(sampler->fp) ;
+  free(sampler) ;
+  
+  us->sampler = NULL ;
+}
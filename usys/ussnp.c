@@ -0,0 +1,520 @@
+#ifdef __linux__
+# define _GNU_SOURCE // `memfd_create`
+#endif
+
+#include "us.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+// =============================================================================
+// Snapshots
+// -----------------------------------------------------------------------------
+// A snapshot holds the whole machine: the state of the kernel, the instruction
+// data, the last IRQ, the options, the pending interrupts and the memory. The
+// memory is aligned in the file so that it can be mapped copy-on-write like the
+// kernel of an image, and the pages filled with zeros are left as holes, so the
+// file is sparse. The events are host state: the host schedules them again
+// after a load.
+// -----------------------------------------------------------------------------
+// Layout of a snapshot (host byte order):
+//   magic number (4-byte), version (4-byte), header size (8-byte)
+//   memory size (8-byte), memory offset (8-byte)
+//   kernel, instruction data, IRQ (4-byte), ISR (1-byte), idle (1-byte),
+//   options, pending interrupts (bitmap)
+//   memory (at the memory offset)
+// Save the machine:
+//   1. merge the injected interrupts into the pending ones
+//   2. write the header and the state
+//   3. write the memory skipping the pages filled with zeros
+// Load the machine:
+//   1. map the file and check the header
+//   2. reserve the memory and map it from the file
+//   3. restore the state and flush the decoded instructions and segments
+//   4. check the pending interrupts at the current clock
+// =============================================================================
+
+enum {
+  US_SNAP_HEAD = // size of the header
+    4 + 4 + 3 * sizeof(u64_t) +
+    sizeof(us_ker_t) + sizeof(us_inst_t) + 4 + 1 + 1 + sizeof(us_opt_t) +
+    US_N_IRQS / 8 ,
+  US_SNAP_PAGE = 1 << 12 // granularity of the holes
+} ;
+
+u32_t us_snapshot_save (
+        us_t * us ,
+  const char * fn
+)
+{
+  FILE * fp = fopen(fn, "wb") ;
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the snapshot `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  // the flags are saved computed
+  us_flags(us) ;
+  
+  // the injected interrupts are saved pending (the recorder logs them instead)
+  if (NULL == us->replay)
+    __sched_inject(us) ;
+  
+  u8_t  mag_num [4] = { 0x45, 0x45, 0x5E, 0xAB } ;
+  u32_t version     = US_SNAP_VERSION ;
+  u64_t head        = US_SNAP_HEAD    ;
+  u64_t mem_size    = us->mem.size    ;
+  u64_t mem_off     = US_SNAP_ALIGN   ;
+  
+  // write the header and the state
+  
+  u64_t n = 0 ;
+  
+  n += fwrite(mag_num, sizeof(mag_num), 1, fp) ;
+  n += fwrite(&version, sizeof(version), 1, fp) ;
+  n += fwrite(&head, sizeof(head), 1, fp) ;
+  n += fwrite(&mem_size, sizeof(mem_size), 1, fp) ;
+  n += fwrite(&mem_off, sizeof(mem_off), 1, fp) ;
+  n += fwrite(&us->ker, sizeof(us->ker), 1, fp) ;
+  n += fwrite(us->inst, sizeof(us_inst_t), 1, fp) ;
+  n += fwrite(&us->IRQ, sizeof(us->IRQ), 1, fp) ;
+  n += fwrite(&us->ISR, sizeof(us->ISR), 1, fp) ;
+  n += fwrite(&us->idle, sizeof(us->idle), 1, fp) ;
+  n += fwrite(&us->opt, sizeof(us->opt), 1, fp) ;
+  n += fwrite(us->sched.pending, sizeof(us->sched.pending), 1, fp) ;
+  
+  if (12 != n) {
+    fclose(fp) ;
+    fprintf(stderr, "error: cannot write the snapshot `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  // write the memory
+  
+  static const u8_t zero [US_SNAP_PAGE] ;
+  
+  for (u64_t addr = 0 ; addr < mem_size ; addr += US_SNAP_PAGE) {
+    u64_t size = mem_size - addr < US_SNAP_PAGE ? mem_size - addr : US_SNAP_PAGE ;
+    
+    // leave a hole, but the file has to reach the end of the memory
+    if (0 == memcmp(us->mem.data + addr, zero, size) && addr + size != mem_size)
+      continue ;
+    
+    if (
+      0 != fseek(fp, mem_off + addr, SEEK_SET) ||
+      size != fwrite(us->mem.data + addr, sizeof(u8_t), size, fp)
+    ) {
+      fclose(fp) ;
+      fprintf(stderr, "error: cannot write the snapshot `%s`: %s\n", fn, strerror(errno)) ;
+      return 1 ;
+    }
+  }
+  
+  if (0 != fclose(fp)) {
+    fprintf(stderr, "error: cannot write the snapshot `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  return 0 ;
+}
+
+u32_t us_snapshot_load (
+        us_t * us ,
+  const char * fn
+)
+{
+  int    fd       ;
+  u8_t * img      ;
+  u64_t  img_size ;
+  
+  if (0 != __map_img(fn, &fd, &img, &img_size))
+    return 1 ;
+  
+  // check the header
+  
+  u32_t version  = 0 ;
+  u64_t head     = 0 ;
+  u64_t mem_size = 0 ;
+  u64_t mem_off  = 0 ;
+  
+  if (US_SNAP_HEAD <= img_size) {
+    memcpy(&version, img + 4, sizeof(u32_t)) ;
+    memcpy(&head, img + 8, sizeof(u64_t)) ;
+    memcpy(&mem_size, img + 16, sizeof(u64_t)) ;
+    memcpy(&mem_off, img + 24, sizeof(u64_t)) ;
+  }
+  
+  if (
+    US_SNAP_HEAD > img_size ||
+    0x45 != img[0] || 0x45 != img[1] || 0x5E != img[2] || 0xAB != img[3] ||
+    US_SNAP_VERSION != version || US_SNAP_HEAD != head
+  ) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: `%s` is not a snapshot of this machine\n", fn) ;
+    return 1 ;
+  }
+  
+  if (img_size < mem_off || img_size - mem_off < mem_size) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: cannot read the memory: snapshot is truncated\n") ;
+    return 1 ;
+  }
+  
+  // map the memory
+  
+  if (NULL != us->mem.map)
+    us_free(us) ;
+  
+  us->mem.size = mem_size ;
+  
+  if (0 != __alloc_mem(us, mem_size, mem_off & (__page_size() - 1))) {
+    __unmap_img(fd, img, img_size) ;
+    fprintf(stderr, "error: cannot allocate the memory: %s\n", strerror(errno)) ;
+    return 1 ;
+  }
+  
+  __map_mem(us, fd, img, mem_off, 0, mem_size) ;
+  
+  // restore the state
+  
+  u8_t * state = img + 4 + 4 + 3 * sizeof(u64_t) ;
+  
+  memcpy(&us->ker, state, sizeof(us->ker)) ;
+  state += sizeof(us->ker) ;
+  
+  memcpy(&us->spare, state, sizeof(us->spare)) ;
+  state += sizeof(us->spare) ;
+  
+  us->inst = &us->spare ;
+  
+  memcpy(&us->IRQ, state, sizeof(us->IRQ)) ;
+  state += sizeof(us->IRQ) ;
+  
+  memcpy(&us->ISR, state, sizeof(us->ISR)) ;
+  state += sizeof(us->ISR) ;
+  
+  memcpy(&us->idle, state, sizeof(us->idle)) ;
+  state += sizeof(us->idle) ;
+  
+  memcpy(&us->opt, state, sizeof(us->opt)) ;
+  state += sizeof(us->opt) ;
+  
+  memcpy(us->sched.pending, state, sizeof(us->sched.pending)) ;
+  
+  us->lazy.op = US_LAZY_NONE ;
+  
+  __unmap_img(fd, img, img_size) ;
+  
+  // clear the decoded instructions and segments
+  us_icache_flush(us) ;
+  us_stlb_flush(us) ;
+  
+  // deliver the pending interrupts at this clock
+  us->sched.next = us->ker.reg[US_REG_CLOCK] ;
+  
+  return 0 ;
+}
+
+// =============================================================================
+// Clones and Baseline
+// -----------------------------------------------------------------------------
+// The memory of a machine can be frozen into an anonymous file, so that other
+// memories can map it copy-on-write and share its pages. The pages filled with
+// zeros are not even frozen.
+// A clone is a new machine starting from the state of a running one: every
+// child maps the frozen memory of the parent and gets private copies only of
+// the written pages.
+// The baseline is a saved state of the machine to return to: while it exists,
+// the writes mark the written pages in a bitmap, so the reset copies back only
+// those pages from the frozen memory.
+// -----------------------------------------------------------------------------
+// Clone the machine:
+//   1. freeze the memory of the parent
+//   2. reserve the memory of every child and map it from the frozen memory
+//   3. copy the state and the pending interrupts and clear the decoded
+//      instructions, segments and the translated code of the children
+// Save the baseline:
+//   1. freeze the memory and save the state
+//   2. allocate the bitmap of the written pages
+// Write into the memory:
+//   1. mark the written pages in the bitmap
+// Reset to the baseline:
+//   1. copy back the written pages from the frozen memory
+//   2. restore the state
+// =============================================================================
+
+#ifdef _WIN32
+
+u32_t __freeze_mem (
+  us_t *  us  ,
+  int *   fd  ,
+  u8_t ** img
+)
+{
+  *fd  = -1 ;
+  *img = (u8_t *)malloc(us->mem.size + 1) ;
+  
+  if (NULL == *img) {
+    fprintf(stderr, "error: cannot freeze the memory: %s\n", strerror(errno)) ;
+    return 1 ;
+  }
+  
+  memcpy(*img, us->mem.data, us->mem.size) ;
+  
+  return 0 ;
+}
+
+#else
+
+int __mem_file (void)
+{
+# ifdef __linux__
+  return memfd_create("us", 0) ;
+# else
+  char fn [] = "/tmp/us.XXXXXX" ;
+  int  fd    = mkstemp(fn) ;
+  
+  if (-1 != fd)
+    unlink(fn) ;
+  
+  return fd ;
+# endif
+}
+
+u32_t __freeze_mem (
+  us_t *  us  ,
+  int *   fd  ,
+  u8_t ** img
+)
+{
+  u64_t size = us->mem.size ;
+  
+  *fd  = __mem_file() ;
+  *img = NULL ;
+  
+  if (-1 == *fd || 0 != ftruncate(*fd, size)) {
+    if (-1 != *fd)
+      close(*fd) ;
+    
+    fprintf(stderr, "error: cannot freeze the memory: %s\n", strerror(errno)) ;
+    return 1 ;
+  }
+  
+  static const u8_t zero [US_SNAP_PAGE] ;
+  
+  for (u64_t addr = 0 ; addr < size ; addr += US_SNAP_PAGE) {
+    u64_t page = size - addr < US_SNAP_PAGE ? size - addr : US_SNAP_PAGE ;
+    
+    if (0 == memcmp(us->mem.data + addr, zero, page))
+      continue ;
+    
+    if ((ssize_t)page != pwrite(*fd, us->mem.data + addr, page, addr)) {
+      close(*fd) ;
+      fprintf(stderr, "error: cannot freeze the memory: %s\n", strerror(errno)) ;
+      return 1 ;
+    }
+  }
+  
+  if (0 != size) {
+    void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, *fd, 0) ;
+    
+    if (MAP_FAILED == map) {
+      close(*fd) ;
+      fprintf(stderr, "error: cannot freeze the memory: %s\n", strerror(errno)) ;
+      return 1 ;
+    }
+    
+    *img = (u8_t *)map ;
+  }
+  
+  return 0 ;
+}
+
+#endif
+
+u32_t us_clone (
+  us_t * us    ,
+  us_t * child ,
+  u32_t  n
+)
+{
+  u64_t size = us->mem.size ;
+  
+  // the children copy the flags computed
+  us_flags(us) ;
+  
+  // freeze the memory
+  
+  int    fd  ;
+  u8_t * img ;
+  
+  if (0 != __freeze_mem(us, &fd, &img))
+    return 1 ;
+  
+  // map the memory of the children
+  
+  for (u32_t i = 0 ; i < n ; ++i) {
+    memset(child + i, 0, sizeof(us_t)) ;
+    
+    child[i].mem.size = size ;
+    
+    if (0 != __alloc_mem(child + i, size, 0)) {
+      for (u32_t j = 0 ; j < i ; ++j)
+        us_free(child + j) ;
+      
+      __unmap_img(fd, img, size) ;
+      fprintf(stderr, "error: cannot allocate the memory: %s\n", strerror(errno)) ;
+      return 1 ;
+    }
+    
+    __map_mem(child + i, fd, img, 0, 0, size) ;
+  }
+  
+  // the mappings keep the file alive
+  __unmap_img(fd, img, size) ;
+  
+  // copy the state
+  
+  for (u32_t i = 0 ; i < n ; ++i) {
+    child[i].ker   = us->ker   ;
+    child[i].spare = *us->inst ;
+    child[i].IRQ   = us->IRQ   ;
+    child[i].ISR   = us->ISR   ;
+    child[i].idle  = us->idle  ;
+    child[i].opt   = us->opt   ;
+    
+    memcpy(child[i].sched.pending, us->sched.pending, sizeof(us->sched.pending)) ;
+    
+    child[i].sched.next = child[i].ker.reg[US_REG_CLOCK] ;
+    
+    child[i].inst = &child[i].spare ;
+    
+    // the decoded data depends on the memory
+    us_icache_flush(child + i) ;
+    us_stlb_flush(child + i) ;
+  }
+  
+  return 0 ;
+}
+
+u32_t us_baseline_save (
+  us_t * us
+)
+{
+  us_baseline_free(us) ;
+  
+  // freeze the memory
+  if (0 != __freeze_mem(us, &us->base.fd, &us->base.mem))
+    return 1 ;
+  
+  // allocate the bitmap
+  
+  u64_t pages = (us->mem.size >> US_DIRTY_PAGE_BITS) + 1 ;
+  
+  us->base.dirty = (u64_t *)calloc((pages + 63) / 64, sizeof(u64_t)) ;
+  
+  if (NULL == us->base.dirty) {
+    __unmap_img(us->base.fd, us->base.mem, us->mem.size) ;
+    us->base.mem = NULL ;
+    
+    fprintf(stderr, "error: cannot allocate the dirty pages: %s\n", strerror(errno)) ;
+    return 1 ;
+  }
+  
+  // save the state (with the flags computed)
+  
+  us_flags(us) ;
+  
+  us->base.ker  = us->ker   ;
+  us->base.inst = *us->inst ;
+  us->base.IRQ  = us->IRQ   ;
+  us->base.ISR  = us->ISR   ;
+  us->base.idle = us->idle  ;
+  
+  return 0 ;
+}
+
+void us_dirty_write (
+  us_t * us   ,
+  u64_t  addr ,
+  u64_t  size
+)
+{
+  if (0 == size)
+    return ;
+  
+  u64_t first = addr >> US_DIRTY_PAGE_BITS ;
+  u64_t last  = (addr + size - 1) >> US_DIRTY_PAGE_BITS ;
+  
+  for (u64_t page = first ; page <= last ; ++page)
+    us->base.dirty[page >> 6] |= (u64_t)1 << (page & 63) ;
+}
+
+void us_reset_to_baseline (
+  us_t * us
+)
+{
+  if (NULL == us->base.dirty)
+    return ;
+  
+  u64_t words = ((us->mem.size >> US_DIRTY_PAGE_BITS) + 1 + 63) / 64 ;
+  
+  // copy back the written pages
+  
+  for (u64_t i = 0 ; i < words ; ++i) {
+    u64_t bits = us->base.dirty[i] ;
+    
+    us->base.dirty[i] = 0 ;
+    
+    while (0 != bits) {
+      u64_t page = i * 64 + __builtin_ctzll(bits) ;
+      u64_t addr = page << US_DIRTY_PAGE_BITS ;
+      u64_t size = (u64_t)1 << US_DIRTY_PAGE_BITS ;
+      
+      bits &= bits - 1 ;
+      
+      if (us->mem.size - addr < size)
+        size = us->mem.size - addr ;
+      
+      // the page can hold decoded instructions, segments or ISRs
+      us_icache_write(us, addr, size) ;
+      us_stlb_write(us, addr, size) ;
+      us_idt_write(us, addr, size) ;
+      
+      memcpy(us->mem.data + addr, us->base.mem + addr, size) ;
+    }
+  }
+  
+  // restore the state
+  
+  us->ker   = us->base.ker  ;
+  us->spare = us->base.inst ;
+  us->IRQ   = us->base.IRQ  ;
+  us->ISR   = us->base.ISR  ;
+  us->idle  = us->base.idle ;
+  
+  us->inst = &us->spare ;
+  
+  us->lazy.op = US_LAZY_NONE ;
+}
+
+void us_baseline_free (
+  us_t * us
+)
+{
+  if (NULL == us->base.dirty)
+    return ;
+  
+  __unmap_img(us->base.fd, us->base.mem, us->mem.size) ;
+  free(us->base.dirty) ;
+  
+  us->base.mem   = NULL ;
+  us->base.dirty = NULL ;
+}
@@ -0,0 +1,585 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(_US_AVX2)
+# include <immintrin.h>
+#elif defined(_US_SSE2)
+# include <emmintrin.h>
+#endif
+
+// =============================================================================
+// String Instructions
+// -----------------------------------------------------------------------------
+// A string instruction moves, stores, compares or scans one element at DATA:SI
+// (segment override allowed) and/or EXTRA:DI, then steps SI and DI by the size
+// of the element, backward if the flag D is set. With the prefix REP, it
+// repeats CX times (none if CX is zero), one clock per element; the prefix
+// 0x65 (REPE) stops `cmps` and `scas` after the first unequal element, 0x64
+// (REPNE) after the first equal one. The other instructions ignore REP.
+// The repeated elements run in bulk on the physical memory through the host
+// kernels (vectorized copy, fill and compare), when the result is the same as
+// running them one by one; if an element faults, SI, DI and CX hold the done
+// elements and the interrupt returns to the instruction.
+// -----------------------------------------------------------------------------
+// Execute a step:
+//   1. bound the elements to CX, the clocks left and the burst
+//   2. check the ranges of the elements without raising and bound `movs` to
+//      the distance of its overlapping ranges
+//   3. run the kernel over the ranges, invalidate the written range and
+//      update SI, DI and the flags; if the ranges cannot run in bulk, execute
+//      one element raising its interrupts
+//   4. account one clock per element and update CX
+//   5. leave IP at the instruction until the repetitions end, so that the
+//      interrupts and the host can stop the machine between the steps
+// =============================================================================
+
+u64_t __mismatch (
+  const u8_t * a    ,
+  const u8_t * b    ,
+        u64_t  size
+)
+{
+  u64_t i = 0 ;
+
+#if defined(_US_AVX2)
+  for ( ; i + 32 <= size ; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i)) ;
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i)) ;
+    u32_t   m = ~(u32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) ;
+    
+    if (0 != m)
+      return i + __builtin_ctz(m) ;
+  }
+#endif
+#if defined(_US_SSE2)
+  for ( ; i + 16 <= size ; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i)) ;
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i)) ;
+    u32_t   m = ~(u32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF ;
+    
+    if (0 != m)
+      return i + __builtin_ctz(m) ;
+  }
+#endif
+  
+  for ( ; i < size ; ++i) {
+    if (a[i] != b[i])
+      return i ;
+  }
+  
+  return size ;
+}
+
+u64_t __find_byte (
+  const u8_t * a    ,
+        u64_t  size ,
+        u8_t   byte ,
+        u8_t   eq
+)
+{
+  // the host `memchr` is vectorized
+  if (0 != eq) {
+    const u8_t * p = memchr(a, byte, size) ;
+    return (NULL != p) ? (u64_t)(p - a) : size ;
+  }
+  
+  u64_t i = 0 ;
+
+#if defined(_US_AVX2)
+  __m256i y32 = _mm256_set1_epi8((char)byte) ;
+  
+  for ( ; i + 32 <= size ; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i)) ;
+    u32_t   m = ~(u32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y32)) ;
+    
+    if (0 != m)
+      return i + __builtin_ctz(m) ;
+  }
+#endif
+#if defined(_US_SSE2)
+  __m128i y16 = _mm_set1_epi8((char)byte) ;
+  
+  for ( ; i + 16 <= size ; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i)) ;
+    u32_t   m = ~(u32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y16)) & 0xFFFF ;
+    
+    if (0 != m)
+      return i + __builtin_ctz(m) ;
+  }
+#endif
+  
+  for ( ; i < size ; ++i) {
+    if (a[i] != byte)
+      return i ;
+  }
+  
+  return size ;
+}
+
+u64_t __find_elem (
+  const u8_t * a      ,
+  const u8_t * b      ,
+        u64_t  b_step , // 0 to compare every element with `b`
+        u64_t  z      ,
+        u64_t  n      ,
+        u8_t   eq
+)
+{
+  // the first unequal element holds the first unequal byte
+  if (0 == eq && b_step == z)
+    return __mismatch(a, b, n * z) / z ;
+  
+  if (0 == b_step && 1 == z)
+    return __find_byte(a, n, b[0], eq) ;
+  
+  for (u64_t i = 0 ; i < n ; ++i) {
+    if ((0 == memcmp(a + i * z, b + i * b_step, z)) == (0 != eq))
+      return i ;
+  }
+  
+  return n ;
+}
+
+void __fill (
+  u8_t * dst  ,
+  u64_t  data ,
+  u64_t  z    ,
+  u64_t  n
+)
+{
+  u64_t size = n * z ;
+  
+  if (1 == z) {
+    memset(dst, (u8_t)data, size) ;
+    return ;
+  }
+  
+  // the pattern doubles at every copy
+  
+  memcpy(dst, &data, z) ;
+  
+  for (u64_t done = z ; done < size ; done *= 2)
+    memcpy(dst + done, dst, (done < size - done) ? done : size - done) ;
+}
+
+u8_t * __string_range (
+  us_t * us   ,
+  u16_t  segx ,
+  u64_t  addr , // element at the register
+  i64_t  step ,
+  u64_t  n    ,
+  u64_t  mask ,
+  u32_t  perm
+)
+{
+  u64_t z    = (0 < step) ? (u64_t)step : (u64_t)-step ;
+  u64_t size = n * z ;
+  u64_t lo   = addr ;
+  
+  // the range cannot wrap around the address size
+  
+  if (step < 0) {
+    if (addr < (n - 1) * z)
+      return NULL ;
+    
+    lo = addr - (n - 1) * z ;
+  } else if (mask - addr < size - 1)
+    return NULL ;
+  
+  if (US_N_IRQS != __check_addr(us, segx, &lo, &size, perm) || n * z != size)
+    return NULL ;
+  
+  // the devices are accessed one element at a time
+  if (__on_bus(us, lo, size))
+    return NULL ;
+  
+  return us->mem.data + lo ;
+}
+
+u64_t __string_bulk (
+  us_t * us   ,
+  u32_t  op   ,
+  i64_t  step ,
+  u64_t  mask ,
+  u64_t  n    ,
+  u8_t * stop
+)
+{
+  u64_t z  = us->inst->oprd_size ;
+  u64_t SI = us->ker.reg[US_REG_SI] & mask ;
+  u64_t DI = us->ker.reg[US_REG_DI] & mask ;
+  u64_t AX = us->ker.reg[US_REG_AX] ;
+  
+  // compare and scan search forward only
+  if (step < 0 && (US_STR_CMPS == op || US_STR_SCAS == op))
+    return 0 ;
+  
+  // check the ranges
+  
+  u8_t * src = NULL ;
+  u8_t * dst = NULL ;
+  
+  if (US_STR_MOVS == op || US_STR_CMPS == op) {
+    src = __string_range(us, us->inst->segx, SI, step, n, mask, US_SEG_PERM_R) ;
+    
+    if (NULL == src)
+      return 0 ;
+  }
+  
+  dst = __string_range(
+    us, us->ker.seg[US_SEG_EXTRA], DI, step, n, mask,
+    (US_STR_MOVS == op || US_STR_STOS == op) ? US_SEG_PERM_W : US_SEG_PERM_R
+  ) ;
+  
+  if (NULL == dst)
+    return 0 ;
+  
+  // the elements at the registers
+  
+  if (step < 0) {
+    src += (NULL != src) ? (n - 1) * z : 0 ;
+    dst += (n - 1) * z ;
+  }
+  
+  switch (op) {
+  case US_STR_MOVS : {
+    // an element cannot read what the previous ones have written
+    
+    u64_t d = (0 < step) ? (u64_t)(dst - src) : (u64_t)(src - dst) ;
+    
+    if (0 < d && d < n * z) {
+      n = d / z ;
+      
+      if (0 == n)
+        return 0 ;
+    }
+    
+    u8_t * lo_src = (0 < step) ? src : src - (n - 1) * z ;
+    u8_t * lo_dst = (0 < step) ? dst : dst - (n - 1) * z ;
+    
+    __mark_write(us, (u64_t)(lo_dst - us->mem.data), n * z) ;
+    memmove(lo_dst, lo_src, n * z) ;
+  } break ;
+  
+  case US_STR_STOS : {
+    u8_t * lo_dst = (0 < step) ? dst : dst - (n - 1) * z ;
+    
+    __mark_write(us, (u64_t)(lo_dst - us->mem.data), n * z) ;
+    __fill(lo_dst, AX, z, n) ;
+  } break ;
+  
+  case US_STR_CMPS :
+  case US_STR_SCAS : {
+    // run up to the element that stops the repetitions
+    
+    u64_t i = (US_STR_CMPS == op) ?
+      __find_elem(src, dst, z, z, n, !us->inst->REP_cc) :
+      __find_elem(dst, (u8_t *)&AX, 0, z, n, !us->inst->REP_cc) ;
+    
+    if (i < n) {
+      *stop = 1 ;
+      n = i + 1 ;
+    }
+    
+    // the flags of the last element
+    
+    u64_t a = 0 ;
+    u64_t b = 0 ;
+    
+    if (US_STR_CMPS == op)
+      memcpy(&a, src + (n - 1) * z, z) ;
+    else
+      memcpy(&a, &AX, z) ;
+    
+    memcpy(&b, dst + (n - 1) * z, z) ;
+    
+    us->lazy.op   = US_LAZY_SUB ;
+    us->lazy.size = z ;
+    us->lazy.a    = a ;
+    us->lazy.b    = b ;
+  } break ;
+  }
+  
+  // count the accesses of the elements
+  
+  if (US_STR_MOVS == op || US_STR_CMPS == op)
+    __prof_mem(us, us->inst->segx, 0, n) ;
+  
+  __prof_mem(us, us->ker.seg[US_SEG_EXTRA], US_STR_MOVS == op || US_STR_STOS == op, n) ;
+  
+  // trace the ranges of the elements
+  
+  if (NULL != us->tracer) {
+    u64_t lo = (0 < step) ? 0 : (n - 1) * z ;
+    
+    if (NULL != src)
+      __trace_mem(us, us->inst->segx, 0, (u64_t)(src - us->mem.data) - lo, n * z) ;
+    
+    __trace_mem(
+      us, us->ker.seg[US_SEG_EXTRA], US_STR_MOVS == op || US_STR_STOS == op,
+      (u64_t)(dst - us->mem.data) - lo, n * z
+    ) ;
+  }
+  
+  // step the registers
+  
+  if (US_STR_MOVS == op || US_STR_CMPS == op)
+    us->ker.reg[US_REG_SI] = (SI + n * step) & mask ;
+  
+  us->ker.reg[US_REG_DI] = (DI + n * step) & mask ;
+  
+  return n ;
+}
+
+u32_t __string_elem (
+  us_t * us   ,
+  u32_t  op   ,
+  i64_t  step ,
+  u64_t  mask ,
+  u8_t * stop
+)
+{
+  u64_t z  = us->inst->oprd_size ;
+  u64_t SI = us->ker.reg[US_REG_SI] & mask ;
+  u64_t DI = us->ker.reg[US_REG_DI] & mask ;
+  
+  u64_t a = 0 ;
+  u64_t b = 0 ;
+  
+  // source
+  
+  if (US_STR_MOVS == op || US_STR_CMPS == op) {
+    if (US_N_IRQS != us_read(us, us->inst->segx, SI, z, &a))
+      return us->IRQ ;
+  } else
+    memcpy(&a, us->ker.reg + US_REG_AX, z) ;
+  
+  // destination
+  
+  if (US_STR_MOVS == op || US_STR_STOS == op) {
+    if (US_N_IRQS != us_write(us, us->ker.seg[US_SEG_EXTRA], DI, z, &a))
+      return us->IRQ ;
+  } else {
+    if (US_N_IRQS != us_read(us, us->ker.seg[US_SEG_EXTRA], DI, z, &b))
+      return us->IRQ ;
+    
+    us->lazy.op   = US_LAZY_SUB ;
+    us->lazy.size = z ;
+    us->lazy.a    = a ;
+    us->lazy.b    = b ;
+    
+    *stop = (a == b) != (0 != us->inst->REP_cc) ;
+  }
+  
+  // step the registers
+  
+  if (US_STR_MOVS == op || US_STR_CMPS == op)
+    us->ker.reg[US_REG_SI] = (SI + step) & mask ;
+  
+  us->ker.reg[US_REG_DI] = (DI + step) & mask ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __string (
+  us_t * us ,
+  u32_t  op
+)
+{
+  u64_t z    = us->inst->oprd_size ;
+  u64_t mask = (8 == us->inst->addr_size) ? (u64_t)-1 : 0xFFFFFFFF ;
+  i64_t step = (0 != (us->ker.reg[US_REG_FLAGS] & US_FLAG_D)) ? -(i64_t)z : (i64_t)z ;
+  u8_t  stop = 0 ;
+  
+  if (0 == us->inst->has_REP) {
+    if (US_N_IRQS != __string_elem(us, op, step, mask, &stop))
+      return us->IRQ ;
+    
+    us->ker.reg[US_REG_IP] += us->inst->cp ;
+    return US_N_IRQS ;
+  }
+  
+  // no repetitions
+  
+  if (0 == us->ker.reg[US_REG_CX]) {
+    us->ker.reg[US_REG_IP] += us->inst->cp ;
+    return US_N_IRQS ;
+  }
+  
+  // bound the elements
+  
+  u64_t n    = us->ker.reg[US_REG_CX] ;
+  u64_t left = us->limit - us->ker.reg[US_REG_CLOCK] ;
+  
+  if (left < n)
+    n = left ;
+  
+  if (US_REP_BURST < n)
+    n = US_REP_BURST ;
+  
+  if (0 == n)
+    n = 1 ;
+  
+  n = __string_bulk(us, op, step, mask, n, &stop) ;
+  
+  if (0 == n) {
+    // one element, raising its interrupts
+    if (US_N_IRQS != __string_elem(us, op, step, mask, &stop))
+      return us->IRQ ;
+    
+    n = 1 ;
+  }
+  
+  // one clock per element (the last one is counted by the clock)
+  
+  us->ker.reg[US_REG_CLOCK] += n - 1 ;
+  us->ker.reg[US_REG_CX]    -= n     ;
+  
+  if (0 == us->ker.reg[US_REG_CX] || 0 != stop)
+    us->ker.reg[US_REG_IP] += us->inst->cp ;
+  
+  return US_N_IRQS ;
+}
+
+// =============================================================================
+// Block Instructions
+// -----------------------------------------------------------------------------
+// A block instruction copies, fills, compares or scans the CX bytes at
+// DATA:SI (segment override allowed) and/or EXTRA:DI in one clock, leaving
+// SI, DI and CX unchanged:
+//   bcopy | copy DATA:SI to EXTRA:DI (as `memmove`, the blocks can overlap)
+//   bfill | fill EXTRA:DI with AL
+//   bcmp  | compare DATA:SI with EXTRA:DI, AX is the offset of the first
+//         | unequal byte (CX if none), the flags are those of `cmp` between
+//         | the unequal bytes (Z if the blocks are equal)
+//   bscan | search AL in EXTRA:DI, AX is the offset of the first equal byte
+//         | (CX if none), the flags are those of `cmp AX, CX` (Z if missing)
+// The blocks are checked against the permissions and the bounds of their
+// segments as a whole, and cannot hold a device with a callback (an empty
+// block is never checked); if the check fails, nothing is written and the
+// interrupt returns to the instruction.
+// -----------------------------------------------------------------------------
+// Execute:
+//   1. convert the blocks into physical ranges
+//   2. (only writing) invalidate the decoded data and mark the dirty pages
+//   3. run the host kernel over the ranges and set AX and the flags
+// =============================================================================
+
+u32_t __block_range (
+  us_t *  us   ,
+  u16_t   segx ,
+  u64_t   addr ,
+  u64_t   size ,
+  u32_t   perm ,
+  u8_t ** data
+)
+{
+  // an empty block accesses nothing
+  if (0 == size) {
+    *data = us->mem.data ;
+    return US_N_IRQS ;
+  }
+  
+  // the block cannot wrap around the address space
+  if (addr + size < addr)
+    return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+  
+  u64_t n = size ;
+  
+  if (US_N_IRQS != __convert_addr(us, segx, &addr, &n, perm))
+    return us->IRQ ;
+  
+  if (n != size) // resized by the bounds
+    return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+  
+  // the devices with a callback are accessed one element at a time
+  if (
+    __on_bus(us, addr, size) &&
+    US_N_IRQS != __bus_bulk(us, addr, size, US_SEG_PERM_W == perm)
+  )
+    return us_int(us, US_IRQ_SEGMENT_FAULT) ;
+  
+  __prof_mem(us, segx, US_SEG_PERM_W == perm, 1) ;
+  __trace_mem(us, segx, US_SEG_PERM_W == perm, addr, size) ;
+  
+  *data = us->mem.data + addr ;
+  
+  return US_N_IRQS ;
+}
+
+u32_t __block (
+  us_t * us ,
+  u32_t  op
+)
+{
+  u64_t mask = (8 == us->inst->addr_size) ? (u64_t)-1 : 0xFFFFFFFF ;
+  u64_t SI   = us->ker.reg[US_REG_SI] & mask ;
+  u64_t DI   = us->ker.reg[US_REG_DI] & mask ;
+  u64_t size = us->ker.reg[US_REG_CX] & mask ;
+  u8_t  AL   = (u8_t)us->ker.reg[US_REG_AX] ;
+  
+  // convert the blocks
+  
+  u8_t * src = NULL ;
+  u8_t * dst = NULL ;
+  
+  if (US_BLK_COPY == op || US_BLK_CMP == op) {
+    if (
+      US_N_IRQS != __block_range(
+        us, us->inst->segx, SI, size, US_SEG_PERM_R, &src
+      )
+    )
+      return us->IRQ ;
+  }
+  
+  if (
+    US_N_IRQS != __block_range(
+      us, us->ker.seg[US_SEG_EXTRA], DI, size,
+      (US_BLK_COPY == op || US_BLK_FILL == op) ? US_SEG_PERM_W : US_SEG_PERM_R,
+      &dst
+    )
+  )
+    return us->IRQ ;
+  
+  // run the kernel
+  
+  switch (op) {
+  case US_BLK_COPY :
+    __mark_write(us, (u64_t)(dst - us->mem.data), size) ;
+    memmove(dst, src, size) ;
+    break ;
+  
+  case US_BLK_FILL :
+    __mark_write(us, (u64_t)(dst - us->mem.data), size) ;
+    memset(dst, AL, size) ;
+    break ;
+  
+  case US_BLK_CMP : {
+    u64_t i = __mismatch(src, dst, size) ;
+    
+    us->ker.reg[US_REG_AX] = i ;
+    
+    us->lazy.op   = US_LAZY_SUB ;
+    us->lazy.size = sizeof(u8_t) ;
+    us->lazy.a    = (i < size) ? src[i] : 0 ;
+    us->lazy.b    = (i < size) ? dst[i] : 0 ;
+  } break ;
+  
+  case US_BLK_SCAN : {
+    u64_t i = __find_byte(dst, size, AL, 1) ;
+    
+    us->ker.reg[US_REG_AX] = i ;
+    
+    us->lazy.op   = US_LAZY_SUB ;
+    us->lazy.size = sizeof(u64_t) ;
+    us->lazy.a    = i    ;
+    us->lazy.b    = size ;
+  } break ;
+  }
+  
+  us->ker.reg[US_REG_IP] += us->inst->cp ;
+  
+  return US_N_IRQS ;
+}
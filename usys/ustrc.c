@@ -0,0 +1,643 @@
+#include "us.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// =============================================================================
+// Trace
+// -----------------------------------------------------------------------------
+// The trace records every instruction, every access of the memory and every
+// interrupt as a fixed record of 16 bytes (see `us_trace_rec_t`), unlike the
+// text of `--verbose`. IP is the delta from the last instruction, the address
+// is the delta from the last access and the clock is implicit: it follows the
+// last instruction, unless a record `US_TRACE_CLOCK` moves it. The machine
+// fills a buffer of records, then hands it over to a writer thread that
+// compresses it (optionally) and writes it, so the machine waits only when all
+// the buffers are full. The instructions are traced by the interpreter, so the
+// translated code is not run while the trace is enabled.
+// -----------------------------------------------------------------------------
+// Layout of a trace (host byte order):
+//   magic number (4-byte), version (4-byte), flags (4-byte), record size
+//   (4-byte)
+//   blocks: raw size (4-byte), stored size (4-byte), records (stored as they
+//   are if the sizes are equal, otherwise compressed)
+// The compression is LZ77 on sequences (as LZ4): a token with the literals
+// (high nibble) and the match length minus 4 (low nibble), the lengths of 15
+// continue on the next bytes (up to a byte other than 255), the literals, the
+// offset of the match (2-byte); the last sequence has only literals.
+// -----------------------------------------------------------------------------
+// Trace a record:
+//   1. compute the delta from the last value of its kind
+//   2. append the record to the buffer, hand the buffer over if it is full
+// Run the writer:
+//   1. wait for a full buffer (or the end)
+//   2. compress the buffer and write the block
+//   3. release the buffer to the machine
+// Dump a trace (CSV, `clock,kind,segx,addr,value`):
+//   1. check the header
+//   2. read, decompress and decode the blocks
+// =============================================================================
+
+enum {
+  US_TRACE_RAW  = US_TRACE_RECS * 16                     , // raw size of a block
+  US_TRACE_PACK = US_TRACE_RAW + US_TRACE_RAW / 255 + 16 , // bound of a block
+  US_TRACE_HASH = 1 << 14                                , // hash table entries
+  US_TRACE_LZ   = 1 << 0                                   // compressed blocks
+} ;
+
+static const u8_t __trace_mag [4] = { 0x45, 0x45, 0x7C, 0xAE } ;
+
+u8_t * __lz_len (
+  u8_t * pc ,
+  u64_t  n
+)
+{
+  // the rest of a length of 15 or more
+  
+  for (; 255 <= n ; n -= 255)
+    *pc++ = 255 ;
+  
+  *pc++ = n ;
+  
+  return pc ;
+}
+
+u32_t __lz_pack (
+  const u8_t *  src  ,
+        u32_t   n    ,
+        u8_t *  dst  ,
+        u32_t * hash
+)
+{
+  u8_t * pc     = dst ;
+  u32_t  anchor = 0   ;
+  u32_t  i      = 0   ;
+  
+  memset(hash, 0, US_TRACE_HASH * sizeof(u32_t)) ;
+  
+  // no match starts in the last 12 bytes
+  
+  while (i + 12 <= n) {
+    u32_t seq ;
+    u32_t ref ;
+    
+    memcpy(&seq, src + i, sizeof(seq)) ;
+    
+    u32_t * entry = hash + ((seq * 2654435761u) >> 18) ;
+    u32_t   pos   = *entry ;
+    
+    *entry = i ;
+    
+    memcpy(&ref, src + pos, sizeof(ref)) ;
+    
+    if (pos == i || 65535 < i - pos || ref != seq) {
+      ++i ;
+      continue ;
+    }
+    
+    // extend the match up to the last 5 bytes
+    
+    u32_t len = 4 ;
+    
+    while (i + len + 5 < n && src[pos + len] == src[i + len])
+      ++len ;
+    
+    // write the sequence
+    
+    u32_t lit = i - anchor ;
+    u8_t * tk = pc++ ;
+    
+    *tk = ((15 < lit) ? 15 : lit) << 4 | ((15 < len - 4) ? 15 : len - 4) ;
+    
+    if (15 <= lit)
+      pc = __lz_len(pc, lit - 15) ;
+    
+    memcpy(pc, src + anchor, lit) ;
+    pc += lit ;
+    
+    u16_t off = i - pos ;
+    
+    memcpy(pc, &off, sizeof(off)) ;
+    pc += sizeof(off) ;
+    
+    if (15 <= len - 4)
+      pc = __lz_len(pc, len - 4 - 15) ;
+    
+    i     += len ;
+    anchor = i   ;
+  }
+  
+  // write the last literals
+  
+  u32_t lit = n - anchor ;
+  
+  *pc++ = ((15 < lit) ? 15 : lit) << 4 ;
+  
+  if (15 <= lit)
+    pc = __lz_len(pc, lit - 15) ;
+  
+  memcpy(pc, src + anchor, lit) ;
+  pc += lit ;
+  
+  return pc - dst ;
+}
+
+u32_t __lz_unpack (
+  const u8_t * src ,
+        u32_t  n   ,
+        u8_t * dst ,
+        u32_t  max
+)
+{
+  const u8_t * end = src + n ;
+        u8_t * pc  = dst     ;
+  
+  while (src < end) {
+    u8_t  tk  = *src++  ;
+    u64_t lit = tk >> 4 ;
+    
+    if (15 == lit) {
+      do {
+        if (end <= src)
+          return (u32_t)-1 ;
+        
+        lit += *src ;
+      } while (255 == *src++) ;
+    }
+    
+    if ((u64_t)(end - src) < lit || (u64_t)(dst + max - pc) < lit)
+      return (u32_t)-1 ;
+    
+    memcpy(pc, src, lit) ;
+    pc  += lit ;
+    src += lit ;
+    
+    // the last sequence
+    if (end == src)
+      break ;
+    
+    u16_t off ;
+    
+    if (end - src < 2)
+      return (u32_t)-1 ;
+    
+    memcpy(&off, src, sizeof(off)) ;
+    src += sizeof(off) ;
+    
+    u64_t len = (tk & 15) + 4 ;
+    
+    if (19 == len) {
+      do {
+        if (end <= src)
+          return (u32_t)-1 ;
+        
+        len += *src ;
+      } while (255 == *src++) ;
+    }
+    
+    if (0 == off || (u64_t)(pc - dst) < off || (u64_t)(dst + max - pc) < len)
+      return (u32_t)-1 ;
+    
+    // the match can overlap the bytes being copied
+    
+    for (u64_t i = 0 ; i < len ; ++i, ++pc)
+      *pc = *(pc - off) ;
+  }
+  
+  return pc - dst ;
+}
+
+void __trace_write (
+  us_tracer_t * tracer ,
+  u32_t         i
+)
+{
+  u32_t  raw  = tracer->n[i] * sizeof(us_trace_rec_t) ;
+  u32_t  size = raw ;
+  u8_t * data = (u8_t *)tracer->buf[i] ;
+  
+  // store the block as it is if it does not shrink
+  
+  if (0 != tracer->lz) {
+    size = __lz_pack(data, raw, tracer->pack, tracer->hash) ;
+    
+    if (size < raw)
+      data = tracer->pack ;
+    else
+      size = raw ;
+  }
+  
+  fwrite(&raw, sizeof(raw), 1, tracer->fp) ;
+  fwrite(&size, sizeof(size), 1, tracer->fp) ;
+  fwrite(data, size, 1, tracer->fp) ;
+  
+  tracer->recs  += tracer->n[i] ;
+  tracer->bytes += 2 * sizeof(u32_t) + size ;
+}
+
+#ifndef _WIN32
+void * __trace_writer (
+  void * arg
+)
+{
+  us_tracer_t * tracer = (us_tracer_t *)arg ;
+  
+  for (;;) {
+    // wait for a full buffer
+    
+    pthread_mutex_lock(&tracer->lock) ;
+    
+    while (tracer->tail == tracer->head && 0 == tracer->done)
+      pthread_cond_wait(&tracer->cond, &tracer->lock) ;
+    
+    if (tracer->tail == tracer->head) {
+      pthread_mutex_unlock(&tracer->lock) ;
+      break ;
+    }
+    
+    pthread_mutex_unlock(&tracer->lock) ;
+    
+    __trace_write(tracer, tracer->tail % US_TRACE_BUFS) ;
+    
+    // release the buffer
+    
+    pthread_mutex_lock(&tracer->lock) ;
+    ++tracer->tail ;
+    pthread_cond_broadcast(&tracer->cond) ;
+    pthread_mutex_unlock(&tracer->lock) ;
+  }
+  
+  return NULL ;
+}
+#endif
+
+void __trace_flush (
+  us_tracer_t * tracer
+)
+{
+  u32_t i = tracer->head % US_TRACE_BUFS ;
+  
+  tracer->n[i] = tracer->i ;
+  tracer->i    = 0         ;
+
+#ifdef _WIN32
+  __trace_write(tracer, i) ;
+#else
+  // hand the buffer over and wait for the next one
+  
+  pthread_mutex_lock(&tracer->lock) ;
+  
+  ++tracer->head ;
+  pthread_cond_broadcast(&tracer->cond) ;
+  
+  while (US_TRACE_BUFS <= tracer->head - tracer->tail)
+    pthread_cond_wait(&tracer->cond, &tracer->lock) ;
+  
+  pthread_mutex_unlock(&tracer->lock) ;
+  
+  i = tracer->head % US_TRACE_BUFS ;
+#endif
+  
+  tracer->rec = tracer->buf[i] ;
+}
+
+static inline void __trace_put (
+  us_tracer_t * tracer ,
+  u8_t          kind   ,
+  u8_t          n      ,
+  u16_t         segx   ,
+  u32_t         arg    ,
+  u64_t         delta
+)
+{
+  us_trace_rec_t * rec = tracer->rec + tracer->i ;
+  
+  rec->kind  = kind  ;
+  rec->n     = n     ;
+  rec->segx  = segx  ;
+  rec->arg   = arg   ;
+  rec->delta = delta ;
+  
+  if (US_TRACE_RECS == ++tracer->i)
+    __trace_flush(tracer) ;
+}
+
+void __trace_inst (
+  us_t * us
+)
+{
+  us_tracer_t * tracer = us->tracer ;
+  
+  u64_t clock = us->ker.reg[US_REG_CLOCK] ;
+  u64_t IP    = us->ker.reg[US_REG_IP]    ;
+  
+  // the clock does not follow the last instruction (an interrupt, a restore)
+  if (clock != tracer->next)
+    __trace_put(tracer, US_TRACE_CLOCK, 0, 0, 0, clock - tracer->next) ;
+  
+  __trace_put(
+    tracer, US_TRACE_INST, (0xF0 == us->inst->op[0]) ? 2 : 1,
+    us->ker.seg[US_SEG_CODE], us->inst->op[0] | us->inst->op[1] << 8,
+    IP - tracer->IP
+  ) ;
+  
+  tracer->IP   = IP        ;
+  tracer->next = clock + 1 ;
+}
+
+void __trace_rec (
+  us_t * us   ,
+  u32_t  kind ,
+  u16_t  segx ,
+  u64_t  arg  ,
+  u64_t  addr
+)
+{
+  us_tracer_t * tracer = us->tracer ;
+  
+  if (US_TRACE_IRQ == kind) {
+    // the clock of the interrupt from the next instruction
+    __trace_put(tracer, kind, 0, segx, arg, us->ker.reg[US_REG_CLOCK] - tracer->next) ;
+    return ;
+  }
+  
+  // the size of a block is clamped to 32 bits
+  __trace_put(
+    tracer, kind, 0, segx, (0xFFFFFFFF < arg) ? 0xFFFFFFFF : arg,
+    addr - tracer->addr
+  ) ;
+  
+  tracer->addr = addr ;
+}
+
+u32_t us_trace_init (
+        us_t * us ,
+  const char * fn ,
+        u8_t   lz
+)
+{
+  // open the file and allocate the buffers
+  
+  us_tracer_t * tracer = (us_tracer_t *)calloc(1, sizeof(us_tracer_t)) ;
+  
+  if (NULL == tracer) {
+    fprintf(stderr, "error: cannot allocate the trace\n") ;
+    return 1 ;
+  }
+  
+  u8_t failed = 0 ;
+  
+  for (u32_t i = 0 ; i < US_TRACE_BUFS ; ++i) {
+    tracer->buf[i] = (us_trace_rec_t *)malloc(US_TRACE_RAW) ;
+    failed |= NULL == tracer->buf[i] ;
+  }
+  
+  if (0 != lz) {
+    tracer->pack = (u8_t *)malloc(US_TRACE_PACK) ;
+    tracer->hash = (u32_t *)malloc(US_TRACE_HASH * sizeof(u32_t)) ;
+    failed |= NULL == tracer->pack || NULL == tracer->hash ;
+  }
+  
+  if (0 != failed) {
+    fprintf(stderr, "error: cannot allocate the trace\n") ;
+  } else {
+    tracer->fp = fopen(fn, "wb") ;
+    
+    if (NULL == tracer->fp) {
+      fprintf(stderr, "error: cannot open the trace `%s`: %s\n", fn, strerror(errno)) ;
+      failed = 1 ;
+    }
+  }
+  
+  if (0 != failed) {
+    for (u32_t i = 0 ; i < US_TRACE_BUFS ; ++i)
+      free(tracer->buf[i]) ;
+    
+    free(tracer->pack) ;
+    free(tracer->hash) ;
+    free(tracer) ;
+    
+    return 1 ;
+  }
+  
+  tracer->lz  = lz             ;
+  tracer->rec = tracer->buf[0] ;
+  
+  // write the header
+  
+  u32_t version = US_TRACE_VERSION              ;
+  u32_t flags   = (0 != lz) ? US_TRACE_LZ : 0   ;
+  u32_t size    = sizeof(us_trace_rec_t)        ;
+  
+  fwrite(__trace_mag, sizeof(__trace_mag), 1, tracer->fp) ;
+  fwrite(&version, sizeof(version), 1, tracer->fp) ;
+  fwrite(&flags, sizeof(flags), 1, tracer->fp) ;
+  fwrite(&size, sizeof(size), 1, tracer->fp) ;
+
+#ifndef _WIN32
+  // start the writer
+  
+  pthread_mutex_init(&tracer->lock, NULL) ;
+  pthread_cond_init(&tracer->cond, NULL) ;
+  
+  if (0 != pthread_create(&tracer->thread, NULL, __trace_writer, tracer)) {
+    fprintf(stderr, "error: cannot start the writer of the trace\n") ;
+    
+    pthread_cond_destroy(&tracer->cond) ;
+    pthread_mutex_destroy(&tracer->lock) ;
+    fclose(tracer->fp) ;
+    remove(fn) ;
+    
+    for (u32_t i = 0 ; i < US_TRACE_BUFS ; ++i)
+      free(tracer->buf[i]) ;
+    
+    free(tracer->pack) ;
+    free(tracer->hash) ;
+    free(tracer) ;
+    
+    return 1 ;
+  }
+#endif
+  
+  us->tracer = tracer ;
+  
+  return 0 ;
+}
+
+void us_trace_free (
+  us_t * us
+)
+{
+  us_tracer_t * tracer = us->tracer ;
+  
+  if (NULL == tracer)
+    return ;
+  
+  // hand the last buffer over
+  if (0 != tracer->i)
+    __trace_flush(tracer) ;
+
+#ifndef _WIN32
+  // stop the writer once the buffers are written
+  
+  pthread_mutex_lock(&tracer->lock) ;
+  tracer->done = 1 ;
+  pthread_cond_broadcast(&tracer->cond) ;
+  pthread_mutex_unlock(&tracer->lock) ;
+  
+  pthread_join(tracer->thread, NULL) ;
+  
+  pthread_cond_destroy(&tracer->cond) ;
+  pthread_mutex_destroy(&tracer->lock) ;
+#endif
+  
+  if (0 != fclose(tracer->fp))
+    fprintf(stderr, "error: cannot write the trace: %s\n", strerror(errno)) ;
+  
+  for (u32_t i = 0 ; i < US_TRACE_BUFS ; ++i)
+    free(tracer->buf[i]) ;
+  
+  free(tracer->pack) ;
+  free(tracer->hash) ;
+  free(tracer) ;
+  
+  us->tracer = NULL ;
+}
+
+u32_t us_trace_dump (
+  const char * fn ,
+        FILE * out
+)
+{
+  FILE * fp = fopen(fn, "rb") ;
+  
+  if (NULL == fp) {
+    fprintf(stderr, "error: cannot open the trace `%s`: %s\n", fn, strerror(errno)) ;
+    return 1 ;
+  }
+  
+  // check the header
+  
+  u8_t  mag_num [4] ;
+  u32_t version     ;
+  u32_t flags       ;
+  u32_t size        ;
+  
+  u64_t n = 0 ;
+  
+  n += fread(mag_num, sizeof(mag_num), 1, fp) ;
+  n += fread(&version, sizeof(version), 1, fp) ;
+  n += fread(&flags, sizeof(flags), 1, fp) ;
+  n += fread(&size, sizeof(size), 1, fp) ;
+  
+  if (
+    4 != n || 0 != memcmp(mag_num, __trace_mag, sizeof(mag_num)) ||
+    US_TRACE_VERSION != version || sizeof(us_trace_rec_t) != size
+  ) {
+    fprintf(stderr, "error: `%s` is not a trace\n", fn) ;
+    fclose(fp) ;
+    return 1 ;
+  }
+  
+  u8_t * raw  = (u8_t *)malloc(US_TRACE_RAW)  ;
+  u8_t * pack = (u8_t *)malloc(US_TRACE_PACK) ;
+  
+  if (NULL == raw || NULL == pack) {
+    fprintf(stderr, "error: cannot allocate the blocks of the trace\n") ;
+    free(raw) ;
+    free(pack) ;
+    fclose(fp) ;
+    return 1 ;
+  }
+  
+  // decode the blocks
+  
+  static const char * kind [] = { "clock", "inst", "read", "write", "irq" } ;
+  
+  u64_t IP    = 0 ;
+  u64_t addr  = 0 ;
+  u64_t next  = 0 ;
+  u32_t error = 0 ;
+  
+  fprintf(out, "clock,kind,segx,addr,value\n") ;
+  
+  for (;;) {
+    u32_t head [2] ; // raw size, stored size
+    
+    if (1 != fread(head, sizeof(head), 1, fp))
+      break ;
+    
+    if (
+      US_TRACE_RAW < head[0] || US_TRACE_PACK < head[1] ||
+      0 != head[0] % sizeof(us_trace_rec_t) ||
+      1 != fread(pack, head[1], 1, fp) || (
+        head[0] != head[1] &&
+        head[0] != __lz_unpack(pack, head[1], raw, US_TRACE_RAW)
+      )
+    ) {
+      fprintf(stderr, "error: the trace `%s` is corrupted\n", fn) ;
+      error = 1 ;
+      break ;
+    }
+    
+    if (head[0] == head[1])
+      memcpy(raw, pack, head[0]) ;
+    
+    for (u32_t i = 0 ; i < head[0] ; i += sizeof(us_trace_rec_t)) {
+      us_trace_rec_t rec ;
+      
+      memcpy(&rec, raw + i, sizeof(rec)) ;
+      
+      switch (rec.kind) {
+      case US_TRACE_CLOCK :
+        next += rec.delta ;
+        break ;
+      
+      case US_TRACE_INST :
+        IP += rec.delta ;
+        
+        fprintf(
+          out, "%llu,inst,%04X,%012llX,%02X",
+          (unsigned long long)next, rec.segx, (unsigned long long)IP, rec.arg & 0xFF
+        ) ;
+        
+        if (2 == rec.n)
+          fprintf(out, " %02X", rec.arg >> 8) ;
+        
+        fprintf(out, "\n") ;
+        
+        ++next ;
+        break ;
+      
+      case US_TRACE_READ  :
+      case US_TRACE_WRITE :
+        addr += rec.delta ;
+        
+        // the accesses of the last instruction
+        fprintf(
+          out, "%llu,%s,%04X,%012llX,%u\n",
+          (unsigned long long)(next - 1), kind[rec.kind], rec.segx,
+          (unsigned long long)addr, rec.arg
+        ) ;
+        break ;
+      
+      case US_TRACE_IRQ :
+        fprintf(
+          out, "%llu,irq,,,%02X\n",
+          (unsigned long long)(next + rec.delta), rec.arg
+        ) ;
+        break ;
+      
+      default :
+        break ;
+      }
+    }
+  }
+  
+  free(raw) ;
+  free(pack) ;
+  fclose(fp) ;
+  
+  return error ;
+}
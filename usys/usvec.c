@@ -0,0 +1,158 @@
+#include "us.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(_US_SSSE3)
+# include <tmmintrin.h>
+#elif defined(_US_SSE2)
+# include <emmintrin.h>
+#endif
+
+// =============================================================================
+// Vector Extension
+// -----------------------------------------------------------------------------
+// The vector registers V0-V7 hold 128-bit of packed integers. The instructions
+// are 2-byte operation codes with the ModRM byte: `reg` selects the vector
+// register destination (or source of `vst`), `rm` another vector register or
+// 128-bit in memory (DATA segment, override allowed).
+//   0xF0 10+e | vadd   V, V/m128 | add the elements
+//   0xF0 14+e | vsub   V, V/m128 | subtract the elements
+//   0xF0 18+e | vmul   V, V/m128 | multiply the elements (low half)
+//   0xF0 1C+e | vcmpeq V, V/m128 | all ones where the elements are equal
+//   0xF0 20+e | vcmpgt V, V/m128 | all ones where greater (signed)
+//   0xF0 24   | vshuf  V, V/m128 | pick the bytes of V by the indices in
+//             |                  | V/m128 (zero if the bit 7 is set)
+//   0xF0 28   | vld    V, V/m128 | load
+//   0xF0 29   | vst    V/m128, V | store
+//   0xF0 2A   | vmovq  V, r/m64  | zero extend into V
+//   0xF0 2B   | vmovq  r/m64, V  | lower 64-bit of V
+// where `e` is the size of the elements (0, 1, 2, 3 -> 8, 16, 32, 64-bit).
+// The operations run through the host SIMD (SSE2 and SSSE3) and fall back to
+// the scalar code for the elements without a host instruction.
+// -----------------------------------------------------------------------------
+// Execute:
+//   1. compute the effective address and read the source operand
+//   2. run the host SIMD operation, if any, otherwise the scalar one
+//   3. write the destination operand
+// =============================================================================
+
+#if defined(_US_SSE2)
+
+u32_t __vec_simd (
+        u8_t   op ,
+        u8_t * a  ,
+  const u8_t * b
+)
+{
+  __m128i x = _mm_loadu_si128((const __m128i *)a) ;
+  __m128i y = _mm_loadu_si128((const __m128i *)b) ;
+  __m128i r ;
+  
+  switch (op) {
+  case US_VEC_ADD + 0   : r = _mm_add_epi8(x, y)      ; break ;
+  case US_VEC_ADD + 1   : r = _mm_add_epi16(x, y)     ; break ;
+  case US_VEC_ADD + 2   : r = _mm_add_epi32(x, y)     ; break ;
+  case US_VEC_ADD + 3   : r = _mm_add_epi64(x, y)     ; break ;
+  case US_VEC_SUB + 0   : r = _mm_sub_epi8(x, y)      ; break ;
+  case US_VEC_SUB + 1   : r = _mm_sub_epi16(x, y)     ; break ;
+  case US_VEC_SUB + 2   : r = _mm_sub_epi32(x, y)     ; break ;
+  case US_VEC_SUB + 3   : r = _mm_sub_epi64(x, y)     ; break ;
+  case US_VEC_CMPEQ + 0 : r = _mm_cmpeq_epi8(x, y)    ; break ;
+  case US_VEC_CMPEQ + 1 : r = _mm_cmpeq_epi16(x, y)   ; break ;
+  case US_VEC_CMPEQ + 2 : r = _mm_cmpeq_epi32(x, y)   ; break ;
+  case US_VEC_CMPGT + 0 : r = _mm_cmpgt_epi8(x, y)    ; break ;
+  case US_VEC_CMPGT + 1 : r = _mm_cmpgt_epi16(x, y)   ; break ;
+  case US_VEC_CMPGT + 2 : r = _mm_cmpgt_epi32(x, y)   ; break ;
+  case US_VEC_MUL + 1   : r = _mm_mullo_epi16(x, y)   ; break ;
+  
+  case US_VEC_MUL + 0 : {
+    // even and odd bytes multiplied as 16-bit
+    __m128i even = _mm_mullo_epi16(x, y) ;
+    __m128i odd  = _mm_mullo_epi16(_mm_srli_epi16(x, 8), _mm_srli_epi16(y, 8)) ;
+    
+    r = _mm_or_si128(
+      _mm_and_si128(even, _mm_set1_epi16(0xFF)), _mm_slli_epi16(odd, 8)
+    ) ;
+  } break ;
+  
+  case US_VEC_MUL + 2 : {
+    // even and odd elements multiplied as 64-bit
+    __m128i even = _mm_mul_epu32(x, y) ;
+    __m128i odd  = _mm_mul_epu32(_mm_srli_si128(x, 4), _mm_srli_si128(y, 4)) ;
+    
+    r = _mm_unpacklo_epi32(
+      _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+      _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))
+    ) ;
+  } break ;
+
+#if defined(_US_SSSE3)
+  case US_VEC_SHUF : r = _mm_shuffle_epi8(x, y) ; break ;
+#endif
+  
+  default : // no host instruction
+    return 1 ;
+  }
+  
+  _mm_storeu_si128((__m128i *)a, r) ;
+  
+  return 0 ;
+}
+
+#endif
+
+void __vec_scalar (
+        u8_t   op ,
+        u8_t * a  ,
+  const u8_t * b
+)
+{
+  if (US_VEC_SHUF == op) {
+    u8_t t [US_VEC_SIZE] ;
+    
+    for (int i = 0 ; i < US_VEC_SIZE ; ++i)
+      t[i] = (0 != (b[i] & 0x80)) ? 0 : a[b[i] & (US_VEC_SIZE - 1)] ;
+    
+    memcpy(a, t, sizeof(t)) ;
+    return ;
+  }
+  
+  u64_t size  = (u64_t)1 << (op & 3) ;
+  u64_t shift = 64 - 8 * size ;
+  
+  for (u64_t i = 0 ; i < US_VEC_SIZE ; i += size) {
+    u64_t x = 0 ;
+    u64_t y = 0 ;
+    u64_t r = 0 ;
+    
+    memcpy(&x, a + i, size) ;
+    memcpy(&y, b + i, size) ;
+    
+    switch (op & ~3) {
+    case US_VEC_ADD   : r = x + y ; break ;
+    case US_VEC_SUB   : r = x - y ; break ;
+    case US_VEC_MUL   : r = x * y ; break ;
+    case US_VEC_CMPEQ : r = (x == y) ? (u64_t)-1 : 0 ; break ;
+    case US_VEC_CMPGT : // sign extend the elements
+      r = ((i64_t)(x << shift) > (i64_t)(y << shift)) ? (u64_t)-1 : 0 ;
+      break ;
+    }
+    
+    memcpy(a + i, &r, size) ;
+  }
+}
+
+void __vec_alu (
+        u8_t   op ,
+        u8_t * a  ,
+  const u8_t * b
+)
+{
+#if defined(_US_SSE2)
+  if (0 == __vec_simd(op, a, b))
+    return ;
+#endif
+  
+  __vec_scalar(op, a, b) ;
+}